@@ -0,0 +1,112 @@
+#include "libbfv.h"
+
+namespace cpu {
+    using namespace seal;
+
+    Aggregator::Aggregator(ServerContext &bfv, size_t n_shards) :
+        bfv(bfv), shards(std::max<size_t>(n_shards, 1))
+    {
+    }
+
+    Aggregator::Shard &Aggregator::acquire(std::unique_lock<std::mutex> &lock) {
+        const size_t start = next_shard.fetch_add(1, std::memory_order_relaxed);
+        for (size_t i = 0; i < shards.size(); ++i) {
+            Shard &shard = shards[(start + i) % shards.size()];
+            lock = std::unique_lock<std::mutex>(shard.mutex, std::try_to_lock);
+            if (lock.owns_lock())
+                return shard;
+        }
+
+        // Every shard is busy, wait for the first one tried
+        Shard &shard = shards[start % shards.size()];
+        lock = std::unique_lock<std::mutex>(shard.mutex);
+        return shard;
+    }
+
+    void Aggregator::accumulate(const Ciphertext &ciphertext, size_t count) {
+        std::unique_lock<std::mutex> lock;
+        Shard &shard = acquire(lock);
+        if (shard.count == 0)
+            shard.sum = ciphertext;
+        else
+            bfv.evaluator.add_inplace(shard.sum, ciphertext);
+        shard.count += count;
+    }
+
+    void Aggregator::add(const Ciphertext &ciphertext) {
+        accumulate(ciphertext, 1);
+    }
+
+    void Aggregator::add(const std::vector<Ciphertext> &batch) {
+        if (batch.empty())
+            return;
+        if (batch.size() == 1) {
+            accumulate(batch[0], 1);
+            return;
+        }
+
+        HE_TRACE_STAGE("aggregate");
+        Ciphertext sum;
+        bfv.evaluator.add_many(batch, sum);
+        accumulate(sum, batch.size());
+    }
+
+    size_t Aggregator::count() {
+        size_t total = 0;
+        for (auto &shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            total += shard.count;
+        }
+        return total;
+    }
+
+    size_t Aggregator::snapshot(Ciphertext &result) {
+        HE_TRACE_STAGE("aggregate");
+        // Copy the running sums and their counts, holding each lock only for the copy
+        std::vector<Ciphertext> sums;
+        sums.reserve(shards.size());
+        size_t total = 0;
+        for (auto &shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            if (shard.count > 0) {
+                sums.push_back(shard.sum);
+                total += shard.count;
+            }
+        }
+
+        if (sums.empty()) {
+            bfv.encryptor.encrypt_zero(result);
+            return 0;
+        }
+
+        // Pairwise tree reduction, every level is summed in parallel
+        while (sums.size() > 1) {
+            std::vector<Ciphertext> merged((sums.size() + 1) / 2);
+            scheduler().parallel_for_each(merged.begin(), merged.end(), [&](Ciphertext &sum) {
+                size_t i = &sum - &merged[0];
+                if (2 * i + 1 < sums.size())
+                    bfv.evaluator.add(sums[2 * i], sums[2 * i + 1], sum);
+                else
+                    sum = std::move(sums[2 * i]);
+            });
+            sums = std::move(merged);
+        }
+        result = std::move(sums[0]);
+        return total;
+    }
+
+    void Aggregator::reset() {
+        for (auto &shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.sum = Ciphertext();
+            shard.count = 0;
+        }
+    }
+
+    void Aggregator::restore(const Ciphertext &sum, size_t count) {
+        reset();
+        std::lock_guard<std::mutex> lock(shards[0].mutex);
+        shards[0].sum = sum;
+        shards[0].count = count;
+    }
+}
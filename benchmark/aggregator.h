@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+
+#include "bfv.h"
+
+namespace cpu {
+    /*
+        Streaming sum of user ciphertexts.
+        Ciphertexts are added one at a time or in batches, from any number of producer
+        threads, and folded into one of several running sums (shards) each guarded by its
+        own mutex, so memory does not depend on the number of users and producers rarely
+        wait on each other. A snapshot merges the shards with a parallel tree reduction and
+        leaves the running sums untouched, so ingestion can continue afterwards.
+    */
+    class Aggregator {
+        struct Shard {
+            std::mutex mutex;
+            seal::Ciphertext sum;
+            size_t count = 0;
+        };
+
+        ServerContext &bfv;
+        std::vector<Shard> shards;
+        std::atomic<size_t> next_shard { 0 };
+
+        // Locks the first free shard, starting from a different one on every call
+        Shard &acquire(std::unique_lock<std::mutex> &lock);
+        void accumulate(const seal::Ciphertext &ciphertext, size_t count);
+    public:
+        // One shard per hardware thread by default
+        explicit Aggregator(ServerContext &bfv, size_t n_shards = std::thread::hardware_concurrency());
+
+        void add(const seal::Ciphertext &ciphertext);
+
+        // Sums the batch before touching any shard, so the batch only takes one lock
+        void add(const std::vector<seal::Ciphertext> &batch);
+
+        // Number of ciphertexts added so far
+        size_t count();
+
+        // Sum of every ciphertext added so far, an encryption of zero if there are none. Returns the
+        // number of ciphertexts in result, read under the same shard locks as their sums
+        size_t snapshot(seal::Ciphertext &result);
+
+        void reset();
+
+        // Replaces the running sums with sum, of count ciphertexts, as when resuming from a snapshot
+        void restore(const seal::Ciphertext &sum, size_t count);
+    };
+}
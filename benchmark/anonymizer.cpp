@@ -0,0 +1,312 @@
+#include "libbfv.h"
+
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <vector>
+
+/*
+    Anonymizer service daemon.
+        ./anonymizer.out [--address=<path or tcp:port>] [--parms=<name>] [--method=range|range_prod|univariate|bounded] [--k=<k>]
+                         [--io-threads=<n>] [--aggregate-threads=<n>] [--respond-threads=<n>] [--queue=<n>] [--epoch-ms=<ms>]
+                         [--threads=<n>] [--layout=<path> | --compact-window=<slots>] [--keys=<path> [--snapshot=<path>]]
+    runs the server until SIGINT or SIGTERM, with the keys of a server key bundle if given (its parameters
+    replace --parms), or keys generated at startup, whose secret key is dropped once they are generated.
+    With a snapshot, the aggregate is saved every epoch and on stop, and a restarted server resumes from
+    it; it needs the keys of a bundle, since the aggregate can only be read with the keys it was made with.
+        ./anonymizer.out --write-keys=<prefix> [--parms=<name>] [--layout=<path> | --compact-window=<slots>]
+    generates the keys once, writing the server bundle to <prefix>.server.keys and the secret key of the
+    clients to <prefix>.client.keys, and
+        ./anonymizer.out --load=<users> [--address=...] [--clients=<n>] [--queries=<n>] [--compact]
+    runs a load generator against a running server and reports request latency and throughput.
+        ./anonymizer.out --query=<prefix>.client.keys [--address=...] [--compact] < slots
+    encrypts the slot values read from standard input with the keys of a client bundle, submits
+    and queries them, and prints the decrypted response on standard output, one line of slot values.
+    Compact queries are served with the rotation window of the slot layouts written by
+    main.out --write-layout, or an explicit window; the load generator needs one of 4096 slots.
+*/
+
+using Clock = std::chrono::steady_clock;
+
+// Latency percentiles in milliseconds, latencies are sorted in place
+void print_latencies(const std::string &name, std::vector<double> &latencies, double seconds) {
+    if (latencies.empty())
+        return;
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) {
+        return latencies[std::min(latencies.size() - 1, size_t(p * latencies.size()))];
+    };
+    std::cout << name << ": " << latencies.size() << " requests in " << seconds << " s, "
+              << latencies.size() / seconds << " requests/s, latency p50 " << percentile(0.5) << " ms, p95 "
+              << percentile(0.95) << " ms, p99 " << percentile(0.99) << " ms, max " << latencies.back() << " ms" << std::endl;
+}
+
+// Runs requests 0 to count - 1 on n_clients threads and returns their latencies in milliseconds
+template <typename F>
+std::vector<double> run_clients(size_t count, size_t n_clients, F request) {
+    std::vector<double> latencies(count);
+    std::atomic<size_t> next { 0 };
+    std::vector<std::thread> clients;
+    for (size_t c = 0; c < n_clients; ++c) {
+        clients.emplace_back([&] {
+            for (size_t i = next++; i < count; i = next++) {
+                auto begin = Clock::now();
+                request(i);
+                latencies[i] = std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+            }
+        });
+    }
+    for (auto &client : clients)
+        client.join();
+    return latencies;
+}
+
+int run_load(const std::string &address, size_t users, size_t n_clients, size_t n_queries, bool compact) {
+    cpu::AnonymizerClient client(address);
+    seal::EncryptionParameters parms;
+    std::vector<seal::seal_byte> key_bytes;
+    client.get_keys(parms, key_bytes);
+
+    seal::SEALContext context(parms);
+    seal::PublicKey public_key;
+    public_key.load(context, key_bytes.data(), key_bytes.size());
+    seal::Encryptor encryptor(context, public_key);
+    seal::BatchEncoder batch_encoder(context);
+
+    // Encrypt up front, so that the measured latencies only cover the service
+    std::cout << "Encrypting " << users << " user vectors" << std::endl;
+    auto data = generate_locations(users);
+    std::vector<seal::Ciphertext> enc_data(users);
+    cpu::scheduler().parallel_for(0, users, [&](size_t i) {
+        seal::Plaintext ptx;
+        cpu::encode_locations(batch_encoder, data, i, ptx);
+        encryptor.encrypt(ptx, enc_data[i]);
+    });
+
+    auto begin = Clock::now();
+    auto submit_latencies = run_clients(users, n_clients, [&](size_t i) {
+        client.submit(enc_data[i]);
+    });
+    print_latencies("submit", submit_latencies, std::chrono::duration<double>(Clock::now() - begin).count());
+
+    // The first queries fail until the server has computed the mask of its first epoch
+    std::atomic<size_t> retries { 0 };
+    begin = Clock::now();
+    auto query_latencies = run_clients(n_queries, n_clients, [&](size_t i) {
+        seal::Ciphertext result;
+        while (true) {
+            try {
+                if (compact)
+                    client.query_compact(context, enc_data[i % users], result);
+                else
+                    client.query(context, enc_data[i % users], result);
+                return;
+            } catch (const std::runtime_error &e) {
+                if (++retries > 100 * n_queries)
+                    throw;
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+        }
+    });
+    print_latencies(compact ? "query_compact" : "query", query_latencies, std::chrono::duration<double>(Clock::now() - begin).count());
+    if (retries > 0)
+        std::cout << "Queries retried " << retries << " times while waiting for the first mask" << std::endl;
+
+    std::cout << "Server stats:" << std::endl << client.stats();
+    return 0;
+}
+
+// Submits and queries the location vector of one user, for the Python client which has no SEAL binding
+int run_query(const std::string &address, const std::string &keys_path, bool compact) {
+    auto bfv = cpu::load_client_context(keys_path);
+    std::vector<uint64_t> slots;
+    uint64_t value;
+    while (std::cin >> value)
+        slots.push_back(value);
+    if (!std::cin.eof() || slots.size() > bfv->batch_encoder.slot_count()) {
+        std::cerr << "Expected at most " << bfv->batch_encoder.slot_count() << " unsigned integer slot values on standard input" << std::endl;
+        return -1;
+    }
+    slots.resize(bfv->batch_encoder.slot_count(), 0);
+
+    seal::Plaintext ptx;
+    seal::Ciphertext user, result;
+    bfv->batch_encoder.encode(slots, ptx);
+    bfv->encryptor.encrypt(ptx, user);
+
+    cpu::AnonymizerClient client(address);
+    std::cerr << "Submitted, " << client.submit(user) << " users so far" << std::endl;
+
+    // As in run_load, queries fail until the server has computed the mask of its first epoch
+    for (size_t retries = 0; ; ++retries) {
+        try {
+            if (compact)
+                client.query_compact(bfv->context, user, result);
+            else
+                client.query(bfv->context, user, result);
+            break;
+        } catch (const std::runtime_error &e) {
+            if (retries == 600) {
+                std::cerr << e.what() << std::endl;
+                return -1;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+
+    bfv->decryptor.decrypt(result, ptx);
+    bfv->batch_encoder.decode(ptx, slots);
+    for (size_t i = 0; i < slots.size(); ++i)
+        std::cout << (i > 0 ? " " : "") << slots[i];
+    std::cout << std::endl;
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    std::vector<std::string> args(argv + 1, argv + argc);
+    cpu::ServerOptions options;
+    const ParameterSet *parameter_set = &DEFAULT_PARAMETER_SET;
+    size_t load_users = 0, n_clients = 8, n_queries = 100;
+    bool compact = false;
+    std::string keys_path, write_keys_prefix, query_keys_path;
+
+    for (const std::string &arg : args) {
+        auto value = [&](const std::string &prefix) {
+            return arg.substr(prefix.size());
+        };
+        if (arg.rfind("--address=", 0) == 0) {
+            options.address = value("--address=");
+        } else if (arg.rfind("--parms=", 0) == 0) {
+            std::string name = value("--parms=");
+            auto it = std::find_if(PARAMETER_SETS.begin(), PARAMETER_SETS.end(), [&](const ParameterSet &set) {
+                return name == set.name;
+            });
+            if (it == PARAMETER_SETS.end()) {
+                std::cout << "Unknown parameter set: " << name << std::endl;
+                return -1;
+            }
+            parameter_set = &(*it);
+        } else if (arg.rfind("--method=", 0) == 0) {
+            std::string method = value("--method=");
+            if (method == "range") {
+                options.method = cpu::Comparison::range;
+            } else if (method == "range_prod") {
+                options.method = cpu::Comparison::range_prod;
+            } else if (method == "univariate") {
+                options.method = cpu::Comparison::univariate;
+            } else if (method == "bounded") {
+                options.method = cpu::Comparison::bounded;
+            } else {
+                std::cout << "Unknown comparison method: " << method << std::endl;
+                return -1;
+            }
+        } else if (arg.rfind("--k=", 0) == 0) {
+            options.k = std::stoull(value("--k="));
+        } else if (arg.rfind("--io-threads=", 0) == 0) {
+            options.io_threads = std::stoul(value("--io-threads="));
+        } else if (arg.rfind("--aggregate-threads=", 0) == 0) {
+            options.aggregate_threads = std::stoul(value("--aggregate-threads="));
+        } else if (arg.rfind("--respond-threads=", 0) == 0) {
+            options.respond_threads = std::stoul(value("--respond-threads="));
+        } else if (arg.rfind("--queue=", 0) == 0) {
+            options.queue_capacity = std::stoul(value("--queue="));
+        } else if (arg.rfind("--epoch-ms=", 0) == 0) {
+            options.epoch_interval = std::chrono::milliseconds(std::stoul(value("--epoch-ms=")));
+        } else if (arg.rfind("--threads=", 0) == 0) {
+            cpu::set_scheduler_threads(std::stoul(value("--threads=")));
+        } else if (arg.rfind("--layout=", 0) == 0) {
+            options.compact_window = 1;
+            for (const auto &layout : load_slot_layouts(value("--layout=")))
+                options.compact_window = std::max(options.compact_window, layout.rotation_window());
+        } else if (arg.rfind("--compact-window=", 0) == 0) {
+            options.compact_window = std::stoul(value("--compact-window="));
+        } else if (arg.rfind("--keys=", 0) == 0) {
+            keys_path = value("--keys=");
+        } else if (arg.rfind("--snapshot=", 0) == 0) {
+            options.snapshot_path = value("--snapshot=");
+        } else if (arg.rfind("--write-keys=", 0) == 0) {
+            write_keys_prefix = value("--write-keys=");
+        } else if (arg.rfind("--query=", 0) == 0) {
+            query_keys_path = value("--query=");
+        } else if (arg == "--compact") {
+            compact = true;
+        } else if (arg.rfind("--load=", 0) == 0) {
+            load_users = std::stoul(value("--load="));
+        } else if (arg.rfind("--clients=", 0) == 0) {
+            n_clients = std::stoul(value("--clients="));
+        } else if (arg.rfind("--queries=", 0) == 0) {
+            n_queries = std::stoul(value("--queries="));
+        } else {
+            std::cout << "Unknown option: " << arg << std::endl;
+            return -1;
+        }
+    }
+
+    if (load_users > 0)
+        return run_load(options.address, load_users, n_clients, n_queries, compact);
+    if (!query_keys_path.empty()) {
+        try {
+            return run_query(options.address, query_keys_path, compact);
+        } catch (const std::runtime_error &e) {
+            std::cerr << e.what() << std::endl;
+            return -1;
+        }
+    }
+    if (!options.snapshot_path.empty() && keys_path.empty()) {
+        std::cout << "--snapshot needs --keys, keys generated at startup could not read the aggregate of a previous run" << std::endl;
+        return -1;
+    }
+
+    auto parms = cpu::get_parameters(*parameter_set);
+    auto generate_keys = [&] {
+        auto bfv = std::make_unique<cpu::BFVContext>(parms);
+        if (options.compact_window > 1)
+            bfv->keygen.create_galois_keys(cpu::rotation_steps(options.compact_window, bfv->batch_encoder.slot_count()), bfv->galois_keys);
+        return bfv;
+    };
+    if (!write_keys_prefix.empty()) {
+        auto bfv = generate_keys();
+        cpu::save_server_keys(write_keys_prefix + ".server.keys", *bfv);
+        cpu::save_client_keys(write_keys_prefix + ".client.keys", *bfv);
+        std::cout << "Wrote the keys of parameters " << parameter_set->name << " to " << write_keys_prefix << ".server.keys and "
+                  << write_keys_prefix << ".client.keys" << std::endl;
+        return 0;
+    }
+
+    // Block the signals before any thread starts, so that only sigwait receives them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    std::unique_ptr<cpu::ServerContext> bfv;
+    std::string parameters_name = parameter_set->name;
+    if (!keys_path.empty()) {
+        bfv = cpu::load_server_context(keys_path);
+        parameters_name = "of " + keys_path;
+    } else {
+        auto generated = generate_keys();
+        bfv = std::make_unique<cpu::ServerContext>(generated->context, cpu::ServerKeys {
+            generated->public_key, std::move(generated->relin_keys), std::move(generated->galois_keys) });
+    }
+    std::unique_ptr<cpu::CoefficientTable> coefficients;
+    if (options.method == cpu::Comparison::univariate)
+        coefficients = std::make_unique<cpu::CoefficientTable>(cpu::load_univ_poly_coefficients(bfv->parms.plain_modulus().value()));
+
+    cpu::Server server(*bfv, options, coefficients.get());
+    try {
+        server.start();
+    } catch (const std::runtime_error &e) {
+        std::cout << e.what() << std::endl;
+        return -1;
+    }
+    std::cout << "Listening on " << options.address << " with parameters " << parameters_name << std::endl;
+
+    int signal;
+    sigwait(&signals, &signal);
+    std::cout << "Stopping" << std::endl;
+    server.stop();
+    std::cout << server.stats();
+    return 0;
+}
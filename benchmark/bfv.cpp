@@ -1,4 +1,4 @@
-#include "bfv.h"
+#include "libbfv.h"
 
 // namespace seal {
 //     bool operator==(const Ciphertext& ctx1, const Ciphertext& ctx2) {
@@ -10,124 +10,528 @@ namespace cpu {
     using namespace seal;
 
     // Constructors
-    cpu::BFVContext::BFVContext(const seal::EncryptionParameters &parms) : 
-        parms(parms), context(parms), 
-        keygen(context), 
-        secret_key(keygen.secret_key()), 
-        encryptor(context, secret_key), 
-        evaluator(context), 
-        decryptor(context, secret_key), 
-        batch_encoder(context) 
+    namespace {
+        // Checked before the encryptor is created with the public key
+        ServerKeys &validated(const SEALContext &context, ServerKeys &keys) {
+            if (!is_valid_for(keys.public_key, context))
+                throw std::invalid_argument("ServerContext: the public key is not valid for the encryption parameters");
+            if (keys.relin_keys.size() > 0 && !is_valid_for(keys.relin_keys, context))
+                throw std::invalid_argument("ServerContext: the relinearization keys are not valid for the encryption parameters");
+            if (keys.galois_keys.size() > 0 && !is_valid_for(keys.galois_keys, context))
+                throw std::invalid_argument("ServerContext: the Galois keys are not valid for the encryption parameters");
+            return keys;
+        }
+
+        ServerKeys create_server_keys(const SEALContext &context, const SecretKey &secret_key) {
+            KeyGenerator keygen(context, secret_key);
+            ServerKeys keys;
+            keygen.create_public_key(keys.public_key);
+            keygen.create_relin_keys(keys.relin_keys);
+            return keys;
+        }
+    }
+
+    cpu::ServerContext::ServerContext(const SEALContext &context, ServerKeys keys) :
+        parms(context.key_context_data()->parms()), context(context),
+        public_key(std::move(validated(context, keys).public_key)),
+        relin_keys(std::move(keys.relin_keys)),
+        galois_keys(std::move(keys.galois_keys)),
+        encryptor(this->context, public_key),
+        evaluator(this->context),
+        batch_encoder(this->context)
+    {
+    }
+
+    bool cpu::ServerContext::has_galois_keys(const std::vector<int> &steps) const {
+        auto galois_tool = context.key_context_data()->galois_tool();
+        return std::all_of(steps.begin(), steps.end(), [&](int step) {
+            return galois_keys.has_key(galois_tool->get_elt_from_step(step));
+        });
+    }
+
+    bool cpu::ServerContext::create_galois_keys(const std::vector<int> &, GaloisKeys &) {
+        return false;
+    }
+
+    bool cpu::ServerContext::has_secret_key() const {
+        return false;
+    }
+
+    int cpu::ServerContext::noise_budget(const Ciphertext &) {
+        throw std::logic_error("ServerContext::noise_budget: the server has no secret key");
+    }
+
+    cpu::BFVContext::BFVContext(const EncryptionParameters &parms) :
+        BFVContext(SEALContext(parms))
+    {
+    }
+
+    cpu::BFVContext::BFVContext(const SEALContext &context) :
+        BFVContext(context, KeyGenerator(context).secret_key())
+    {
+    }
+
+    cpu::BFVContext::BFVContext(const SEALContext &context, const SecretKey &secret_key) :
+        BFVContext(context, secret_key, create_server_keys(context, secret_key))
+    {
+    }
+
+    cpu::BFVContext::BFVContext(const SEALContext &context, const SecretKey &secret_key, ServerKeys keys) :
+        ServerContext(context, std::move(keys)),
+        keygen(this->context, secret_key),
+        secret_key(secret_key),
+        decryptor(this->context, secret_key)
     {
-        keygen.create_public_key(this->public_key);
-        keygen.create_relin_keys(this->relin_keys);
-        this->encryptor.set_public_key(this->public_key);
+        this->encryptor.set_secret_key(secret_key);
+    }
+
+    bool cpu::BFVContext::create_galois_keys(const std::vector<int> &steps, GaloisKeys &destination) {
+        keygen.create_galois_keys(steps, destination);
+        return true;
+    }
+
+    bool cpu::BFVContext::has_secret_key() const {
+        return true;
+    }
+
+    int cpu::BFVContext::noise_budget(const Ciphertext &x) {
+        return decryptor.invariant_noise_budget(x);
+    }
+
+    const Plaintext &cpu::ServerContext::constant(int64_t value) {
+        const int64_t p = parms.plain_modulus().value();
+        const uint64_t key = ((value % p) + p) % p;
+        {
+            std::shared_lock<std::shared_mutex> lock(constants_mutex);
+            auto it = constants.find(key);
+            if (it != constants.end())
+                return it->second;
+        }
+
+        // Plaintext(std::string) parses a hexadecimal polynomial, so the decimal value
+        // is written into the constant coefficient directly.
+        Plaintext ptx(1);
+        ptx[0] = key;
+
+        // std::map never invalidates references to existing elements on insertion
+        std::unique_lock<std::shared_mutex> lock(constants_mutex);
+        return constants.emplace(key, std::move(ptx)).first->second;
+    }
+
+    void cpu::ServerContext::warm_constants(int64_t first, int64_t last) {
+        for (int64_t value = first; value <= last; ++value)
+            constant(value);
+    }
+
+    void OpCounters::reset() {
+        multiplications = 0;
+        plain_multiplications = 0;
+        relinearizations = 0;
+        mod_switches = 0;
+        rotations = 0;
+    }
+
+    OpCounters &op_counters() {
+        static OpCounters counters;
+        return counters;
+    }
+
+    void CountingEvaluator::multiply_inplace(Ciphertext &encrypted1, const Ciphertext &encrypted2, MemoryPoolHandle pool) const {
+        HE_TRACE_OP("multiply");
+        op_counters().multiplications.fetch_add(1, std::memory_order_relaxed);
+        Evaluator::multiply_inplace(encrypted1, encrypted2, pool);
+    }
+
+    void CountingEvaluator::multiply(const Ciphertext &encrypted1, const Ciphertext &encrypted2, Ciphertext &destination, MemoryPoolHandle pool) const {
+        HE_TRACE_OP("multiply");
+        op_counters().multiplications.fetch_add(1, std::memory_order_relaxed);
+        Evaluator::multiply(encrypted1, encrypted2, destination, pool);
+    }
+
+    void CountingEvaluator::square_inplace(Ciphertext &encrypted, MemoryPoolHandle pool) const {
+        HE_TRACE_OP("square");
+        op_counters().multiplications.fetch_add(1, std::memory_order_relaxed);
+        Evaluator::square_inplace(encrypted, pool);
+    }
+
+    void CountingEvaluator::square(const Ciphertext &encrypted, Ciphertext &destination, MemoryPoolHandle pool) const {
+        HE_TRACE_OP("square");
+        op_counters().multiplications.fetch_add(1, std::memory_order_relaxed);
+        Evaluator::square(encrypted, destination, pool);
+    }
+
+    void CountingEvaluator::multiply_plain_inplace(Ciphertext &encrypted, const Plaintext &plain, MemoryPoolHandle pool) const {
+        HE_TRACE_OP("multiply_plain");
+        op_counters().plain_multiplications.fetch_add(1, std::memory_order_relaxed);
+        Evaluator::multiply_plain_inplace(encrypted, plain, pool);
+    }
+
+    void CountingEvaluator::multiply_plain(const Ciphertext &encrypted, const Plaintext &plain, Ciphertext &destination, MemoryPoolHandle pool) const {
+        HE_TRACE_OP("multiply_plain");
+        op_counters().plain_multiplications.fetch_add(1, std::memory_order_relaxed);
+        Evaluator::multiply_plain(encrypted, plain, destination, pool);
+    }
+
+    void CountingEvaluator::relinearize_inplace(Ciphertext &encrypted, const RelinKeys &relin_keys, MemoryPoolHandle pool) const {
+        HE_TRACE_OP("relinearize");
+        if (encrypted.size() > 2)
+            op_counters().relinearizations.fetch_add(1, std::memory_order_relaxed);
+        Evaluator::relinearize_inplace(encrypted, relin_keys, pool);
+    }
+
+    void CountingEvaluator::mod_switch_to_next_inplace(Ciphertext &encrypted, MemoryPoolHandle pool) const {
+        HE_TRACE_OP("mod_switch");
+        op_counters().mod_switches.fetch_add(1, std::memory_order_relaxed);
+        Evaluator::mod_switch_to_next_inplace(encrypted, pool);
+    }
+
+    void CountingEvaluator::mod_switch_to_inplace(Ciphertext &encrypted, parms_id_type parms_id, MemoryPoolHandle pool) const {
+        HE_TRACE_OP("mod_switch");
+        size_t before = encrypted.coeff_modulus_size();
+        Evaluator::mod_switch_to_inplace(encrypted, parms_id, pool);
+        op_counters().mod_switches.fetch_add(before - encrypted.coeff_modulus_size(), std::memory_order_relaxed);
+    }
+
+    void CountingEvaluator::mod_switch_to(const Ciphertext &encrypted, parms_id_type parms_id, Ciphertext &destination, MemoryPoolHandle pool) const {
+        HE_TRACE_OP("mod_switch");
+        Evaluator::mod_switch_to(encrypted, parms_id, destination, pool);
+        op_counters().mod_switches.fetch_add(encrypted.coeff_modulus_size() - destination.coeff_modulus_size(), std::memory_order_relaxed);
+    }
+
+    void CountingEvaluator::add_plain_inplace(Ciphertext &encrypted, const Plaintext &plain, MemoryPoolHandle pool) const {
+        HE_TRACE_OP("add_plain");
+        Evaluator::add_plain_inplace(encrypted, plain, pool);
+    }
+
+    void CountingEvaluator::add_plain(const Ciphertext &encrypted, const Plaintext &plain, Ciphertext &destination, MemoryPoolHandle pool) const {
+        HE_TRACE_OP("add_plain");
+        Evaluator::add_plain(encrypted, plain, destination, pool);
+    }
+
+    void CountingEvaluator::sub_plain_inplace(Ciphertext &encrypted, const Plaintext &plain, MemoryPoolHandle pool) const {
+        HE_TRACE_OP("sub_plain");
+        Evaluator::sub_plain_inplace(encrypted, plain, pool);
+    }
+
+    void CountingEvaluator::sub_plain(const Ciphertext &encrypted, const Plaintext &plain, Ciphertext &destination, MemoryPoolHandle pool) const {
+        HE_TRACE_OP("sub_plain");
+        Evaluator::sub_plain(encrypted, plain, destination, pool);
+    }
+
+    void CountingEvaluator::rotate_rows_inplace(Ciphertext &encrypted, int steps, const GaloisKeys &galois_keys, MemoryPoolHandle pool) const {
+        HE_TRACE_OP("rotate");
+        op_counters().rotations.fetch_add(1, std::memory_order_relaxed);
+        Evaluator::rotate_rows_inplace(encrypted, steps, galois_keys, pool);
+    }
+
+    void CountingEvaluator::rotate_columns_inplace(Ciphertext &encrypted, const GaloisKeys &galois_keys, MemoryPoolHandle pool) const {
+        HE_TRACE_OP("rotate");
+        op_counters().rotations.fetch_add(1, std::memory_order_relaxed);
+        Evaluator::rotate_columns_inplace(encrypted, galois_keys, pool);
+    }
+
+    void TracingEncryptor::encrypt(const Plaintext &plain, Ciphertext &destination, MemoryPoolHandle pool) const {
+        HE_TRACE_OP("encrypt");
+        Encryptor::encrypt(plain, destination, pool);
+    }
+
+    void TracingEncryptor::encrypt_zero(Ciphertext &destination, MemoryPoolHandle pool) const {
+        HE_TRACE_OP("encrypt");
+        Encryptor::encrypt_zero(destination, pool);
+    }
+
+    void TracingBatchEncoder::encode(const std::vector<std::uint64_t> &values, Plaintext &destination) const {
+        HE_TRACE_OP("encode");
+        BatchEncoder::encode(values, destination);
+    }
+
+    void TracingBatchEncoder::encode(const std::vector<std::int64_t> &values, Plaintext &destination) const {
+        HE_TRACE_OP("encode");
+        BatchEncoder::encode(values, destination);
+    }
+
+    NoiseModel SealBackend::noise_model(ServerContext &bfv) {
+        return NoiseModel(bfv.parms);
     }
 
     // Functions
-    EncryptionParameters get_default_parameters() {
+    EncryptionParameters get_parameters(const ParameterSet &set) {
         EncryptionParameters parms(scheme_type::bfv);
-        size_t poly_modulus_degree = pow(2.0, POLY_MOD_DEG_EXP);
+        size_t poly_modulus_degree = size_t(1) << set.poly_mod_deg_exp;
 
         parms.set_poly_modulus_degree(poly_modulus_degree);
-        parms.set_coeff_modulus(CoeffModulus::BFVDefault(poly_modulus_degree));
-        parms.set_plain_modulus(PLAIN_MOD);
+        if (set.coeff_count == 0) {
+            parms.set_coeff_modulus(CoeffModulus::BFVDefault(poly_modulus_degree));
+        } else {
+            std::vector<int> bit_sizes(set.coeff_bits.begin(), set.coeff_bits.begin() + set.coeff_count);
+            parms.set_coeff_modulus(CoeffModulus::Create(poly_modulus_degree, bit_sizes));
+        }
+        parms.set_plain_modulus(set.plain_modulus);
         return parms;
     }
 
-    std::vector<Ciphertext> encrypt_data(cpu::BFVContext &bfv, std::vector<std::vector<uint64_t>> data) {
-        std::vector<Ciphertext> enc_data(data.size());
-        for(int i = 0; i < enc_data.size(); ++i) {
-            Plaintext pt;
-            Ciphertext ct;
-            bfv.batch_encoder.encode(data[i], pt);
-            bfv.encryptor.encrypt(pt, ct);
-            enc_data[i] = ct;
+    EncryptionParameters get_default_parameters() {
+        return get_parameters(DEFAULT_PARAMETER_SET);
+    }
+
+    namespace {
+        // Runs body(begin, end) over a few contiguous chunks of [0, rows) per worker
+        template <typename F>
+        void for_each_chunk(size_t rows, F body) {
+            const size_t chunks = std::min(rows, 4 * scheduler().threads());
+            scheduler().parallel_for(0, chunks, [&](size_t chunk) {
+                body(rows * chunk / chunks, rows * (chunk + 1) / chunks);
+            });
         }
+    }
+
+    void encrypt_rows(cpu::ServerContext &bfv, size_t rows, const RowEncoder &encode, std::vector<Ciphertext> &destination) {
+        HE_TRACE_STAGE("ingest");
+        destination.resize(rows);
+        for_each_chunk(rows, [&](size_t begin, size_t end) {
+            Plaintext plain;
+            for (size_t i = begin; i < end; ++i) {
+                encode(i, plain);
+                bfv.encryptor.encrypt(plain, destination[i], current_pool());
+            }
+        });
+    }
+
+    void encrypt_rows(cpu::ServerContext &bfv, size_t rows, const RowEncoder &encode, const CiphertextSink &sink) {
+        HE_TRACE_STAGE("ingest");
+        for_each_chunk(rows, [&](size_t begin, size_t end) {
+            Plaintext plain;
+            Ciphertext ciphertext;
+            for (size_t i = begin; i < end; ++i) {
+                encode(i, plain);
+                bfv.encryptor.encrypt(plain, ciphertext, current_pool());
+                sink(i, ciphertext);
+            }
+        });
+    }
+
+    std::vector<Ciphertext> encrypt_data(cpu::ServerContext &bfv, const std::vector<std::vector<uint64_t>> &data) {
+        std::vector<Ciphertext> enc_data;
+        encrypt_rows(bfv, data.size(), [&](size_t i, Plaintext &plain) {
+            bfv.batch_encoder.encode(data[i], plain);
+        }, enc_data);
         return enc_data;
     }
 
-    void mod_exp(cpu::BFVContext &bfv, const Ciphertext &x, uint64_t exponent, Ciphertext &result) {
-        Plaintext plain_one("1");
-        Ciphertext base(x);
-        bfv.encryptor.encrypt(plain_one, result);
+    std::vector<Ciphertext> encrypt_data(cpu::ServerContext &bfv, const LocationVectors &data) {
+        std::vector<Ciphertext> enc_data;
+        encrypt_rows(bfv, data.rows(), [&](size_t i, Plaintext &plain) {
+            encode_locations(bfv, data, i, plain);
+        }, enc_data);
+        return enc_data;
+    }
 
-        if (exponent == 1) {
-            result = x;
-            return;
-        }
+    std::vector<Ciphertext> encrypt_data(cpu::ServerContext &bfv, const FlatMatrix &data) {
+        std::vector<Ciphertext> enc_data;
+        encrypt_rows(bfv, data.rows(), [&](size_t i, Plaintext &plain) {
+            encode_row(bfv, data, i, plain);
+        }, enc_data);
+        return enc_data;
+    }
 
-        // Compute modular exponent by square and multiply
-        // evaluator.exponentiate_inplace(result, P - 1, relin_keys);
-        uint64_t initial_exponent = exponent;
-        while (exponent > 0)
-        {
-            if(exponent % 2 == 1) {
-                bfv.evaluator.multiply_inplace(result, base);
-                bfv.evaluator.relinearize_inplace(result, bfv.relin_keys);
+    namespace {
+        // Takes the encoder of the context when there is one, so that the encodings are traced
+        template <typename Encoder>
+        void encode_sparse(const Encoder &encoder, const LocationVectors &locations, size_t i, Plaintext &destination) {
+            if (locations.slot_count() > encoder.slot_count())
+                throw std::invalid_argument("encode_locations: " + std::to_string(locations.slot_count())
+                    + " slots do not fit in " + std::to_string(encoder.slot_count()));
+
+            // Every slot of the buffer is zero between two calls, and the encoder zero-pads
+            // shorter vectors, so the buffer is only as wide as the locations
+            thread_local std::vector<uint64_t> slots;
+            slots.resize(locations.slot_count(), 0);
+            const uint32_t *regions = locations.row(i);
+            for (size_t level = 0; level < locations.levels(); ++level) {
+                if (regions[level] != LocationVectors::NO_REGION)
+                    slots[regions[level]] = 1;
+            }
+            encoder.encode(slots, destination);
+            for (size_t level = 0; level < locations.levels(); ++level) {
+                if (regions[level] != LocationVectors::NO_REGION)
+                    slots[regions[level]] = 0;
             }
-            exponent >>= 1;
-            bfv.evaluator.square_inplace(base);
-            bfv.evaluator.relinearize_inplace(base, bfv.relin_keys);
-            // std::cout << bfv.decryptor.invariant_noise_budget(base) << std::endl;
         }
+    }
 
-        if(bfv.decryptor.invariant_noise_budget(result) <= 0) {
-            // std::cout << "mod_exp: out of noise budget while calculating exp(X, " << initial_exponent << ")!" << std::endl;
-            std::string err_msg("mod_exp: out of noise budget while calculating exp(X, " + std::to_string(initial_exponent) + ")!");
-            throw std::logic_error(err_msg);
-            exit(-1);
-        }
+    void encode_locations(cpu::ServerContext &bfv, const LocationVectors &locations, size_t i, Plaintext &destination) {
+        encode_sparse(bfv.batch_encoder, locations, i, destination);
     }
 
-    void equate_plain(cpu::BFVContext &bfv, const Ciphertext &x, const Plaintext &y, Ciphertext &result) {
-        // Equate
-        // EQ(x, y) = 1 - (x - y)^p-1
+    void encode_locations(const BatchEncoder &encoder, const LocationVectors &locations, size_t i, Plaintext &destination) {
+        encode_sparse(encoder, locations, i, destination);
+    }
 
-        Plaintext plain_one("1");
-        Ciphertext base;
-        bfv.evaluator.sub_plain(x, y, base);
+    void encode_row(cpu::ServerContext &bfv, const FlatMatrix &matrix, size_t i, Plaintext &destination) {
+        thread_local std::vector<uint64_t> row;
+        row.assign(matrix.row(i), matrix.row(i) + matrix.cols());
+        bfv.batch_encoder.encode(row, destination);
+    }
 
-        uint64_t exponent = PLAIN_MOD - 1;
-        mod_exp(bfv, base, exponent, result);
-        bfv.evaluator.negate_inplace(result);
-        bfv.evaluator.relinearize_inplace(result, bfv.relin_keys);
-        bfv.evaluator.add_plain_inplace(result, plain_one);
+    void relinearize_if_needed(cpu::ServerContext &bfv, Ciphertext &x) {
+        he::relinearize_if_needed<SealBackend>(bfv, x);
     }
 
-    void lt_range(cpu::BFVContext &bfv, const Ciphertext &x, uint64_t y, Ciphertext &result) {
-        // Range comparison from 0 to threshold - 1
+    void mod_exp(cpu::ServerContext &bfv, const Ciphertext &x, uint64_t exponent, Ciphertext &result, double budget) {
+        he::mod_exp<SealBackend>(bfv, x, exponent, result, budget);
+    }
+
+    void equate_plain(cpu::ServerContext &bfv, const Ciphertext &x, const Plaintext &y, Ciphertext &result, double budget) {
+        he::equate_plain<SealBackend>(bfv, x, y, result, budget);
+    }
 
-        // Equals [i][j] == 1 if x[j] == i, 0 otherwise
-        // Sum over i: if x[j] was within [0, y - 1] then result[j] == 1, 0 otherwise
-        // std::vector<Ciphertext> equals(y);
-        bfv.encryptor.encrypt_zero(result);
+    void lt_range(cpu::ServerContext &bfv, const Ciphertext &x, uint64_t y, Ciphertext &result, double budget) {
+        he::lt_range<SealBackend>(bfv, x, y, result, budget);
+    }
 
-        for(uint64_t i = 0; i < y; ++i) {
-            Plaintext ptx(std::to_string(i));
+    void lt_range_mt(cpu::ServerContext &bfv, const Ciphertext &x, uint64_t y, Ciphertext &result, double budget) {
+        if (y == 0) {
+            bfv.encryptor.encrypt_zero(result);
+            return;
+        }
+        HE_TRACE_STAGE("lt_range");
+
+        // One partial sum per worker, each worker claims the next value of i until none is left,
+        // so at most two ciphertexts per worker are alive at a time whatever the threshold.
+        std::vector<Ciphertext> partials(std::min<uint64_t>(scheduler().threads(), y));
+        std::vector<char> present(partials.size(), false);
+        std::atomic<uint64_t> next { 0 };
+        scheduler().parallel_for(0, partials.size(), [&](size_t w) {
             Ciphertext equals;
-            equate_plain(bfv, x, ptx, equals);
-            // Sum every intermediate result immediately to avoid memory growth
-            bfv.evaluator.add_inplace(result, equals);
+            for (uint64_t i = next++; i < y; i = next++) {
+                equate_plain(bfv, x, bfv.constant(i), present[w] ? equals : partials[w], budget);
+                if (present[w])
+                    bfv.evaluator.add_inplace(partials[w], equals);
+                present[w] = true;
+            }
+        });
+
+        // Sum everything: if x[j] was within [0, y - 1] then result[j] == 1, 0 otherwise.
+        // Workers that started after every value was claimed have no partial sum.
+        std::vector<Ciphertext> sums;
+        for (size_t w = 0; w < partials.size(); ++w) {
+            if (present[w])
+                sums.push_back(std::move(partials[w]));
         }
+        bfv.evaluator.add_many(sums, result);
 
-        // bfv.evaluator.add_many(equals, result);
+        // Every equality comes out at the same level, predicted by the model alone
+        NoiseModel model(bfv.parms);
+        he::drop_levels<SealBackend>(bfv, result, budget > 0 ? model.lt_range(budget, y) : he::UNKNOWN_BUDGET);
+        relinearize_if_needed(bfv, result);
     }
 
-    void lt_range_mt(cpu::BFVContext &bfv, const Ciphertext &x, uint64_t y, Ciphertext &result) {
-        // Vector to store results
-        std::vector<Ciphertext> equals(y);
+    std::vector<int> rotation_steps(size_t window, size_t slot_count) {
+        // Step 0 stands for the rotation of the columns, which swaps the two rows
+        std::vector<int> steps;
+        for (size_t step = 1; step < window && step < slot_count / 2; step <<= 1)
+            steps.push_back(static_cast<int>(step));
+        if (window > slot_count / 2)
+            steps.push_back(0);
+        return steps;
+    }
 
-        // Loop with concurrent execution
-        std::for_each(std::execution::par, equals.begin(), equals.end(), [&](Ciphertext &row) {
-            // auto i = std::find(equals.begin(), equals.end(), row) - equals.begin();
-            auto i = &row - &equals[0];
-            Plaintext ptx(std::to_string(i));
-            equate_plain(bfv, x, ptx, row);
-        });
+    void rotate_sum(cpu::ServerContext &bfv, Ciphertext &x, size_t window, const GaloisKeys &galois_keys) {
+        // Rotating by 1, 2, 4, ... and adding sums 2, 4, 8, ... consecutive slots of each row
+        size_t row_size = bfv.batch_encoder.slot_count() / 2;
+        if (window == 0 || (window & (window - 1)) != 0 || window > 2 * row_size)
+            throw std::invalid_argument("rotate_sum: the window must be a power of two no larger than the slot count");
+
+        HE_TRACE_STAGE("rotate_sum");
+        auto pool = current_pool();
+        Ciphertext rotated;
+        for (size_t step = 1; step < window && step < row_size; step <<= 1) {
+            rotated = x;
+            bfv.evaluator.rotate_rows_inplace(rotated, static_cast<int>(step), galois_keys, pool);
+            bfv.evaluator.add_inplace(x, rotated);
+        }
+        if (window > row_size) {
+            rotated = x;
+            bfv.evaluator.rotate_columns_inplace(rotated, galois_keys, pool);
+            bfv.evaluator.add_inplace(x, rotated);
+        }
+    }
+
+    // Multiplies all the factors together with a balanced binary tree, so that the
+    // multiplicative depth of the product is ceil(log2(n)) instead of n - 1.
+    // The contents of factors are consumed, budgets holds their predicted budgets and
+    // is left with the one of the product.
+    void multiply_tree(cpu::ServerContext &bfv, std::vector<Ciphertext> &factors, std::vector<double> &budgets, Ciphertext &result, bool parallel) {
+        HE_TRACE_STAGE("product");
+        while (factors.size() > 1) {
+            std::vector<Ciphertext> products((factors.size() + 1) / 2);
+            std::vector<double> product_budgets(products.size());
+            auto multiply_pair = [&](Ciphertext &product) {
+                size_t i = &product - &products[0];
+                if (2 * i + 1 < factors.size()) {
+                    // Products of the previous level are switched down, then relinearized once they are multiplied again
+                    he::align_levels<SealBackend>(bfv, factors[2 * i], factors[2 * i + 1]);
+                    relinearize_if_needed(bfv, factors[2 * i]);
+                    relinearize_if_needed(bfv, factors[2 * i + 1]);
+                    bfv.evaluator.multiply(factors[2 * i], factors[2 * i + 1], product, current_pool());
+                    product_budgets[i] = he::predict_multiply<SealBackend>(bfv, budgets[2 * i], budgets[2 * i + 1]);
+                    he::drop_levels<SealBackend>(bfv, product, product_budgets[i]);
+                } else {
+                    // Odd factor out: carry it over to the next level
+                    product = std::move(factors[2 * i]);
+                    product_budgets[i] = budgets[2 * i];
+                }
+            };
+
+            if (parallel)
+                scheduler().parallel_for_each(products.begin(), products.end(), multiply_pair);
+            else
+                std::for_each(products.begin(), products.end(), multiply_pair);
+            factors = std::move(products);
+            budgets = std::move(product_budgets);
+        }
+        result = std::move(factors[0]);
+    }
+
+    void lt_range_prod_impl(cpu::ServerContext &bfv, const Ciphertext &x, uint64_t y, Ciphertext &result, double budget, bool parallel) {
+        // Range comparison from 0 to threshold - 1 with a single exponentiation
+        // LT(x, y) = 1 - (prod_{i<y} (x - i))^(p-1)
+        // The product is zero if and only if x[j] is within [0, y - 1], so after applying
+        // Fermat's little theorem result[j] == 1 in that case and 0 otherwise.
+        if (y == 0) {
+            bfv.encryptor.encrypt_zero(result);
+            return;
+        }
+        HE_TRACE_STAGE("lt_range_prod");
+
+        // Differences (x - i) only require a plain subtraction each
+        std::vector<Ciphertext> factors(y);
+        auto subtract = [&](Ciphertext &factor) {
+            auto i = &factor - &factors[0];
+            bfv.evaluator.sub_plain(x, bfv.constant(i), factor);
+        };
+
+        if (parallel)
+            scheduler().parallel_for_each(factors.begin(), factors.end(), subtract);
+        else
+            std::for_each(factors.begin(), factors.end(), subtract);
+
+        Ciphertext product;
+        std::vector<double> budgets(y, budget);
+        multiply_tree(bfv, factors, budgets, product, parallel);
+
+        mod_exp(bfv, product, bfv.parms.plain_modulus().value() - 1, result, budgets[0]);
+        bfv.evaluator.negate_inplace(result);
+        bfv.evaluator.add_plain_inplace(result, bfv.constant(1));
+        relinearize_if_needed(bfv, result);
+    }
+
+    void lt_range_prod(cpu::ServerContext &bfv, const Ciphertext &x, uint64_t y, Ciphertext &result, double budget) {
+        lt_range_prod_impl(bfv, x, y, result, budget, false);
+    }
 
-        // Sum everything: if x[j] was within [0, y - 1] then result[j] == 1, 0 otherwise
-        bfv.evaluator.add_many(equals, result);
+    void lt_range_prod_mt(cpu::ServerContext &bfv, const Ciphertext &x, uint64_t y, Ciphertext &result, double budget) {
+        lt_range_prod_impl(bfv, x, y, result, budget, true);
     }
 
     constexpr int64_t mod_exp(int64_t base, int64_t exponent, int64_t p) {
@@ -144,112 +548,58 @@ namespace cpu {
         return result;
     }
 
-    int64_t mod_sum(const int64_t& a, const int64_t& b) {
-        return (a + b) % PLAIN_MOD;
-    }
-
-    void calc_univ_poly_coefficients(std::array<int64_t, N_POLY_TERMS> &result) {
-        auto *terms = new std::array<int64_t, N_POLY_TERMS - 1>();
-
-        for (int i = 0; i < PLAIN_MOD; i += 2) {
-            int64_t exponent = (i == PLAIN_MOD - 1) ? (PLAIN_MOD - i - 1) : (PLAIN_MOD - i);
-            std::for_each(std::execution::par, terms->begin(), terms->end(), [&](int64_t &term) {
-                auto a = (&term - &(*terms->begin())) + 1;
-                term = mod_exp(a, exponent, PLAIN_MOD);
-            });
-
-            result[i/2] = std::accumulate(terms->begin(), terms->end(), 0, mod_sum);
-        }
-
-        delete terms;
-    }
-
-    void paterson_stockmeyer(cpu::BFVContext &bfv, const std::vector<int64_t> &coefficients, const Ciphertext &z, Ciphertext &result) {
-        int k = coefficients.size();
-        int s = static_cast<int>(std::sqrt(k));     // Truncate the result to previous integer
-        int v = k / s;
-        std::cout << "Paterson-Stockmeyer: k = " << k << ", s = " << s << ", v = " << v << std::endl;
-
-        // Precompute powers of z up to z^s.
-        // Requires only sqrt(n) exponentiations instead of n
-        // Each has a multiplicative depth of roughly log2(2i)
-        // Max depth is log2(2s) = log2(2sqrt(k)) = 1 + 0.5log2(k)
-        std::vector<Ciphertext> z_powers(s + 1);
-        std::for_each(std::execution::par, z_powers.begin(), z_powers.end(), [&](Ciphertext &z_i) {
-            auto i = &z_i - &z_powers[0];
-            bfv.encryptor.encrypt_zero(z_powers[i]);
-            mod_exp(bfv, z, i, z_powers[i]);
-        });
+    void calc_univ_poly_coefficients(uint64_t plain_modulus, std::vector<int64_t> &result) {
+        // With h = (p-1)/2, [z < 0] for z in [-h, h] is (p+1)/2 * z^(p-1) + sum_{j<h} c_j * z^(2j+1),
+        // where the odd coefficients are the power sums
+        //     result[j] = c_j = sum_{a=1}^{h} a^(p-2-2j) mod p, for 0 <= j < h
+        //     result[h] = (p+1)/2
+        // Since p-2-2j = 2m+1 with m = h-1-j, every coefficient is an odd power sum S(2m+1).
+        // Instead of one modular exponentiation per term, each a^(2m+1) is obtained from
+        // a^(2m-1) with a single multiplication by a^2. Consecutive values of m are split in chunks evaluated in parallel.
+        const uint64_t p = plain_modulus;
+        const uint64_t h = (p - 1) / 2;
+        const uint64_t chunk_size = 256;
+
+        std::vector<uint64_t> odd_sums(h);     // odd_sums[m] = S(2m+1)
+        const uint64_t chunks = (h + chunk_size - 1) / chunk_size;
+
+        scheduler().parallel_for(0, chunks, [&](size_t chunk) {
+            uint64_t first = chunk * chunk_size;
+            uint64_t last = std::min(first + chunk_size, h);
+
+            std::vector<uint64_t> powers(h), squares(h);
+            for (uint64_t a = 1; a <= h; ++a) {
+                squares[a - 1] = a * a % p;
+                powers[a - 1] = mod_exp(a, 2 * first + 1, p);
+            }
 
-        bfv.encryptor.encrypt_zero(result);
-        std::vector<Ciphertext> block_results(v);
-
-        // In parallel: combine blocks, from 0 to v - 1
-        std::for_each(std::execution::par, block_results.begin(), block_results.end(), [&](Ciphertext &block_result) {
-            auto i = &block_result - &block_results[0];
-            bfv.encryptor.encrypt_zero(block_result);
-
-            // Inner loop: evaluate each block, from 0 to s - 1 
-            for (int j = 0; j < s; ++j) {
-                int idx = i * s + j;
-                // If the coefficient is zero, skip calculating the modular exponent
-                // Also avoids std::logic_error due to transparent ciphertext
-                if (coefficients[idx] != 0) {
-                    Plaintext alpha(std::to_string(coefficients[idx]));
-                    Ciphertext term = z_powers[j];
-                    bfv.evaluator.multiply_plain_inplace(term, alpha);
-                    bfv.evaluator.relinearize_inplace(term, bfv.relin_keys);
-                    bfv.evaluator.add_inplace(block_result, term);
+            for (uint64_t m = first; m < last; ++m) {
+                // At most h terms smaller than p: no overflow for any 32-bit plain modulus
+                uint64_t sum = 0;
+                for (uint64_t a = 0; a < h; ++a) {
+                    sum += powers[a];
+                    powers[a] = powers[a] * squares[a] % p;
                 }
+                odd_sums[m] = sum % p;
             }
-
-            // Multiply by the outer power (z^(si)) and add to the result
-            Ciphertext outer_power;
-            mod_exp(bfv, z_powers[s], i, outer_power);
-            bfv.evaluator.multiply_inplace(block_result, outer_power);
-            bfv.evaluator.relinearize_inplace(block_result, bfv.relin_keys);
         });
 
-        bfv.evaluator.add_many(block_results, result);
-
-        // Last block: remainder of k / s
-        Ciphertext last_block;
-        bfv.encryptor.encrypt_zero(last_block);
-        for (int j = 0; j < k % s; ++j) {
-            int idx = s * v + j;
-            if (coefficients[idx] != 0) {
-                Plaintext alpha(std::to_string(coefficients[idx]));
-                Ciphertext term = z_powers[j];
-                bfv.evaluator.multiply_plain_inplace(term, alpha);
-                bfv.evaluator.relinearize_inplace(term, bfv.relin_keys);
-                bfv.evaluator.add_inplace(last_block, term);
-            }
-        }
+        result.resize(h + 1);
+        for (uint64_t j = 0; j < h; ++j)
+            result[j] = odd_sums[h - 1 - j];
+        result[h] = (p + 1) / 2;
+    }
+
+    void paterson_stockmeyer(cpu::ServerContext &bfv, const int64_t *coefficients, size_t n_terms, const Ciphertext &z, Ciphertext &result, double budget) {
+        he::paterson_stockmeyer<SealBackend>(bfv, coefficients, n_terms, z, result, budget);
+    }
+
+    void lt_bounded(cpu::ServerContext &bfv, const Ciphertext &x, uint64_t y, uint64_t n_max, Ciphertext &result, double budget) {
+        const CoefficientTable &coefficients = bounded_lt_coefficients(bfv.parms.plain_modulus().value(), y, n_max);
+        he::lt_bounded<SealBackend>(bfv, coefficients.data(), coefficients.size(), x, result, budget);
+    }
 
-        Ciphertext last_power;
-        mod_exp(bfv, z_powers[s], v, last_power);
-        bfv.evaluator.multiply_inplace(last_block, last_power);
-        bfv.evaluator.relinearize_inplace(last_block, bfv.relin_keys);
-        bfv.evaluator.add_inplace(result, last_block);
-    }
-
-    void lt_univariate(cpu::BFVContext &bfv, const std::array<int64_t, N_POLY_TERMS> &coefficients, const Ciphertext &x, const Ciphertext &y, Ciphertext &result) {
-        Ciphertext z = x;
-        bfv.evaluator.sub_inplace(z, y);
-        
-        Ciphertext second_term, z2;
-        bfv.evaluator.square(z, z2);
-        bfv.evaluator.relinearize_inplace(z2, bfv.relin_keys);
-        paterson_stockmeyer(bfv, std::vector<int64_t>(coefficients.begin(), coefficients.end() - 1), z2, second_term);
-        bfv.evaluator.multiply_inplace(second_term, z);
-        bfv.evaluator.relinearize_inplace(second_term, bfv.relin_keys);
-        
-        Ciphertext first_term;
-        Plaintext alpha_zero(std::to_string(coefficients.back()));
-        mod_exp(bfv, z, PLAIN_MOD - 1, first_term);
-        bfv.evaluator.multiply_plain_inplace(first_term, alpha_zero);
-        bfv.evaluator.relinearize_inplace(first_term, bfv.relin_keys);
-
-        bfv.evaluator.add(first_term, second_term, result);
+    void lt_univariate(cpu::ServerContext &bfv, const CoefficientTable &coefficients, const Ciphertext &x, const Ciphertext &y, Ciphertext &result, double budget) {
+        he::lt_univariate<SealBackend>(bfv, coefficients.data(), coefficients.size(), x, y, result, budget);
     }
 }
@@ -8,23 +8,230 @@
 #include <execution>
 #include <tbb/parallel_for_each.h>
 #include <thread>
+#include <map>
+#include <shared_mutex>
+#include <atomic>
 
 #include "constants.h"
+#include "scheduler.h"
+#include "trace.h"
 
 namespace cpu {
-    class BFVContext {
+    class NoiseModel;
+
+    // Homomorphic operations performed through a CountingEvaluator, summed over every thread
+    struct OpCounters {
+        std::atomic<uint64_t> multiplications { 0 };       // Ciphertext by ciphertext, squares included
+        std::atomic<uint64_t> plain_multiplications { 0 };
+        std::atomic<uint64_t> relinearizations { 0 };
+        std::atomic<uint64_t> mod_switches { 0 };           // One per prime dropped
+        std::atomic<uint64_t> rotations { 0 };
+
+        void reset();
+    };
+
+    OpCounters &op_counters();
+
+    /*
+        seal::Evaluator that counts the operations which dominate the cost of the kernels,
+        with a relaxed atomic increment each, negligible next to any of them. The methods
+        hide the ones of seal::Evaluator, so only calls through a CountingEvaluator are counted.
+        With -DHE_TRACE the same calls, and the additions of plaintexts, are traced as well.
+    */
+    class CountingEvaluator : public seal::Evaluator {
+    public:
+        using seal::Evaluator::Evaluator;
+        using seal::Evaluator::mod_switch_to_inplace;
+
+        void multiply_inplace(seal::Ciphertext &encrypted1, const seal::Ciphertext &encrypted2,
+            seal::MemoryPoolHandle pool = seal::MemoryManager::GetPool()) const;
+        void multiply(const seal::Ciphertext &encrypted1, const seal::Ciphertext &encrypted2, seal::Ciphertext &destination,
+            seal::MemoryPoolHandle pool = seal::MemoryManager::GetPool()) const;
+        void square_inplace(seal::Ciphertext &encrypted, seal::MemoryPoolHandle pool = seal::MemoryManager::GetPool()) const;
+        void square(const seal::Ciphertext &encrypted, seal::Ciphertext &destination,
+            seal::MemoryPoolHandle pool = seal::MemoryManager::GetPool()) const;
+        void multiply_plain_inplace(seal::Ciphertext &encrypted, const seal::Plaintext &plain,
+            seal::MemoryPoolHandle pool = seal::MemoryManager::GetPool()) const;
+        void multiply_plain(const seal::Ciphertext &encrypted, const seal::Plaintext &plain, seal::Ciphertext &destination,
+            seal::MemoryPoolHandle pool = seal::MemoryManager::GetPool()) const;
+        void relinearize_inplace(seal::Ciphertext &encrypted, const seal::RelinKeys &relin_keys,
+            seal::MemoryPoolHandle pool = seal::MemoryManager::GetPool()) const;
+        void mod_switch_to_next_inplace(seal::Ciphertext &encrypted, seal::MemoryPoolHandle pool = seal::MemoryManager::GetPool()) const;
+        void mod_switch_to_inplace(seal::Ciphertext &encrypted, seal::parms_id_type parms_id,
+            seal::MemoryPoolHandle pool = seal::MemoryManager::GetPool()) const;
+        void mod_switch_to(const seal::Ciphertext &encrypted, seal::parms_id_type parms_id, seal::Ciphertext &destination,
+            seal::MemoryPoolHandle pool = seal::MemoryManager::GetPool()) const;
+        void add_plain_inplace(seal::Ciphertext &encrypted, const seal::Plaintext &plain,
+            seal::MemoryPoolHandle pool = seal::MemoryManager::GetPool()) const;
+        void add_plain(const seal::Ciphertext &encrypted, const seal::Plaintext &plain, seal::Ciphertext &destination,
+            seal::MemoryPoolHandle pool = seal::MemoryManager::GetPool()) const;
+        void sub_plain_inplace(seal::Ciphertext &encrypted, const seal::Plaintext &plain,
+            seal::MemoryPoolHandle pool = seal::MemoryManager::GetPool()) const;
+        void sub_plain(const seal::Ciphertext &encrypted, const seal::Plaintext &plain, seal::Ciphertext &destination,
+            seal::MemoryPoolHandle pool = seal::MemoryManager::GetPool()) const;
+        void rotate_rows_inplace(seal::Ciphertext &encrypted, int steps, const seal::GaloisKeys &galois_keys,
+            seal::MemoryPoolHandle pool = seal::MemoryManager::GetPool()) const;
+        void rotate_columns_inplace(seal::Ciphertext &encrypted, const seal::GaloisKeys &galois_keys,
+            seal::MemoryPoolHandle pool = seal::MemoryManager::GetPool()) const;
+    };
+
+    // seal::Encryptor tracing the encryptions under -DHE_TRACE
+    class TracingEncryptor : public seal::Encryptor {
+    public:
+        using seal::Encryptor::Encryptor;
+        using seal::Encryptor::encrypt;
+        using seal::Encryptor::encrypt_zero;
+
+        void encrypt(const seal::Plaintext &plain, seal::Ciphertext &destination,
+            seal::MemoryPoolHandle pool = seal::MemoryManager::GetPool()) const;
+        void encrypt_zero(seal::Ciphertext &destination, seal::MemoryPoolHandle pool = seal::MemoryManager::GetPool()) const;
+    };
+
+    // seal::BatchEncoder tracing the encodings under -DHE_TRACE
+    class TracingBatchEncoder : public seal::BatchEncoder {
+    public:
+        using seal::BatchEncoder::BatchEncoder;
+        using seal::BatchEncoder::encode;
+
+        void encode(const std::vector<std::uint64_t> &values, seal::Plaintext &destination) const;
+        void encode(const std::vector<std::int64_t> &values, seal::Plaintext &destination) const;
+    };
+
+    // Keys the server evaluates with, none of which can decrypt
+    struct ServerKeys {
+        seal::PublicKey public_key;
+        seal::RelinKeys relin_keys;         // Empty in the contexts of clients, which never multiply
+        seal::GaloisKeys galois_keys;       // Empty unless compact responses are served
+    };
+
+    /*
+        Context of the server: it encrypts with the public key and evaluates with the
+        relinearization and Galois keys, but holds no secret key and has no decryptor,
+        so aggregates and masks can not be read even by whoever runs it. The keys are
+        generated by a BFVContext and loaded from a key bundle (keys.h).
+    */
+    class ServerContext {
+        // Constant plaintexts, keyed by their value modulo the plain modulus
+        std::map<uint64_t, seal::Plaintext> constants;
+        std::shared_mutex constants_mutex;
     public:
         seal::EncryptionParameters parms;
         seal::SEALContext context;
-        seal::KeyGenerator keygen;
-        seal::SecretKey secret_key;
         seal::PublicKey public_key;
         seal::RelinKeys relin_keys;
-        seal::Encryptor encryptor;
-        seal::Evaluator evaluator;
+        seal::GaloisKeys galois_keys;
+        TracingEncryptor encryptor;
+        CountingEvaluator evaluator;
+        TracingBatchEncoder batch_encoder;
+
+        // Throws std::invalid_argument if a key is not valid for the context, only the public key is required
+        ServerContext(const seal::SEALContext &context, ServerKeys keys);
+        ServerContext(const ServerContext &) = delete;
+        ServerContext &operator=(const ServerContext &) = delete;
+        virtual ~ServerContext() = default;
+
+        /*
+            Returns a plaintext holding value in every slot, ready to be passed to
+            multiply_plain, add_plain and sub_plain. A constant is stored as a degree 0
+            polynomial, which SEAL multiplies without any NTT, so it is already in the
+            cheapest form for BFV ciphertexts. Plaintexts are created on first use and
+            cached for the lifetime of the context; lookups are thread-safe.
+        */
+        const seal::Plaintext &constant(int64_t value);
+
+        // Precompute the constants from first to last (inclusive)
+        void warm_constants(int64_t first, int64_t last);
+
+        // Precompute the constants for every value in [begin, end)
+        template <typename It>
+        void warm_constants(It begin, It end) {
+            for (It it = begin; it != end; ++it)
+                constant(*it);
+        }
+
+        // Whether galois_keys hold the rotations by every step, 0 standing for the column rotation
+        bool has_galois_keys(const std::vector<int> &steps) const;
+
+        // Generates the Galois keys of steps into destination, which needs the secret key: false on the server
+        virtual bool create_galois_keys(const std::vector<int> &steps, seal::GaloisKeys &destination);
+
+        // Whether the context holds the secret key, which noise_budget needs: false on the server
+        virtual bool has_secret_key() const;
+
+        // Measured noise budget of x, which needs the secret key: throws std::logic_error on the server
+        virtual int noise_budget(const seal::Ciphertext &x);
+    };
+
+    /*
+        Context holding every key, for clients and for benchmarks that check their results.
+        It is a ServerContext as well, so that it runs the same kernels as the server.
+    */
+    class BFVContext : public ServerContext {
+    public:
+        seal::KeyGenerator keygen;
+        seal::SecretKey secret_key;
         seal::Decryptor decryptor;
-        seal::BatchEncoder batch_encoder;
 
+        // Generates a secret key and the keys of the server, the relinearization keys being by far the slowest
         BFVContext(const seal::EncryptionParameters &parms);
+        explicit BFVContext(const seal::SEALContext &context);
+
+        // Generates the keys of the server from an existing secret key
+        BFVContext(const seal::SEALContext &context, const seal::SecretKey &secret_key);
+
+        // Context of previously generated keys, see load_client_context
+        BFVContext(const seal::SEALContext &context, const seal::SecretKey &secret_key, ServerKeys keys);
+
+        bool create_galois_keys(const std::vector<int> &steps, seal::GaloisKeys &destination) override;
+        bool has_secret_key() const override;
+        int noise_budget(const seal::Ciphertext &x) override;
+    };
+
+    /*
+        Backend traits of the algorithms of comparison.h for SEAL. Evaluator calls use the
+        pool of the calling thread, and parallel loops run on the scheduler.
+        Ciphertexts are switched down the modulus chain as their noise grows.
+    */
+    struct SealBackend {
+        using Context = ServerContext;
+        using Ciphertext = seal::Ciphertext;
+        using Plaintext = seal::Plaintext;
+
+        static constexpr bool leveled = true;
+
+        static size_t size(const Ciphertext &x) { return x.size(); }
+        static uint64_t plain_modulus(Context &bfv) { return bfv.parms.plain_modulus().value(); }
+
+        static NoiseModel noise_model(Context &bfv);
+        static size_t level(Context &bfv, const Ciphertext &x) {
+            return bfv.context.first_context_data()->chain_index() - bfv.context.get_context_data(x.parms_id())->chain_index();
+        }
+        static void mod_switch_to_next_inplace(Context &bfv, Ciphertext &x) { bfv.evaluator.mod_switch_to_next_inplace(x, current_pool()); }
+
+        static void encrypt(Context &bfv, const Plaintext &plain, Ciphertext &result) { bfv.encryptor.encrypt(plain, result, current_pool()); }
+        static void encrypt_zero(Context &bfv, Ciphertext &result) { bfv.encryptor.encrypt_zero(result, current_pool()); }
+
+        static void add(Context &bfv, const Ciphertext &a, const Ciphertext &b, Ciphertext &result) { bfv.evaluator.add(a, b, result); }
+        static void add_inplace(Context &bfv, Ciphertext &x, const Ciphertext &y) { bfv.evaluator.add_inplace(x, y); }
+        static void add_plain_inplace(Context &bfv, Ciphertext &x, const Plaintext &y) { bfv.evaluator.add_plain_inplace(x, y); }
+        static void sub_inplace(Context &bfv, Ciphertext &x, const Ciphertext &y) { bfv.evaluator.sub_inplace(x, y); }
+        static void sub_plain(Context &bfv, const Ciphertext &x, const Plaintext &y, Ciphertext &result) { bfv.evaluator.sub_plain(x, y, result); }
+        static void negate_inplace(Context &bfv, Ciphertext &x) { bfv.evaluator.negate_inplace(x); }
+
+        static void multiply(Context &bfv, const Ciphertext &a, const Ciphertext &b, Ciphertext &result) { bfv.evaluator.multiply(a, b, result, current_pool()); }
+        static void multiply_inplace(Context &bfv, Ciphertext &x, const Ciphertext &y) { bfv.evaluator.multiply_inplace(x, y, current_pool()); }
+        static void square(Context &bfv, const Ciphertext &x, Ciphertext &result) { bfv.evaluator.square(x, result, current_pool()); }
+        static void square_inplace(Context &bfv, Ciphertext &x) { bfv.evaluator.square_inplace(x, current_pool()); }
+        static void multiply_plain(Context &bfv, const Ciphertext &x, const Plaintext &y, Ciphertext &result) { bfv.evaluator.multiply_plain(x, y, result, current_pool()); }
+        static void multiply_plain_inplace(Context &bfv, Ciphertext &x, const Plaintext &y) { bfv.evaluator.multiply_plain_inplace(x, y, current_pool()); }
+        static void relinearize_inplace(Context &bfv, Ciphertext &x) { bfv.evaluator.relinearize_inplace(x, bfv.relin_keys, current_pool()); }
+
+        static const Plaintext &coefficient(Context &bfv, int64_t value, Plaintext &) { return bfv.constant(value); }
+
+        static bool has_secret_key(Context &bfv) { return bfv.has_secret_key(); }
+        static int noise_budget(Context &bfv, const Ciphertext &x) { return bfv.noise_budget(x); }
+
+        template <typename F>
+        static void parallel_for(size_t n, F body) { scheduler().parallel_for(0, n, body); }
     };
 }
@@ -1,4 +1,7 @@
 #include "bfvcuda.h"
+#include "dataset.h"
+#include "coefficients.h"
+#include "comparison.h"
 
 namespace gpu {
     using namespace troy;
@@ -34,6 +37,37 @@ namespace gpu {
         pool.get()->destroy();
     }
 
+    const Plaintext &gpu::BFVContext::constant(int64_t value) {
+        const int64_t p = PLAIN_MOD;
+        const uint64_t key = ((value % p) + p) % p;
+        {
+            std::shared_lock<std::shared_mutex> lock(constants_mutex);
+            auto it = constants.find(key);
+            if (it != constants.end())
+                return it->second;
+        }
+
+        Plaintext ptx;
+        encode_constant(value, ptx);
+
+        // std::map never invalidates references to existing elements on insertion
+        std::unique_lock<std::shared_mutex> lock(constants_mutex);
+        return constants.emplace(key, std::move(ptx)).first->second;
+    }
+
+    void gpu::BFVContext::encode_constant(int64_t value, Plaintext &ptx) {
+        const int64_t p = PLAIN_MOD;
+        const uint64_t key = ((value % p) + p) % p;
+        ptx = batch_encoder.encode_new(std::vector<uint64_t>(batch_encoder.slot_count(), key));
+        if(utils::device_count() > 0 && !ptx.on_device())
+            ptx.to_device_inplace(pool);
+    }
+
+    void gpu::BFVContext::warm_constants(int64_t first, int64_t last) {
+        for (int64_t value = first; value <= last; ++value)
+            constant(value);
+    }
+
     // Functions
     EncryptionParameters get_default_parameters() {
         EncryptionParameters parms(SchemeType::BFV);
@@ -45,222 +79,88 @@ namespace gpu {
         return parms;
     }
 
-    std::vector<Ciphertext> encrypt_data(gpu::BFVContext &bfv, std::vector<std::vector<uint64_t>> data) {
+    std::vector<Ciphertext> encrypt_data(gpu::BFVContext &bfv, const std::vector<std::vector<uint64_t>> &data) {
         std::vector<Ciphertext> enc_data(data.size());
-        for(int i = 0; i < enc_data.size(); ++i) {
+        for(size_t i = 0; i < enc_data.size(); ++i) {
             Plaintext pt = bfv.batch_encoder.encode_new(data[i]);
-            Ciphertext ct = bfv.encryptor.encrypt_asymmetric_new(pt);
-            enc_data[i] = ct;
+            enc_data[i] = bfv.encryptor.encrypt_asymmetric_new(pt);
         }
         return enc_data;
     }
 
-    void mod_exp(gpu::BFVContext &bfv, const Ciphertext &x, uint64_t exponent, Ciphertext &result) {
-        Plaintext plain_one = bfv.batch_encoder.encode_new(std::vector<uint64_t>(bfv.batch_encoder.slot_count(), 1));
-        Ciphertext base(x);
-        result = bfv.encryptor.encrypt_asymmetric_new(plain_one);
-
-        // Compute modular exponent by square and multiply
-        // evaluator.exponentiate_inplace(result, P - 1, relin_keys);
-        if(!result.on_device())
-            result.to_device_inplace();
-        if(!base.on_device())
-            base.to_device_inplace();
-        
-        if (exponent == 1) {
-            result = x;
-            return;
-        }
-
-        uint64_t initial_exponent = exponent;
-        while (exponent > 0)
-        {
-            if(exponent % 2 == 1) {
-                bfv.evaluator.multiply_inplace(result, base);
-                result = bfv.evaluator.relinearize_new(result, bfv.relin_keys);
+    std::vector<Ciphertext> encrypt_data(gpu::BFVContext &bfv, const LocationVectors &data) {
+        // Only the slots of the regions of a user are set in the buffer, and cleared after its encoding
+        std::vector<Ciphertext> enc_data(data.rows());
+        std::vector<uint64_t> slots(data.slot_count(), 0);
+        for(size_t i = 0; i < enc_data.size(); ++i) {
+            const uint32_t *regions = data.row(i);
+            for (size_t level = 0; level < data.levels(); ++level) {
+                if (regions[level] != LocationVectors::NO_REGION)
+                    slots[regions[level]] = 1;
+            }
+            Plaintext pt = bfv.batch_encoder.encode_new(slots);
+            enc_data[i] = bfv.encryptor.encrypt_asymmetric_new(pt);
+            for (size_t level = 0; level < data.levels(); ++level) {
+                if (regions[level] != LocationVectors::NO_REGION)
+                    slots[regions[level]] = 0;
             }
-            exponent >>= 1;
-            bfv.evaluator.square_inplace(base);
-            base = bfv.evaluator.relinearize_new(base, bfv.relin_keys);
-            // std::cout << bfv.decryptor.invariant_noise_budget(base) << std::endl;
-        }
-
-        if(bfv.decryptor.invariant_noise_budget(result) <= 0) {
-            // std::cout << "mod_exp: out of noise budget while calculating exp(X, " << exponent << ")!" << std::endl;
-            std::string err_msg("mod_exp: out of noise budget while calculating exp(X, " + std::to_string(initial_exponent) + ")!");
-            throw std::logic_error(err_msg);
         }
+        return enc_data;
     }
 
-    void equate_plain(gpu::BFVContext &bfv, const Ciphertext &x, const Plaintext &y, Ciphertext &result) {
-        // Equate
-        // EQ(x, y) = 1 - (x - y)^p-1
-
-        Plaintext plain_one = bfv.batch_encoder.encode_new(std::vector<uint64_t>(bfv.batch_encoder.slot_count(), 1));
-        Plaintext Y = y;
-        Ciphertext X = x;
-
-        if(!X.on_device())
-            X.to_device_inplace();
-        if(!Y.on_device())
-            Y.to_device_inplace();
-
-        Ciphertext base = bfv.evaluator.sub_plain_new(X, Y);
-
-        uint64_t exponent = PLAIN_MOD - 1;
-        mod_exp(bfv, base, exponent, result);
-        bfv.evaluator.negate_inplace(result);
-        bfv.evaluator.relinearize_inplace(result, bfv.relin_keys);
-        bfv.evaluator.add_plain_inplace(result, plain_one);
-    }
-
-    void lt_range(gpu::BFVContext &bfv, const Ciphertext &x, uint64_t y, Ciphertext &result) {
-        // Range comparison from 0 to threshold - 1
-
-        // Equals [i][j] == 1 if x[j] == i, 0 otherwise
-        // Sum over i: if x[j] was within [0, y - 1] then result[j] == 1, 0 otherwise
-        // std::vector<Ciphertext> equals(y);
-        bfv.encryptor.encrypt_zero_asymmetric(result);
-        Plaintext y_ptx;
-        Ciphertext equals;
-
-        for(uint64_t i = 0; i < y; ++i) {
-            bfv.batch_encoder.encode(std::vector<uint64_t>(bfv.batch_encoder.slot_count(), i), y_ptx);
-            equate_plain(bfv, x, y_ptx, equals);
-            // Sum every intermediate result immediately to avoid memory growth
-            bfv.evaluator.add_inplace(result, equals);
+    std::vector<Ciphertext> encrypt_data(gpu::BFVContext &bfv, const FlatMatrix &data) {
+        std::vector<Ciphertext> enc_data(data.rows());
+        std::vector<uint64_t> row;
+        for(size_t i = 0; i < enc_data.size(); ++i) {
+            row.assign(data.row(i), data.row(i) + data.cols());
+            Plaintext pt = bfv.batch_encoder.encode_new(row);
+            enc_data[i] = bfv.encryptor.encrypt_asymmetric_new(pt);
         }
-
-        // bfv.encryptor.encrypt_zero_asymmetric(result);
-        // std::for_each(equals.begin(), equals.end(), [&](Ciphertext &ctx) {
-        //     ctx.to_device_inplace();
-        //     bfv.evaluator.add_inplace(result, ctx);
-        // });
+        return enc_data;
     }
 
-    constexpr int64_t mod_exp(int64_t base, int64_t exponent, int64_t p) {
-        int64_t result = 1;
-        while (exponent > 0)
-        {
-            if(exponent % 2 == 1) {
-                result = (result * base) % p;
-            }
-            exponent >>= 1;
-            base = (base * base) % p;
-        }
-
-        return result;
+    // Copy of x on the device, or x itself when it already is
+    const Ciphertext &on_device(const Ciphertext &x, Ciphertext &copy) {
+        if (x.on_device())
+            return x;
+        copy = x.to_device();
+        return copy;
     }
 
-    int64_t mod_sum(const int64_t& a, const int64_t& b) {
-        return (a + b) % PLAIN_MOD;
+    void relinearize_if_needed(gpu::BFVContext &bfv, Ciphertext &x) {
+        he::relinearize_if_needed<TroyBackend>(bfv, x);
     }
 
-    void calc_univ_poly_coefficients(std::array<int64_t, N_POLY_TERMS> &result) {
-        auto *terms = new std::array<int64_t, N_POLY_TERMS - 1>();
-
-        for (int i = 0; i < PLAIN_MOD; i += 2) {
-            int64_t exponent = (i == PLAIN_MOD - 1) ? (PLAIN_MOD - i - 1) : (PLAIN_MOD - i);
-            std::for_each(std::execution::par, terms->begin(), terms->end(), [&](int64_t &term) {
-                auto a = (&term - &(*terms->begin())) + 1;
-                term = mod_exp(a, exponent, PLAIN_MOD);
-            });
-
-            result[i/2] = std::accumulate(terms->begin(), terms->end(), 0, mod_sum);
-        }
-
-        delete terms;
+    void mod_exp(gpu::BFVContext &bfv, const Ciphertext &x, uint64_t exponent, Ciphertext &result) {
+        Ciphertext copy;
+        he::mod_exp<TroyBackend>(bfv, on_device(x, copy), exponent, result);
     }
 
-    void paterson_stockmeyer(gpu::BFVContext &bfv, const std::vector<int64_t> &coefficients, const Ciphertext &z, Ciphertext &result) {
-        int k = coefficients.size();
-        int s = static_cast<int>(std::sqrt(k));     // Truncate the result to previous integer
-        int v = k / s;
-        std::cout << "Paterson-Stockmeyer: k = " << k << ", s = " << s << ", v = " << v << std::endl;
-
-        // Precompute powers of z up to z^s.
-        // Requires only sqrt(n) exponentiations instead of n
-        // Each has a multiplicative depth of roughly log2(2i)
-        // Max depth is log2(2s) = log2(2sqrt(k)) = 1 + 0.5log2(k)
-        std::vector<Ciphertext> z_powers(s + 1);
-        for (int i = 0; i <= s; ++i) {
-            z_powers[i] = bfv.encryptor.encrypt_zero_asymmetric_new();
-            mod_exp(bfv, z, i, z_powers[i]);
-        }
-        
-        result = bfv.encryptor.encrypt_zero_asymmetric_new();
-
-        // Outer loop: combine blocks, from 0 to v - 1
-        for (int i = 0; i < v; ++i) {
-            Ciphertext block_result = bfv.encryptor.encrypt_zero_asymmetric_new();
-
-            // Inner loop: evaluate each block, from 0 to s - 1 
-            for (int j = 0; j < s; ++j) {
-                int idx = i * s + j;
-                // If the coefficient is zero, skip calculating the modular exponent
-                // Also avoids std::logic_error due to transparent ciphertext
-                if (coefficients[idx] != 0) {
-                    Plaintext alpha = bfv.batch_encoder.encode_new(std::vector<uint64_t>(bfv.batch_encoder.slot_count(), coefficients[idx]));
-                    Ciphertext term = z_powers[j];
-                    bfv.evaluator.multiply_plain_inplace(term, alpha);
-                    bfv.evaluator.relinearize_inplace(term, bfv.relin_keys);
-                    bfv.evaluator.add_inplace(block_result, term);
-                }
-            }
-
-            // Multiply by the outer power (z^(si)) and add to the result
-            Ciphertext outer_power;
-            mod_exp(bfv, z_powers[s], i, outer_power);
-            bfv.evaluator.multiply_inplace(block_result, outer_power);
-            bfv.evaluator.relinearize_inplace(block_result, bfv.relin_keys);
-            bfv.evaluator.add_inplace(result, block_result);
-        }
-
-        // Last block: remainder of k / s
-        Ciphertext last_block = bfv.encryptor.encrypt_zero_asymmetric_new();
-        for (int j = 0; j < k % s; ++j) {
-            int idx = s * v + j;
-            if (coefficients[idx] != 0) {
-                Plaintext alpha = bfv.batch_encoder.encode_new(std::vector<uint64_t>(bfv.batch_encoder.slot_count(), coefficients[idx]));
-                Ciphertext term = z_powers[j];
-                bfv.evaluator.multiply_plain_inplace(term, alpha);
-                bfv.evaluator.relinearize_inplace(term, bfv.relin_keys);
-                bfv.evaluator.add_inplace(last_block, term);
-            }
+    void equate_plain(gpu::BFVContext &bfv, const Ciphertext &x, const Plaintext &y, Ciphertext &result) {
+        // Cached constants already live on the device, only copy y if it does not
+        Ciphertext copy;
+        if (y.on_device()) {
+            he::equate_plain<TroyBackend>(bfv, on_device(x, copy), y, result);
+        } else {
+            Plaintext y_device = y.to_device();
+            he::equate_plain<TroyBackend>(bfv, on_device(x, copy), y_device, result);
         }
+    }
 
-        Ciphertext last_power;
-        mod_exp(bfv, z_powers[s], v, last_power);
-        bfv.evaluator.multiply_inplace(last_block, last_power);
-        bfv.evaluator.relinearize_inplace(last_block, bfv.relin_keys);
-        bfv.evaluator.add_inplace(result, last_block);
+    void lt_range(gpu::BFVContext &bfv, const Ciphertext &x, uint64_t y, Ciphertext &result) {
+        // x is copied to the device once for the y equality tests
+        Ciphertext copy;
+        he::lt_range<TroyBackend>(bfv, on_device(x, copy), y, result);
     }
 
     void lt_univariate(gpu::BFVContext &bfv, const std::array<int64_t, N_POLY_TERMS> &coefficients, const Ciphertext &x, const Ciphertext &y, Ciphertext &result) {
-        Ciphertext z = x, y_copy = y;
-        if(!z.on_device())
-            z.to_device_inplace();
-        if(!y_copy.on_device())
-            y_copy.to_device_inplace();
-        
-        bfv.evaluator.sub_inplace(z, y_copy);
-
-        // Evaluate the second term as Zg(Z^2)
-        Ciphertext second_term, z2;
-        bfv.evaluator.square(z, z2);
-        bfv.evaluator.relinearize_inplace(z2, bfv.relin_keys);
-        // Evaluate g(X) with X = Z^2 using the Paterson-Stockmeyer algorithm
-        paterson_stockmeyer(bfv, std::vector<int64_t>(coefficients.begin(), coefficients.end() - 1), z2, second_term);
-        bfv.evaluator.multiply_inplace(second_term, z);
-        bfv.evaluator.relinearize_inplace(second_term, bfv.relin_keys);
-
-        // Evaluate the first term
-        Ciphertext first_term = bfv.encryptor.encrypt_zero_asymmetric_new();
-        Plaintext alpha_zero = bfv.batch_encoder.encode_new(std::vector<uint64_t>(bfv.batch_encoder.slot_count(), coefficients.back()));
-        mod_exp(bfv, z, PLAIN_MOD - 1, first_term);
-        bfv.evaluator.multiply_plain_inplace(first_term, alpha_zero);
-        bfv.evaluator.relinearize_inplace(first_term, bfv.relin_keys);
+        Ciphertext x_copy, y_copy;
+        he::lt_univariate<TroyBackend>(bfv, coefficients.data(), coefficients.size(), on_device(x, x_copy), on_device(y, y_copy), result);
+    }
 
-        bfv.evaluator.add(first_term, second_term, result);
+    void lt_bounded(gpu::BFVContext &bfv, const Ciphertext &x, uint64_t y, uint64_t n_max, Ciphertext &result) {
+        const cpu::CoefficientTable &coefficients = cpu::bounded_lt_coefficients(PLAIN_MOD, y, n_max);
+        Ciphertext copy;
+        he::lt_bounded<TroyBackend>(bfv, coefficients.data(), coefficients.size(), on_device(x, copy), result);
     }
 }
@@ -8,12 +8,18 @@
 #include <execution>
 #include <tbb/parallel_for_each.h>
 #include <thread>
+#include <map>
+#include <shared_mutex>
 
 #include "constants.h"
+#include "trace.h"
 
 namespace gpu {
     class BFVContext {
         troy::MemoryPoolHandle pool;
+        // Encoded constant plaintexts, keyed by their value modulo the plain modulus
+        std::map<uint64_t, troy::Plaintext> constants;
+        std::shared_mutex constants_mutex;
     public:
         troy::EncryptionParameters parms;
         troy::HeContextPointer context;
@@ -28,6 +34,76 @@ namespace gpu {
 
         BFVContext(const troy::EncryptionParameters &parms);
         ~BFVContext();
+
+        /*
+            Returns a batched plaintext holding value in every slot, already moved to the
+            device when one is available. Encoding a full slot vector is expensive, so
+            plaintexts are created on first use and cached for the lifetime of the context.
+        */
+        const troy::Plaintext &constant(int64_t value);
+
+        // Encodes value in every slot of ptx, on the device when one is available, without caching it
+        void encode_constant(int64_t value, troy::Plaintext &ptx);
+
+        // Precompute the constants from first to last (inclusive)
+        void warm_constants(int64_t first, int64_t last);
+
+        // Precompute the constants for every value in [begin, end)
+        template <typename It>
+        void warm_constants(It begin, It end) {
+            for (It it = begin; it != end; ++it)
+                constant(*it);
+        }
     };
-}
 
+    /*
+        Backend traits of the algorithms of comparison.h for troy. Operations are issued
+        one after the other, the device parallelizes within each of them. Traced operations
+        are timed on the host, including any wait for the device.
+    */
+    struct TroyBackend {
+        using Context = BFVContext;
+        using Ciphertext = troy::Ciphertext;
+        using Plaintext = troy::Plaintext;
+
+        // The kernels keep the whole chain on the device, no noise model is tied to the troy parameters
+        static constexpr bool leveled = false;
+
+        static size_t size(const Ciphertext &x) { return x.polynomial_count(); }
+        static uint64_t plain_modulus(Context &bfv) { return PLAIN_MOD; }
+
+        static void encrypt(Context &bfv, const Plaintext &plain, Ciphertext &result) { HE_TRACE_OP("encrypt"); bfv.encryptor.encrypt_asymmetric(plain, result); }
+        static void encrypt_zero(Context &bfv, Ciphertext &result) { HE_TRACE_OP("encrypt"); bfv.encryptor.encrypt_zero_asymmetric(result); }
+
+        static void add(Context &bfv, const Ciphertext &a, const Ciphertext &b, Ciphertext &result) { bfv.evaluator.add(a, b, result); }
+        static void add_inplace(Context &bfv, Ciphertext &x, const Ciphertext &y) { bfv.evaluator.add_inplace(x, y); }
+        static void add_plain_inplace(Context &bfv, Ciphertext &x, const Plaintext &y) { HE_TRACE_OP("add_plain"); bfv.evaluator.add_plain_inplace(x, y); }
+        static void sub_inplace(Context &bfv, Ciphertext &x, const Ciphertext &y) { bfv.evaluator.sub_inplace(x, y); }
+        static void sub_plain(Context &bfv, const Ciphertext &x, const Plaintext &y, Ciphertext &result) { HE_TRACE_OP("sub_plain"); bfv.evaluator.sub_plain(x, y, result); }
+        static void negate_inplace(Context &bfv, Ciphertext &x) { bfv.evaluator.negate_inplace(x); }
+
+        static void multiply(Context &bfv, const Ciphertext &a, const Ciphertext &b, Ciphertext &result) { HE_TRACE_OP("multiply"); bfv.evaluator.multiply(a, b, result); }
+        static void multiply_inplace(Context &bfv, Ciphertext &x, const Ciphertext &y) { HE_TRACE_OP("multiply"); bfv.evaluator.multiply_inplace(x, y); }
+        static void square(Context &bfv, const Ciphertext &x, Ciphertext &result) { HE_TRACE_OP("square"); bfv.evaluator.square(x, result); }
+        static void square_inplace(Context &bfv, Ciphertext &x) { HE_TRACE_OP("square"); bfv.evaluator.square_inplace(x); }
+        static void multiply_plain(Context &bfv, const Ciphertext &x, const Plaintext &y, Ciphertext &result) { HE_TRACE_OP("multiply_plain"); bfv.evaluator.multiply_plain(x, y, result); }
+        static void multiply_plain_inplace(Context &bfv, Ciphertext &x, const Plaintext &y) { HE_TRACE_OP("multiply_plain"); bfv.evaluator.multiply_plain_inplace(x, y); }
+        static void relinearize_inplace(Context &bfv, Ciphertext &x) { HE_TRACE_OP("relinearize"); bfv.evaluator.relinearize_inplace(x, bfv.relin_keys); }
+
+        // A device plaintext holds a full slot vector, about 256 KB, so the (p+1)/2 coefficients of a
+        // univariate table would take gigabytes if cached: they are encoded when used instead
+        static const Plaintext &coefficient(Context &bfv, int64_t value, Plaintext &scratch) {
+            bfv.encode_constant(value, scratch);
+            return scratch;
+        }
+
+        static bool has_secret_key(Context &bfv) { return true; }
+        static int noise_budget(Context &bfv, const Ciphertext &x) { return bfv.decryptor.invariant_noise_budget(x); }
+
+        template <typename F>
+        static void parallel_for(size_t n, F body) {
+            for (size_t i = 0; i < n; ++i)
+                body(i);
+        }
+    };
+}
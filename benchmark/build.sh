@@ -1,11 +1,62 @@
 #! /bin/bash
 
+# Usage: ./build.sh [--cpu-only | --cuda] [--trace]
+# The GPU backend is built when troy and CUDA are found, --cpu-only builds the library,
+# the benchmarks and the anonymizer with SEAL only, --cuda requires the GPU backend.
+# --trace compiles in the tracing of trace.h (main.out --trace=<path>), every file must share it.
+WITH_CUDA=auto
+TRACE_FLAGS=""
+for arg in "$@"; do
+    case "$arg" in
+        --cpu-only) WITH_CUDA=no ;;
+        --cuda) WITH_CUDA=yes ;;
+        --trace) TRACE_FLAGS="-DHE_TRACE" ;;
+        *) echo "Unknown option: $arg"; exit 1 ;;
+    esac
+done
+if [ "$WITH_CUDA" = auto ]; then
+    if [ -f ../troy-nova/src/troy.h ] && [ -d /usr/local/cuda ]; then WITH_CUDA=yes; else WITH_CUDA=no; fi
+fi
+
+CUDA_FLAGS=""
+CUDA_LIBS=""
+CUDA_OBJECTS=""
+if [ "$WITH_CUDA" = yes ]; then
+    CUDA_FLAGS="-DHAVE_CUDA -I../troy-nova/src/ -I/usr/local/cuda/include"
+    CUDA_LIBS="-L/usr/local/cuda/lib64 -ltroy -lcudart"
+    CUDA_OBJECTS="libbfvcuda.o"
+    echo "Building with the CUDA backend"
+else
+    echo "Building without CUDA"
+fi
+
+set -e
+
 # Build library
-g++ -fPIC -std=c++17 -fopenmp -g -c bfv.cpp -o libbfv.o -I/usr/local/include/SEAL-4.1 -lseal-4.1 -ltbb
-g++ -fPIC -std=c++17 -fopenmp -g -c bfvcuda.cpp -o libbfvcuda.o -I../troy-nova/src/ -I/usr/local/cuda/include -L/usr/local/cuda/lib64 -ltroy -lcudart -ltbb
-g++ -fPIC -std=c++17 -g -c util.cpp -o libutil.o -I/usr/local/include/SEAL-4.1 -I../troy-nova/src/ -I/usr/local/cuda/include -lseal-4.1 -ltroy
-g++ -shared -g libbfv.o libutil.o libbfvcuda.o libbfv.h libbfvcuda.h -o libbfv.so -I/usr/local/include/SEAL-4.1 -I../troy-nova/src/ -I/usr/local/cuda/include -L/usr/local/cuda/lib64 -lseal-4.1 -ltroy -lcudart
+g++ -fPIC -std=c++17 $TRACE_FLAGS -fopenmp -g -c bfv.cpp -o libbfv.o -I/usr/local/include/SEAL-4.1 -lseal-4.1 -ltbb
+g++ -fPIC -std=c++17 $TRACE_FLAGS -g -c trace.cpp -o libtrace.o
+g++ -fPIC -std=c++17 $TRACE_FLAGS -g -c scheduler.cpp -o libscheduler.o -I/usr/local/include/SEAL-4.1 -lseal-4.1 -ltbb
+g++ -fPIC -std=c++17 $TRACE_FLAGS -g -c noise.cpp -o libnoise.o -I/usr/local/include/SEAL-4.1 -lseal-4.1
+g++ -fPIC -std=c++17 $TRACE_FLAGS -g -c coefficients.cpp -o libcoefficients.o -I/usr/local/include/SEAL-4.1 -lseal-4.1
+g++ -fPIC -std=c++17 $TRACE_FLAGS -g -c aggregator.cpp -o libaggregator.o -I/usr/local/include/SEAL-4.1 -lseal-4.1 -ltbb
+g++ -fPIC -std=c++17 $TRACE_FLAGS -g -c mask.cpp -o libmask.o -I/usr/local/include/SEAL-4.1 -lseal-4.1
+g++ -fPIC -std=c++17 $TRACE_FLAGS -g -c slot_layout.cpp -o libslot_layout.o -ltbb
+g++ -fPIC -std=c++17 $TRACE_FLAGS -g -c dataset.cpp -o libdataset.o -I/usr/local/include/SEAL-4.1 -ltbb
+# The point-in-polygon loop is vectorized through its omp simd pragma
+g++ -fPIC -std=c++17 $TRACE_FLAGS -O3 -fopenmp-simd -g -c geoindex.cpp -o libgeoindex.o -I/usr/local/include/SEAL-4.1 -ltbb
+g++ -fPIC -std=c++17 $TRACE_FLAGS -g -c snapshot.cpp -o libsnapshot.o -I/usr/local/include/SEAL-4.1 -lseal-4.1 -ltbb
+g++ -fPIC -std=c++17 $TRACE_FLAGS -g -c keys.cpp -o libkeys.o -I/usr/local/include/SEAL-4.1 -lseal-4.1 -ltbb
+g++ -fPIC -std=c++17 $TRACE_FLAGS -g -c protocol.cpp -o libprotocol.o -I/usr/local/include/SEAL-4.1 -lseal-4.1
+g++ -fPIC -std=c++17 $TRACE_FLAGS -g -c server.cpp -o libserver.o -I/usr/local/include/SEAL-4.1 -lseal-4.1 -ltbb -lpthread
+if [ "$WITH_CUDA" = yes ]; then
+    g++ -fPIC -std=c++17 $TRACE_FLAGS -fopenmp -g -c bfvcuda.cpp -o libbfvcuda.o $CUDA_FLAGS $CUDA_LIBS -ltbb
+fi
+g++ -fPIC -std=c++17 $TRACE_FLAGS -g -c util.cpp -o libutil.o -I/usr/local/include/SEAL-4.1 $CUDA_FLAGS -lseal-4.1
+g++ -shared -g libbfv.o libscheduler.o libnoise.o libcoefficients.o libaggregator.o libmask.o libslot_layout.o libdataset.o libgeoindex.o libsnapshot.o libkeys.o libprotocol.o libserver.o libtrace.o libutil.o $CUDA_OBJECTS -o libbfv.so -I/usr/local/include/SEAL-4.1 $CUDA_FLAGS -lseal-4.1 $CUDA_LIBS
 # g++ -shared libbfv.o libbfv_extern.h -o libbfv_extern.so -I/usr/local/include/SEAL-4.1 -lseal-4.1
 
 # Build main for testing
-g++ -std=c++17 -fopenmp -g main.cpp ./libbfv.so -isystem benchmark/include -lbenchmark -lpthread -I/usr/local/include/SEAL-4.1 -I../troy-nova/src/ -I/usr/local/cuda/include -L/usr/local/cuda/lib64 -lseal-4.1 -ltroy -ltbb -lcudart -o main.out
\ No newline at end of file
+g++ -std=c++17 $TRACE_FLAGS -fopenmp -g main.cpp ./libbfv.so -isystem benchmark/include -lbenchmark -lpthread -I/usr/local/include/SEAL-4.1 $CUDA_FLAGS -lseal-4.1 -ltbb $CUDA_LIBS -o main.out
+
+# Build the anonymizer service
+g++ -std=c++17 $TRACE_FLAGS -g anonymizer.cpp ./libbfv.so -lpthread -I/usr/local/include/SEAL-4.1 -lseal-4.1 -ltbb $CUDA_LIBS -o anonymizer.out
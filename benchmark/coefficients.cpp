@@ -0,0 +1,246 @@
+#include "coefficients.h"
+#include "libbfv.h"
+
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <shared_mutex>
+#include <stdexcept>
+#include <tuple>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cpu {
+    namespace {
+        const char COEFFICIENT_FILE_MAGIC[8] = { 'U', 'N', 'I', 'V', 'P', 'O', 'L', 'Y' };
+
+        struct CoefficientFileHeader {
+            char magic[8];
+            uint32_t version;
+            uint32_t reserved;
+            uint64_t plain_modulus;
+            uint64_t count;
+            uint64_t checksum;
+        };
+
+        // Products of two residues of a 32-bit modulus fit in 64 bits
+        uint64_t mod_pow(uint64_t base, uint64_t exponent, uint64_t p) {
+            uint64_t result = 1;
+            for (base %= p; exponent > 0; exponent >>= 1) {
+                if (exponent % 2 == 1)
+                    result = result * base % p;
+                base = base * base % p;
+            }
+            return result;
+        }
+    }
+
+    uint64_t fnv1a(const void *data, size_t size, uint64_t hash) {
+        const unsigned char *bytes = static_cast<const unsigned char *>(data);
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    CoefficientTable::CoefficientTable(std::vector<int64_t> coefficients) : owned(std::move(coefficients)) {
+        this->coefficients = owned.data();
+        count = owned.size();
+    }
+
+    CoefficientTable::CoefficientTable(CoefficientTable &&other) noexcept {
+        *this = std::move(other);
+    }
+
+    CoefficientTable &CoefficientTable::operator=(CoefficientTable &&other) noexcept {
+        if (this != &other) {
+            release();
+            bool is_owned = other.mapping == nullptr;
+            owned = std::move(other.owned);
+            coefficients = is_owned ? owned.data() : other.coefficients;
+            count = other.count;
+            mapping = other.mapping;
+            mapping_size = other.mapping_size;
+
+            other.coefficients = nullptr;
+            other.count = 0;
+            other.mapping = nullptr;
+            other.mapping_size = 0;
+        }
+        return *this;
+    }
+
+    CoefficientTable::~CoefficientTable() {
+        release();
+    }
+
+    void CoefficientTable::release() {
+        if (mapping != nullptr)
+            munmap(mapping, mapping_size);
+        mapping = nullptr;
+        mapping_size = 0;
+        owned.clear();
+        coefficients = nullptr;
+        count = 0;
+    }
+
+    CoefficientTable CoefficientTable::map(const std::string &path, uint64_t plain_modulus) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("CoefficientTable: cannot open " + path);
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(CoefficientFileHeader)) {
+            close(fd);
+            throw std::runtime_error("CoefficientTable: " + path + " is truncated");
+        }
+
+        size_t size = st.st_size;
+        void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+            throw std::runtime_error("CoefficientTable: cannot map " + path);
+
+        CoefficientTable table;
+        table.mapping = mapping;
+        table.mapping_size = size;
+
+        CoefficientFileHeader header;
+        std::memcpy(&header, mapping, sizeof(header));
+        const int64_t *coefficients = reinterpret_cast<const int64_t *>(static_cast<const char *>(mapping) + sizeof(header));
+
+        if (std::memcmp(header.magic, COEFFICIENT_FILE_MAGIC, sizeof(header.magic)) != 0)
+            throw std::runtime_error("CoefficientTable: " + path + " is not a coefficient file");
+        if (header.version != COEFFICIENT_FILE_VERSION)
+            throw std::runtime_error("CoefficientTable: " + path + " has unsupported version " + std::to_string(header.version));
+        if (header.plain_modulus != plain_modulus)
+            throw std::runtime_error("CoefficientTable: " + path + " was generated for plain modulus " + std::to_string(header.plain_modulus));
+        if (header.count != plain_modulus / 2 + 1 || size != sizeof(header) + header.count * sizeof(int64_t))
+            throw std::runtime_error("CoefficientTable: " + path + " has an invalid size");
+        if (fnv1a(coefficients, header.count * sizeof(int64_t)) != header.checksum)
+            throw std::runtime_error("CoefficientTable: " + path + " failed the checksum");
+
+        table.coefficients = coefficients;
+        table.count = header.count;
+        return table;
+    }
+
+    std::string univ_poly_coefficients_path(const std::string &directory, uint64_t plain_modulus) {
+        return directory + "/univ_poly_" + std::to_string(plain_modulus) + ".bin";
+    }
+
+    void save_univ_poly_coefficients(const std::string &path, uint64_t plain_modulus, const std::vector<int64_t> &coefficients) {
+        CoefficientFileHeader header;
+        std::memcpy(header.magic, COEFFICIENT_FILE_MAGIC, sizeof(header.magic));
+        header.version = COEFFICIENT_FILE_VERSION;
+        header.reserved = 0;
+        header.plain_modulus = plain_modulus;
+        header.count = coefficients.size();
+        header.checksum = fnv1a(coefficients.data(), coefficients.size() * sizeof(int64_t));
+
+        // Write to a temporary file first, so that concurrent readers never see a partial table
+        std::string tmp_path = path + ".tmp";
+        {
+            std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char *>(coefficients.data()), coefficients.size() * sizeof(int64_t));
+            if (!out)
+                throw std::runtime_error("save_univ_poly_coefficients: cannot write " + tmp_path);
+        }
+        if (std::rename(tmp_path.c_str(), path.c_str()) != 0)
+            throw std::runtime_error("save_univ_poly_coefficients: cannot rename " + tmp_path + " to " + path);
+    }
+
+    CoefficientTable load_univ_poly_coefficients(uint64_t plain_modulus, const std::string &directory) {
+        std::string path = univ_poly_coefficients_path(directory, plain_modulus);
+        try {
+            return CoefficientTable::map(path, plain_modulus);
+        } catch (const std::runtime_error &) {
+            // Missing or stale: generate the table once and keep it for the next runs
+        }
+
+        std::vector<int64_t> coefficients;
+        calc_univ_poly_coefficients(plain_modulus, coefficients);
+        try {
+            save_univ_poly_coefficients(path, plain_modulus, coefficients);
+            return CoefficientTable::map(path, plain_modulus);
+        } catch (const std::runtime_error &e) {
+            std::cerr << e.what() << std::endl;
+            return CoefficientTable(std::move(coefficients));
+        }
+    }
+
+    std::vector<int64_t> calc_bounded_lt_coefficients(uint64_t plain_modulus, uint64_t k, uint64_t n_max) {
+        // Newton's forward difference formula: f(x) = sum_{j<=n} D_j * x (x-1) ... (x-j+1) / j!,
+        // with D_j = (Delta^j f)(0), expanded into monomials one falling factorial at a time
+        const uint64_t p = plain_modulus;
+        if (n_max >= p)
+            throw std::invalid_argument("calc_bounded_lt_coefficients: the domain [0, n_max] must be smaller than the plain modulus");
+
+        std::vector<uint64_t> differences(n_max + 1);
+        for (uint64_t x = 0; x <= n_max; ++x)
+            differences[x] = x < k ? 1 : 0;
+
+        std::vector<uint64_t> coefficients(n_max + 1, 0);
+        std::vector<uint64_t> falling { 1 };    // x (x-1) ... (x-j+1), lowest degree first
+        uint64_t inverse_factorial = 1;         // 1 / j!
+        for (uint64_t j = 0; j <= n_max; ++j) {
+            if (j > 0) {
+                // Multiply by x - (j-1), from the highest degree down
+                falling.push_back(0);
+                for (size_t d = j; d > 0; --d)
+                    falling[d] = (falling[d - 1] + p - falling[d] * (j - 1) % p) % p;
+                falling[0] = (p - falling[0] * (j - 1) % p) % p;
+                inverse_factorial = inverse_factorial * mod_pow(j, p - 2, p) % p;
+            }
+
+            uint64_t scale = differences[0] * inverse_factorial % p;
+            if (scale != 0) {
+                for (size_t d = 0; d <= j; ++d)
+                    coefficients[d] = (coefficients[d] + scale * falling[d]) % p;
+            }
+
+            // Next order of differences, one value shorter
+            for (uint64_t x = 0; x + j < n_max; ++x)
+                differences[x] = (differences[x + 1] + p - differences[x]) % p;
+        }
+
+        std::vector<int64_t> result(coefficients.begin(), coefficients.end());
+        for (auto &c : result) {
+            if (c > static_cast<int64_t>(p / 2))
+                c -= p;
+        }
+        while (result.size() > 1 && result.back() == 0)
+            result.pop_back();
+        return result;
+    }
+
+    uint64_t bounded_domain(uint64_t users) {
+        uint64_t size = 1;
+        while (size - 1 < users)
+            size <<= 1;
+        return size - 1;
+    }
+
+    const CoefficientTable &bounded_lt_coefficients(uint64_t plain_modulus, uint64_t k, uint64_t n_max) {
+        static std::shared_mutex mutex;
+        static std::map<std::tuple<uint64_t, uint64_t, uint64_t>, CoefficientTable> tables;
+
+        // Every threshold above n_max is the constant 1
+        const auto key = std::make_tuple(plain_modulus, std::min(k, n_max + 1), n_max);
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            auto it = tables.find(key);
+            if (it != tables.end())
+                return it->second;
+        }
+
+        // Interpolate without holding the lock, a concurrent miss keeps the first table
+        CoefficientTable table(calc_bounded_lt_coefficients(plain_modulus, k, n_max));
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        return tables.emplace(key, std::move(table)).first->second;
+    }
+}
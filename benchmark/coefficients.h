@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace cpu {
+    // FNV-1a hash of a byte range, used to detect corrupted files. Pass the previous
+    // hash to continue it over several ranges.
+    constexpr uint64_t FNV1A_OFFSET_BASIS = 14695981039346656037ULL;
+    uint64_t fnv1a(const void *data, size_t size, uint64_t hash = FNV1A_OFFSET_BASIS);
+
+    /*
+        Read-only table of univariate comparison polynomial coefficients.
+        The coefficients are either owned by the table or memory-mapped from a
+        coefficient file, in which case they are never copied.
+    */
+    class CoefficientTable {
+        std::vector<int64_t> owned;
+        const int64_t *coefficients = nullptr;
+        size_t count = 0;
+        void *mapping = nullptr;
+        size_t mapping_size = 0;
+
+        void release();
+    public:
+        CoefficientTable() = default;
+        explicit CoefficientTable(std::vector<int64_t> coefficients);
+        CoefficientTable(CoefficientTable &&other) noexcept;
+        CoefficientTable &operator=(CoefficientTable &&other) noexcept;
+        CoefficientTable(const CoefficientTable &) = delete;
+        CoefficientTable &operator=(const CoefficientTable &) = delete;
+        ~CoefficientTable();
+
+        // Maps a coefficient file, throws std::runtime_error if it is missing, corrupted
+        // or was generated for a different plain modulus
+        static CoefficientTable map(const std::string &path, uint64_t plain_modulus);
+
+        const int64_t *data() const { return coefficients; }
+        size_t size() const { return count; }
+        const int64_t *begin() const { return coefficients; }
+        const int64_t *end() const { return coefficients + count; }
+        const int64_t &operator[](size_t i) const { return coefficients[i]; }
+        const int64_t &back() const { return coefficients[count - 1]; }
+    };
+
+    /*
+        Coefficient file layout, all fields little endian:
+            magic           8 bytes, "UNIVPOLY"
+            version         uint32
+            reserved        uint32
+            plain_modulus   uint64
+            count           uint64
+            checksum        uint64, FNV-1a of the coefficient bytes
+            coefficients    count x int64
+    */
+    constexpr uint32_t COEFFICIENT_FILE_VERSION = 2;
+
+    std::string univ_poly_coefficients_path(const std::string &directory, uint64_t plain_modulus);
+    void save_univ_poly_coefficients(const std::string &path, uint64_t plain_modulus, const std::vector<int64_t> &coefficients);
+
+    /*
+        Maps the coefficient file for plain_modulus from directory. If it does not exist or
+        is invalid, the coefficients are generated with calc_univ_poly_coefficients and
+        saved, so that every plain modulus only pays for the generation once.
+    */
+    CoefficientTable load_univ_poly_coefficients(uint64_t plain_modulus, const std::string &directory = ".");
+
+    /*
+        Coefficients c_0 ... c_n, centered in (-p/2, p/2], of the polynomial of degree at most n = n_max
+        over Z_p with f(x) = 1 for x in [0, k) and f(x) = 0 for x in [k, n_max]: the comparison [x < k]
+        for values known to lie within [0, n_max], such as a sum of n_max binary vectors. Trailing zero
+        coefficients are dropped. Interpolated in O(n_max^2) operations, for a prime plain modulus
+        of at most 32 bits; throws std::invalid_argument if n_max is not smaller than it.
+    */
+    std::vector<int64_t> calc_bounded_lt_coefficients(uint64_t plain_modulus, uint64_t k, uint64_t n_max);
+
+    // Smallest domain [0, 2^m - 1] holding [0, users], so that aggregates of close user counts share their polynomial
+    uint64_t bounded_domain(uint64_t users);
+
+    /*
+        Table of calc_bounded_lt_coefficients, computed on first use and cached for the lifetime
+        of the process. Lookups are thread-safe and returned tables are never freed.
+    */
+    const CoefficientTable &bounded_lt_coefficients(uint64_t plain_modulus, uint64_t k, uint64_t n_max);
+}
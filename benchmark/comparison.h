@@ -0,0 +1,606 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "trace.h"
+
+/*
+    Comparison algorithms written once for every backend. A backend is a traits type with
+        using Context, Ciphertext, Plaintext
+        size(x)                         number of polynomials of x
+        plain_modulus(bfv)
+        encrypt(bfv, plain, result), encrypt_zero(bfv, result)
+        add, add_inplace, add_plain_inplace, sub_inplace, sub_plain, negate_inplace
+        multiply, multiply_inplace, square, square_inplace, multiply_plain, multiply_plain_inplace
+        relinearize_inplace(bfv, x)
+        has_secret_key(bfv), noise_budget(bfv, x)
+                                        only used with NOISE_DEBUG, the budget is measured when there is a secret key
+        parallel_for(n, body)           runs body(i) for i in [0, n), in parallel when the backend can
+        leveled                         constexpr bool, whether the backend switches ciphertexts down the chain
+        coefficient(bfv, value, scratch)
+                                        plaintext of a polynomial coefficient, either a cached one or
+                                        value encoded into scratch, which the caller keeps until it is used
+    as static functions taking the context first, and Context::constant(value) returning a cached plaintext.
+    A leveled backend also provides
+        noise_model(bfv)                a NoiseModel of the parameters of the context
+        level(bfv, x)                   number of primes x has dropped since the first level
+        mod_switch_to_next_inplace(bfv, x)
+    Ciphertexts passed in are expected to be wherever the backend computes (on the device for troy).
+
+    The algorithms take the predicted noise budget of their input and return the one of their result.
+    On a leveled backend they follow the budget of every intermediate ciphertext with the noise model,
+    and switch it down to the lowest level whose fresh budget is still above it (NoiseModel::level_floor)
+    as soon as it is computed. A switch there loses no budget, so the predictions of the model still hold,
+    while every later multiplication, relinearization and addition works on fewer primes.
+    Operands at different levels are brought down to the lower one before a binary operation, which
+    does not lower the budget of its result either. With UNKNOWN_BUDGET nothing is switched.
+*/
+namespace he {
+    // Budget of a ciphertext whose noise is not predicted, which turns off the level switching
+    constexpr double UNKNOWN_BUDGET = -1.0;
+
+    // Block size s and number of blocks v chosen for a Paterson-Stockmeyer evaluation
+    struct PatersonStockmeyerPlan {
+        size_t s;
+        size_t v;
+        unsigned int depth;
+        size_t multiplications;
+    };
+
+    // Multiplicative depth of z^i when computed by compute_powers
+    inline unsigned int power_depth(size_t i) {
+        unsigned int depth = 0;
+        while ((size_t(1) << depth) < i)
+            ++depth;
+        return depth;
+    }
+
+    /*
+        Addition chain computing every requested power of one base at once. Each step is the product
+        of two earlier ones, x^e = x^a * x^b, and step 0 is x itself. Every power is computed in the
+        minimal depth ceil(log2(e)), and powers shared by several requested exponents are computed once.
+    */
+    struct PowerPlan {
+        struct Step {
+            uint64_t exponent;
+            size_t a, b;            // Steps multiplied together, a == b for a square
+            unsigned int depth;
+            bool requested;         // Handed back to the caller
+            bool factor;            // Used by a later step, so relinearized as soon as it is computed
+        };
+        std::vector<Step> steps;
+        std::map<uint64_t, size_t> index_of;
+
+        size_t index(uint64_t exponent) const {
+            auto it = index_of.find(exponent);
+            if (it == index_of.end())
+                throw std::invalid_argument("PowerPlan::index: x^" + std::to_string(exponent) + " is not planned");
+            return it->second;
+        }
+
+        unsigned int depth() const {
+            unsigned int depth = 0;
+            for (const auto &step : steps)
+                depth = std::max(depth, step.depth);
+            return depth;
+        }
+
+        size_t multiplications() const { return steps.size() - 1; }
+    };
+
+    /*
+        Plans the powers x^e for every e in exponents. A power of depth d is split as x^a * x^b with
+        a, b <= 2^(d-1), which keeps the depth minimal. Among those splits the planner prefers one whose
+        factors are both already planned, then one with the largest factor planned, and otherwise
+        x^(2^(d-1)) * x^(e - 2^(d-1)), as powers of two are shared by most exponents. This greedy choice
+        is not always the shortest chain, but a single exponent never takes more multiplications than
+        square and multiply, and a run of exponents, as for the baby steps, takes one each.
+    */
+    inline PowerPlan plan_powers(std::vector<uint64_t> exponents) {
+        PowerPlan plan;
+        plan.steps.push_back({ 1, 0, 0, 0, false, false });
+        plan.index_of[1] = 0;
+
+        std::function<size_t(uint64_t)> plan_power = [&](uint64_t e) -> size_t {
+            auto it = plan.index_of.find(e);
+            if (it != plan.index_of.end())
+                return it->second;
+
+            // Both factors lie within [e - half, half]
+            const unsigned int depth = power_depth(e);
+            const uint64_t half = uint64_t(1) << (depth - 1);
+            uint64_t a = 0;
+            for (auto b = plan.index_of.lower_bound(e - half); b != plan.index_of.end() && 2 * b->first <= e; ++b) {
+                if (plan.index_of.count(e - b->first)) {
+                    a = e - b->first;
+                    break;
+                }
+            }
+            if (a == 0) {
+                auto largest = plan.index_of.upper_bound(half);
+                if (largest != plan.index_of.begin() && 2 * std::prev(largest)->first >= e)
+                    a = std::prev(largest)->first;
+            }
+            if (a == 0)
+                a = half;
+
+            size_t i_a = plan_power(a), i_b = plan_power(e - a);
+            plan.steps[i_a].factor = plan.steps[i_b].factor = true;
+            plan.steps.push_back({ e, i_a, i_b, depth, false, false });
+            plan.index_of[e] = plan.steps.size() - 1;
+            return plan.steps.size() - 1;
+        };
+
+        std::sort(exponents.begin(), exponents.end());
+        for (uint64_t e : exponents) {
+            if (e == 0)
+                throw std::invalid_argument("plan_powers: exponents must be positive");
+            plan.steps[plan_power(e)].requested = true;
+        }
+        return plan;
+    }
+
+    inline PatersonStockmeyerPlan plan_paterson_stockmeyer(size_t n_terms) {
+        // Try every block size and keep the one with the lowest depth, which determines the
+        // noise budget consumption, breaking ties with the number of ciphertext multiplications.
+        // The number of plain multiplications is always n_terms, so it does not affect the choice.
+        PatersonStockmeyerPlan best { 1, n_terms, ~0U, ~size_t(0) };
+        for (size_t s = 1; s <= std::max<size_t>(n_terms, 1); ++s) {
+            size_t v = (n_terms + s - 1) / s;
+            unsigned int levels = power_depth(v);
+
+            // Baby steps z^2 ... z^(s-1), plus z^s when there is more than one block
+            size_t baby_steps = (v > 1 ? s : s - 1);
+            size_t multiplications = (baby_steps > 1 ? baby_steps - 1 : 0)
+                + (levels > 1 ? levels - 1 : 0)     // Giant steps z^(s*2^l) by squaring
+                + (v - 1);                          // One multiplication per block combination
+
+            unsigned int depth = power_depth(s > 1 ? s - 1 : 1);
+            for (unsigned int l = 0; l < levels; ++l)
+                depth = std::max(depth, power_depth(s) + l) + 1;
+
+            if (depth < best.depth || (depth == best.depth && multiplications < best.multiplications))
+                best = { s, v, depth, multiplications };
+        }
+        return best;
+    }
+
+    // Powers of z used by a Paterson-Stockmeyer evaluation: the baby steps z^1 ... z^s, without z^s
+    // when there is a single block, and the giant steps z^(s*2^l) which combine the blocks
+    inline std::vector<uint64_t> paterson_stockmeyer_powers(const PatersonStockmeyerPlan &plan) {
+        std::vector<uint64_t> exponents;
+        for (size_t j = 1; j < plan.s || (j == plan.s && plan.v > 1); ++j)
+            exponents.push_back(j);
+        for (unsigned int l = 1; (size_t(1) << l) < plan.v; ++l)
+            exponents.push_back(uint64_t(plan.s) << l);
+        return exponents;
+    }
+
+    template <typename Backend>
+    void relinearize_if_needed(typename Backend::Context &bfv, typename Backend::Ciphertext &x) {
+        if (Backend::size(x) > 2)
+            Backend::relinearize_inplace(bfv, x);
+    }
+
+    // Predictions of the noise model of a leveled backend, unknown budgets stay unknown
+    template <typename Backend>
+    double predict_fresh(typename Backend::Context &bfv) {
+        if constexpr (Backend::leveled)
+            return Backend::noise_model(bfv).fresh();
+        return UNKNOWN_BUDGET;
+    }
+
+    template <typename Backend>
+    double predict_multiply(typename Backend::Context &bfv, double a, double b) {
+        if constexpr (Backend::leveled) {
+            if (a > 0 && b > 0)
+                return Backend::noise_model(bfv).multiply(a, b);
+        }
+        return UNKNOWN_BUDGET;
+    }
+
+    template <typename Backend>
+    double predict_multiply_plain(typename Backend::Context &bfv, double budget, int64_t value) {
+        if constexpr (Backend::leveled) {
+            if (budget > 0)
+                return Backend::noise_model(bfv).multiply_plain(budget, value);
+        }
+        return UNKNOWN_BUDGET;
+    }
+
+    template <typename Backend>
+    double predict_add_many(typename Backend::Context &bfv, double budget, size_t count) {
+        if constexpr (Backend::leveled) {
+            if (budget > 0)
+                return Backend::noise_model(bfv).add_many(budget, count);
+        }
+        return UNKNOWN_BUDGET;
+    }
+
+    template <typename Backend>
+    size_t level(typename Backend::Context &bfv, const typename Backend::Ciphertext &x) {
+        if constexpr (Backend::leveled)
+            return Backend::level(bfv, x);
+        return 0;
+    }
+
+    // Switches x down to the lowest level its budget allows without losing any of it
+    template <typename Backend>
+    void drop_levels(typename Backend::Context &bfv, typename Backend::Ciphertext &x, double budget) {
+        if constexpr (Backend::leveled) {
+            if (budget <= 0)
+                return;
+            size_t floor = Backend::noise_model(bfv).level_floor(budget);
+            while (Backend::level(bfv, x) < floor)
+                Backend::mod_switch_to_next_inplace(bfv, x);
+        }
+    }
+
+    template <typename Backend>
+    void switch_to_level(typename Backend::Context &bfv, typename Backend::Ciphertext &x, size_t target) {
+        if constexpr (Backend::leveled) {
+            while (Backend::level(bfv, x) < target)
+                Backend::mod_switch_to_next_inplace(bfv, x);
+        }
+    }
+
+    // Brings two ciphertexts that are both consumed by an operation to the same level
+    template <typename Backend>
+    void align_levels(typename Backend::Context &bfv, typename Backend::Ciphertext &a, typename Backend::Ciphertext &b) {
+        size_t target = std::max(level<Backend>(bfv, a), level<Backend>(bfv, b));
+        switch_to_level<Backend>(bfv, a, target);
+        switch_to_level<Backend>(bfv, b, target);
+    }
+
+    // x itself when it is at the target level or below, otherwise a copy of x switched down to it
+    template <typename Backend>
+    const typename Backend::Ciphertext &at_level(typename Backend::Context &bfv, const typename Backend::Ciphertext &x, size_t target,
+        typename Backend::Ciphertext &copy) {
+        if (level<Backend>(bfv, x) >= target)
+            return x;
+        copy = x;
+        switch_to_level<Backend>(bfv, copy, target);
+        return copy;
+    }
+
+    // Brings x, replaced by the result of an operation, and y, used again later, to the same level
+    template <typename Backend>
+    const typename Backend::Ciphertext &align_operands(typename Backend::Context &bfv, typename Backend::Ciphertext &x,
+        const typename Backend::Ciphertext &y, typename Backend::Ciphertext &copy) {
+        size_t target = std::max(level<Backend>(bfv, x), level<Backend>(bfv, y));
+        switch_to_level<Backend>(bfv, x, target);
+        return at_level<Backend>(bfv, y, target, copy);
+    }
+
+    /*
+        Computes the powers of x planned by plan. powers and budgets are indexed like plan.steps and
+        budgets receives the predicted budget of every power, given the one of x. Every step only
+        depends on steps of lower depth, so each depth is computed in parallel. Powers are relinearized
+        only when they are factors of later ones, so requested powers may hold three polynomials.
+        Intermediate powers are released after the last depth that uses them, and x is only copied
+        when it is requested itself or must be relinearized.
+    */
+    template <typename Backend>
+    void compute_powers(typename Backend::Context &bfv, const PowerPlan &plan, const typename Backend::Ciphertext &x,
+        std::vector<typename Backend::Ciphertext> &powers, double budget, std::vector<double> &budgets) {
+        using Ciphertext = typename Backend::Ciphertext;
+        const auto &steps = plan.steps;
+        powers.clear();
+        powers.resize(steps.size());
+        budgets.assign(steps.size(), UNKNOWN_BUDGET);
+        budgets[0] = budget;
+
+        const Ciphertext *base = &x;
+        if (steps[0].requested || (steps[0].factor && Backend::size(x) > 2)) {
+            powers[0] = x;
+            if (steps[0].factor)
+                relinearize_if_needed<Backend>(bfv, powers[0]);
+            base = &powers[0];
+        }
+        auto power = [&](size_t i) -> const Ciphertext & { return i == 0 ? *base : powers[i]; };
+
+        const unsigned int depth = plan.depth();
+        std::vector<std::vector<size_t>> by_depth(depth + 1);
+        std::vector<unsigned int> last_use(steps.size(), 0);
+        for (size_t i = 1; i < steps.size(); ++i) {
+            by_depth[steps[i].depth].push_back(i);
+            last_use[steps[i].a] = std::max(last_use[steps[i].a], steps[i].depth);
+            last_use[steps[i].b] = std::max(last_use[steps[i].b], steps[i].depth);
+        }
+
+        for (unsigned int d = 1; d <= depth; ++d) {
+            const auto &current = by_depth[d];
+            Backend::parallel_for(current.size(), [&](size_t k) {
+                const size_t i = current[k];
+                const auto &step = steps[i];
+                if (step.a == step.b) {
+                    Backend::square(bfv, power(step.a), powers[i]);
+                } else {
+                    // Both factors may be used again, the one at the higher level is copied down
+                    Ciphertext a_copy, b_copy;
+                    size_t target = std::max(level<Backend>(bfv, power(step.a)), level<Backend>(bfv, power(step.b)));
+                    Backend::multiply(bfv, at_level<Backend>(bfv, power(step.a), target, a_copy),
+                        at_level<Backend>(bfv, power(step.b), target, b_copy), powers[i]);
+                }
+                budgets[i] = predict_multiply<Backend>(bfv, budgets[step.a], budgets[step.b]);
+                drop_levels<Backend>(bfv, powers[i], budgets[i]);
+                if (step.factor)
+                    Backend::relinearize_inplace(bfv, powers[i]);
+            });
+
+            for (size_t i = 0; i < steps.size(); ++i) {
+                if (!steps[i].requested && steps[i].factor && last_use[i] == d)
+                    powers[i] = Ciphertext();
+            }
+        }
+    }
+
+    template <typename Backend>
+    double mod_exp(typename Backend::Context &bfv, const typename Backend::Ciphertext &x, uint64_t exponent, typename Backend::Ciphertext &result,
+        double budget = UNKNOWN_BUDGET) {
+        if (exponent == 0) {
+            Backend::encrypt(bfv, bfv.constant(1), result);
+            return budget > 0 ? predict_fresh<Backend>(bfv) : UNKNOWN_BUDGET;
+        }
+        if (exponent == 1) {
+            result = x;
+            return budget;
+        }
+        HE_TRACE_STAGE("fermat");
+
+        // The chain starts from x itself, the result is left with three polynomials
+        const PowerPlan plan = plan_powers({ exponent });
+        std::vector<typename Backend::Ciphertext> powers;
+        std::vector<double> budgets;
+        compute_powers<Backend>(bfv, plan, x, powers, budget, budgets);
+        result = std::move(powers.back());
+
+#ifdef NOISE_DEBUG
+        // Noise exhaustion is normally ruled out in advance by check_noise_budget,
+        // measuring it here requires the secret key and a decryption: servers skip it.
+        if(Backend::has_secret_key(bfv) && Backend::noise_budget(bfv, result) <= 0) {
+            std::string err_msg("mod_exp: out of noise budget while calculating exp(X, " + std::to_string(exponent) + ")!");
+            throw std::logic_error(err_msg);
+        }
+#endif
+        return budgets.back();
+    }
+
+    template <typename Backend>
+    double equate_plain(typename Backend::Context &bfv, const typename Backend::Ciphertext &x, const typename Backend::Plaintext &y, typename Backend::Ciphertext &result,
+        double budget = UNKNOWN_BUDGET) {
+        // Equate
+        // EQ(x, y) = 1 - (x - y)^p-1
+        typename Backend::Ciphertext base;
+        Backend::sub_plain(bfv, x, y, base);
+
+        double result_budget = mod_exp<Backend>(bfv, base, Backend::plain_modulus(bfv) - 1, result, budget);
+        Backend::negate_inplace(bfv, result);
+        Backend::add_plain_inplace(bfv, result, bfv.constant(1));
+        return result_budget;
+    }
+
+    template <typename Backend>
+    double lt_range(typename Backend::Context &bfv, const typename Backend::Ciphertext &x, uint64_t y, typename Backend::Ciphertext &result,
+        double budget = UNKNOWN_BUDGET) {
+        // Range comparison from 0 to threshold - 1
+
+        // Equals [i][j] == 1 if x[j] == i, 0 otherwise
+        // Sum over i: if x[j] was within [0, y - 1] then result[j] == 1, 0 otherwise
+        if (y == 0) {
+            Backend::encrypt_zero(bfv, result);
+            return budget > 0 ? predict_fresh<Backend>(bfv) : UNKNOWN_BUDGET;
+        }
+        HE_TRACE_STAGE("lt_range");
+
+        // Every equality comes out at the same level, the first one starts the sum
+        typename Backend::Ciphertext equals;
+        double equals_budget = equate_plain<Backend>(bfv, x, bfv.constant(0), result, budget);
+        for(uint64_t i = 1; i < y; ++i) {
+            equate_plain<Backend>(bfv, x, bfv.constant(i), equals, budget);
+            // Sum every intermediate result immediately to avoid memory growth
+            Backend::add_inplace(bfv, result, equals);
+        }
+
+        // The terms are summed before relinearization, so it happens once
+        double result_budget = predict_add_many<Backend>(bfv, equals_budget, y);
+        drop_levels<Backend>(bfv, result, result_budget);
+        relinearize_if_needed<Backend>(bfv, result);
+        return result_budget;
+    }
+
+    template <typename Backend>
+    double paterson_stockmeyer(typename Backend::Context &bfv, const int64_t *coefficients, size_t n_terms, const typename Backend::Ciphertext &z, typename Backend::Ciphertext &result,
+        double budget = UNKNOWN_BUDGET) {
+        using Ciphertext = typename Backend::Ciphertext;
+        using Plaintext = typename Backend::Plaintext;
+
+        // p(z) = sum_{i<v} B_i(z) * z^(s*i), with blocks B_i(z) = sum_{j<s} c_{s*i+j} * z^j
+        const int64_t p = Backend::plain_modulus(bfv);
+        const double fresh = budget > 0 ? predict_fresh<Backend>(bfv) : UNKNOWN_BUDGET;
+        if (n_terms == 0) {
+            Backend::encrypt_zero(bfv, result);
+            return fresh;
+        }
+        const auto plan = plan_paterson_stockmeyer(n_terms);
+        const size_t s = plan.s, v = plan.v;
+
+        // Baby and giant steps, planned together so that the giant steps reuse the baby steps
+        const PowerPlan power_plan = plan_powers(paterson_stockmeyer_powers(plan));
+        std::vector<Ciphertext> z_powers;
+        std::vector<double> z_budgets;
+        {
+            HE_TRACE_STAGE("z_powers");
+            compute_powers<Backend>(bfv, power_plan, z, z_powers, budget, z_budgets);
+        }
+        std::vector<size_t> baby_steps(s, 0);
+        for (size_t j = 1; j < s; ++j)
+            baby_steps[j] = power_plan.index(j);
+
+        // Evaluate every block with plain multiplications only, summing the terms as they are.
+        // Blocks whose coefficients are all zero are skipped, which also avoids transparent ciphertexts.
+        std::vector<Ciphertext> blocks(v);
+        std::vector<double> block_budgets(v, UNKNOWN_BUDGET);
+        std::vector<char> present(v, false);
+        {
+            HE_TRACE_STAGE("block");
+            Backend::parallel_for(v, [&](size_t i) {
+                Ciphertext &block = blocks[i];
+                Plaintext scratch;
+                double lowest = fresh;
+                size_t count = 0;
+                for (size_t j = 1; j < s && i * s + j < n_terms; ++j) {
+                    int64_t alpha = coefficients[i * s + j];
+                    if (alpha % p == 0)
+                        continue;
+
+                    if (present[i]) {
+                        Ciphertext term;
+                        Backend::multiply_plain(bfv, z_powers[baby_steps[j]], Backend::coefficient(bfv, alpha, scratch), term);
+                        align_levels<Backend>(bfv, block, term);
+                        Backend::add_inplace(bfv, block, term);
+                    } else {
+                        Backend::multiply_plain(bfv, z_powers[baby_steps[j]], Backend::coefficient(bfv, alpha, scratch), block);
+                        present[i] = true;
+                    }
+                    lowest = std::min(lowest, predict_multiply_plain<Backend>(bfv, z_budgets[baby_steps[j]], alpha));
+                    ++count;
+                }
+
+                int64_t alpha_zero = coefficients[i * s];
+                if (alpha_zero % p != 0) {
+                    if (present[i])
+                        Backend::add_plain_inplace(bfv, block, Backend::coefficient(bfv, alpha_zero, scratch));
+                    else
+                        Backend::encrypt(bfv, Backend::coefficient(bfv, alpha_zero, scratch), block);
+                    present[i] = true;
+                }
+                block_budgets[i] = predict_add_many<Backend>(bfv, lowest, count);
+                if (present[i])
+                    drop_levels<Backend>(bfv, block, block_budgets[i]);
+            });
+        }
+
+        // Combine the blocks pairwise, Horner-style, with the giant steps z^(s*2^l):
+        // level l + 1 holds P_k = P_2k + z^(s*2^l) * P_2k+1, until a single polynomial is left
+        // Blocks and their combinations are relinearized only when they are multiplied,
+        // so the result may hold three polynomials.
+        HE_TRACE_STAGE("giant_steps");
+        for (unsigned int l = 0; blocks.size() > 1; ++l) {
+            // The last giant step is no factor of another power, it is relinearized before it is shared
+            const size_t giant_index = power_plan.index(uint64_t(s) << l);
+            Ciphertext &giant_step = z_powers[giant_index];
+            const double giant_budget = z_budgets[giant_index];
+            relinearize_if_needed<Backend>(bfv, giant_step);
+
+            std::vector<Ciphertext> combined((blocks.size() + 1) / 2);
+            std::vector<double> combined_budgets(combined.size(), UNKNOWN_BUDGET);
+            std::vector<char> combined_present(combined.size(), false);
+            Backend::parallel_for(combined.size(), [&](size_t k) {
+                size_t low = 2 * k, high = 2 * k + 1;
+                if (high < blocks.size() && present[high]) {
+                    Ciphertext giant_copy;
+                    relinearize_if_needed<Backend>(bfv, blocks[high]);
+                    Backend::multiply(bfv, blocks[high], align_operands<Backend>(bfv, blocks[high], giant_step, giant_copy), combined[k]);
+                    combined_budgets[k] = predict_multiply<Backend>(bfv, block_budgets[high], giant_budget);
+                    if (present[low]) {
+                        align_levels<Backend>(bfv, combined[k], blocks[low]);
+                        Backend::add_inplace(bfv, combined[k], blocks[low]);
+                        combined_budgets[k] = predict_add_many<Backend>(bfv, std::min(combined_budgets[k], block_budgets[low]), 2);
+                    }
+                    drop_levels<Backend>(bfv, combined[k], combined_budgets[k]);
+                    combined_present[k] = true;
+                } else {
+                    combined[k] = std::move(blocks[low]);
+                    combined_budgets[k] = block_budgets[low];
+                    combined_present[k] = present[low];
+                }
+            });
+
+            blocks = std::move(combined);
+            block_budgets = std::move(combined_budgets);
+            present = std::move(combined_present);
+        }
+
+        if (present[0]) {
+            result = std::move(blocks[0]);
+            return block_budgets[0];
+        }
+        Backend::encrypt_zero(bfv, result);
+        return fresh;
+    }
+
+    /*
+        [x < k] for x known to lie within [0, n_max], with the n_coefficients of calc_bounded_lt_coefficients
+        for k and n_max: a polynomial of degree at most n_max evaluated by Paterson-Stockmeyer, in depth
+        about log2(n_max) + 1 and about 2 sqrt(n_max) ciphertext multiplications, whatever the plain modulus.
+    */
+    template <typename Backend>
+    double lt_bounded(typename Backend::Context &bfv, const int64_t *coefficients, size_t n_coefficients,
+        const typename Backend::Ciphertext &x, typename Backend::Ciphertext &result, double budget = UNKNOWN_BUDGET) {
+        HE_TRACE_STAGE("lt_bounded");
+        double result_budget = paterson_stockmeyer<Backend>(bfv, coefficients, n_coefficients, x, result, budget);
+        relinearize_if_needed<Backend>(bfv, result);
+        return result_budget;
+    }
+
+    /*
+        [x < y] for x - y in [-(p-1)/2, (p-1)/2], the sign of x - y centered modulo p, such as
+        x, y in [0, (p-1)/2]. With n_coefficients = (p+1)/2 coefficients of
+        calc_univ_poly_coefficients: the odd ones of z g(z^2) followed by the one of z^(p-1).
+        The budget is the smaller of the ones of x and y.
+    */
+    template <typename Backend>
+    double lt_univariate(typename Backend::Context &bfv, const int64_t *coefficients, size_t n_coefficients,
+        const typename Backend::Ciphertext &x, const typename Backend::Ciphertext &y, typename Backend::Ciphertext &result,
+        double budget = UNKNOWN_BUDGET) {
+        using Ciphertext = typename Backend::Ciphertext;
+        HE_TRACE_STAGE("lt_univariate");
+        Ciphertext z = x, y_copy;
+        Backend::sub_inplace(bfv, z, align_operands<Backend>(bfv, z, y, y_copy));
+        relinearize_if_needed<Backend>(bfv, z);
+        double z_budget = predict_add_many<Backend>(bfv, budget, 2);
+
+        // z^2 and z^(p-1) come from one power plan, z^2 being the first of the squares towards z^(p-1)
+        const uint64_t p_minus_one = Backend::plain_modulus(bfv) - 1;
+        const PowerPlan plan = plan_powers({ 2, p_minus_one });
+        std::vector<Ciphertext> z_powers;
+        std::vector<double> z_budgets;
+        {
+            HE_TRACE_STAGE("fermat");
+            compute_powers<Backend>(bfv, plan, z, z_powers, z_budget, z_budgets);
+        }
+
+        // Evaluate the second term as Zg(Z^2), with g evaluated by Paterson-Stockmeyer
+        Ciphertext second_term, z_copy;
+        Ciphertext &z2 = z_powers[plan.index(2)];
+        relinearize_if_needed<Backend>(bfv, z2);
+        double second_budget = paterson_stockmeyer<Backend>(bfv, coefficients, n_coefficients - 1, z2, second_term, z_budgets[plan.index(2)]);
+        z2 = Ciphertext();
+        relinearize_if_needed<Backend>(bfv, second_term);
+        Backend::multiply_inplace(bfv, second_term, align_operands<Backend>(bfv, second_term, z, z_copy));
+        second_budget = predict_multiply<Backend>(bfv, second_budget, z_budget);
+
+        // Evaluate the first term
+        Ciphertext &first_term = z_powers[plan.index(p_minus_one)];
+        typename Backend::Plaintext scratch;
+        Backend::multiply_plain_inplace(bfv, first_term, Backend::coefficient(bfv, coefficients[n_coefficients - 1], scratch));
+        double first_budget = predict_multiply_plain<Backend>(bfv, z_budgets[plan.index(p_minus_one)], coefficients[n_coefficients - 1]);
+
+        // Both terms still hold three polynomials, relinearize their sum once
+        align_levels<Backend>(bfv, first_term, second_term);
+        Backend::add(bfv, first_term, second_term, result);
+        double result_budget = predict_add_many<Backend>(bfv, std::min(first_budget, second_budget), 2);
+        drop_levels<Backend>(bfv, result, result_budget);
+        relinearize_if_needed<Backend>(bfv, result);
+        return result_budget;
+    }
+}
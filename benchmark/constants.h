@@ -1,5 +1,9 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
 /*
     The exponent of poly_modulus_degree as a power of 2.
     poly_modulus_degree is equal to the order of the multiplicative group defined by 
@@ -40,8 +44,66 @@
 #define PLAIN_MOD 65537
 static_assert(PLAIN_MOD % (1 << POLY_MOD_DEG_EXP + 1) == 1, "The specified PLAIN_MOD is invalid for batching.");
 
+/*
+    Descriptor of a BFV parameter set that can be selected at runtime.
+    coeff_bits holds the bit sizes of the coeff_modulus primes, the last of which is the
+    special prime reserved for keyswitching; when coeff_count is 0 the chain is
+    CoeffModulus::BFVDefault(poly_modulus_degree).
+    The cost of ciphertext operations grows with poly_modulus_degree times the number
+    of primes, while the noise budget grows with the total bit count of the primes.
+*/
+struct ParameterSet {
+    const char *name;
+    unsigned int poly_mod_deg_exp;
+    uint64_t plain_modulus;
+    std::array<int, 16> coeff_bits;
+    size_t coeff_count;
+};
+
+/*
+    Available parameter sets, sorted by increasing cost.
+    With plain_modulus = 65537, Fermat's little theorem alone needs 16 squarings,
+    which only fits into poly_modulus_degree = 32768. N = 16384 is kept for the bounded
+    comparison, whose depth only grows with log2 of the number of users: select_parameter_set
+    picks it for aggregates of up to a few hundred users. No pipeline fits into N = 8192.
+    The custom chains use 60-bit primes and stay below the 881 bits allowed by the
+    HomomorphicEncryption.org standard for 128-bit security at N = 32768.
+*/
+constexpr std::array<ParameterSet, 4> PARAMETER_SETS = {{
+    { "n16384", 14, 65537, {}, 0 },
+    { "n32768_l12", 15, 65537, { 60, 60, 60, 60, 60, 60, 60, 60, 60, 60, 60, 60, 60 }, 13 },
+    { "n32768_l13", 15, 65537, { 60, 60, 60, 60, 60, 60, 60, 60, 60, 60, 60, 60, 60, 60 }, 14 },
+    { "n32768", 15, 65537, {}, 0 }
+}};
+
+// The parameter set matching POLY_MOD_DEG_EXP and PLAIN_MOD
+inline constexpr const ParameterSet &DEFAULT_PARAMETER_SET = PARAMETER_SETS[3];
+
+constexpr bool valid_for_batching(const ParameterSet &set) {
+    return set.plain_modulus % (2ULL << set.poly_mod_deg_exp) == 1;
+}
+
+constexpr bool all_valid_for_batching() {
+    for (const auto &set : PARAMETER_SETS) {
+        if (!valid_for_batching(set))
+            return false;
+    }
+    return true;
+}
+
+static_assert(all_valid_for_batching(), "A parameter set has a plain_modulus that is invalid for batching.");
+static_assert(DEFAULT_PARAMETER_SET.poly_mod_deg_exp == POLY_MOD_DEG_EXP && DEFAULT_PARAMETER_SET.plain_modulus == PLAIN_MOD,
+    "The default parameter set does not match POLY_MOD_DEG_EXP and PLAIN_MOD.");
+
 /*
     The number of terms in the univariate comparison polynomial.
     Effectively equal to the number of even numbers from 0 to p-1.
 */
 #define N_POLY_TERMS PLAIN_MOD/2+1
+
+/*
+    Uncomment to measure the noise budget with the secret key after the comparison
+    pipeline stages and print it next to the prediction of the static noise model.
+    Every measurement costs a decryption, so keep it disabled outside of debugging.
+*/
+// #define NOISE_DEBUG
@@ -0,0 +1,79 @@
+#include "dataset.h"
+#include "slot_layout.h"
+#include "scheduler.h"
+
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+
+LocationVectors::LocationVectors(size_t levels, size_t slot_count, size_t rows) :
+    n_levels(levels), slots(slot_count), regions(rows * levels, NO_REGION)
+{
+    if (levels == 0)
+        throw std::invalid_argument("LocationVectors: there must be at least one level");
+}
+
+std::vector<uint64_t> LocationVectors::dense(size_t i) const {
+    std::vector<uint64_t> vector(slots, 0);
+    const uint32_t *regions = row(i);
+    for (size_t level = 0; level < n_levels; ++level) {
+        if (regions[level] != NO_REGION)
+            vector[regions[level]] = 1;
+    }
+    return vector;
+}
+
+LocationVectors generate_locations(unsigned int rows) {
+    const std::vector<uint32_t> avg_region_count = { 14, 26, 189, 143, 1062, 727, 919, 35 };
+    const size_t slot_count = std::accumulate(avg_region_count.begin(), avg_region_count.end(), size_t(0));
+
+    LocationVectors locations(avg_region_count.size(), slot_count, rows);
+
+    std::random_device rd;
+    cpu::scheduler().parallel_for(0, rows, [&](size_t i) {
+        std::mt19937 gen(rd());
+        uint32_t *regions = locations.row(i);
+        uint32_t begin = 0;
+        for (size_t level = 0; level < avg_region_count.size(); ++level) {
+            std::uniform_int_distribution<uint32_t> dis(begin, begin + avg_region_count[level] - 1);
+            regions[level] = dis(gen);
+            begin += avg_region_count[level];
+        }
+    });
+
+    return locations;
+}
+
+LocationVectors generate_locations(const SlotLayout &layout, unsigned int rows) {
+    const auto &countries = layout.countries();
+    if (countries.empty())
+        throw std::invalid_argument("generate_locations: the layout has no countries");
+
+    size_t levels = 1;
+    for (const auto &country : countries)
+        levels = std::max(levels, country.level_sizes.size());
+
+    LocationVectors locations(levels, layout.slot_count(), rows);
+
+    std::random_device rd;
+    cpu::scheduler().parallel_for(0, rows, [&](size_t i) {
+        std::mt19937 gen(rd());
+        std::uniform_int_distribution<size_t> pick(0, countries.size() - 1);
+        const CountrySlots &country = countries[pick(gen)];
+
+        // Levels without regions, and those the country does not have, stay NO_REGION
+        uint32_t *regions = locations.row(i);
+        size_t begin = country.offset;
+        for (size_t level = 0; level < country.level_sizes.size(); ++level) {
+            size_t count = country.level_sizes[level];
+            if (count > 0) {
+                std::uniform_int_distribution<size_t> dis(begin, begin + count - 1);
+                regions[level] = dis(gen);
+            }
+            begin += count;
+        }
+    });
+
+    return locations;
+}
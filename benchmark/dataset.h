@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class SlotLayout;
+
+/*
+    Location vectors of users, which are one-hot per administrative level: only the slot of the
+    region of every level is stored, levels() indices per user in a single contiguous buffer,
+    instead of slot_count() mostly zero values. A level without a region holds NO_REGION.
+*/
+class LocationVectors {
+    size_t n_levels;
+    size_t slots;
+    std::vector<uint32_t> regions;
+public:
+    static constexpr uint32_t NO_REGION = ~uint32_t(0);
+
+    // rows users without any region, throws std::invalid_argument if levels is 0
+    LocationVectors(size_t levels, size_t slot_count, size_t rows = 0);
+
+    size_t rows() const { return regions.size() / n_levels; }
+    size_t levels() const { return n_levels; }
+    size_t slot_count() const { return slots; }
+
+    uint32_t *row(size_t i) { return regions.data() + i * n_levels; }
+    const uint32_t *row(size_t i) const { return regions.data() + i * n_levels; }
+
+    // Dense vector of user i, slot_count() wide
+    std::vector<uint64_t> dense(size_t i) const;
+};
+
+// Dense rows of the same width, stored one after the other in a single buffer
+class FlatMatrix {
+    size_t n_rows;
+    size_t n_cols;
+    std::vector<uint64_t> values;
+public:
+    FlatMatrix(size_t rows, size_t cols) : n_rows(rows), n_cols(cols), values(rows * cols, 0) {}
+
+    size_t rows() const { return n_rows; }
+    size_t cols() const { return n_cols; }
+
+    uint64_t *row(size_t i) { return values.data() + i * n_cols; }
+    const uint64_t *row(size_t i) const { return values.data() + i * n_cols; }
+};
+
+// Random location vectors with the average number of regions per level, one region per level
+LocationVectors generate_locations(unsigned int rows);
+
+// Random location vectors packed with a layout, every user is in one region per level of a random country
+LocationVectors generate_locations(const SlotLayout &layout, unsigned int rows);
@@ -0,0 +1,319 @@
+#include "geoindex.h"
+#include "scheduler.h"
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+    const char GEO_INDEX_FILE_MAGIC[8] = { 'H', 'E', 'G', 'E', 'O', 'I', 'D', 'X' };
+
+    struct GeoIndexFileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t fanout;
+        uint64_t country_count;
+        uint64_t region_count;
+        uint64_t node_count;
+        uint64_t leaf_count;
+        uint64_t ring_count;
+        uint64_t vertex_count;
+        uint64_t names_size;
+    };
+
+    // The exporter writes the same layouts with numpy structured dtypes
+    static_assert(sizeof(GeoIndexFileHeader) == 72, "GeoIndexFileHeader must match the file format");
+    static_assert(sizeof(GeoCountry) == 56, "GeoCountry must match the file format");
+    static_assert(sizeof(GeoRegion) == 56, "GeoRegion must match the file format");
+    static_assert(sizeof(GeoNode) == 40, "GeoNode must match the file format");
+    static_assert(sizeof(GeoRing) == 8, "GeoRing must match the file format");
+
+    bool in_box(const double *box, double x, double y) {
+        return box[0] <= x && x <= box[2] && box[1] <= y && y <= box[3];
+    }
+
+    // Whether [first, first + count) lies within [0, size), without overflowing
+    bool in_range(uint64_t first, uint64_t count, uint64_t size) {
+        return first <= size && count <= size - first;
+    }
+}
+
+GeoIndex::GeoIndex(GeoIndex &&other) noexcept {
+    *this = std::move(other);
+}
+
+GeoIndex &GeoIndex::operator=(GeoIndex &&other) noexcept {
+    if (this != &other) {
+        release();
+        mapping = other.mapping;
+        mapping_size = other.mapping_size;
+        country_table = other.country_table;
+        region_table = other.region_table;
+        node_table = other.node_table;
+        ring_table = other.ring_table;
+        xs = other.xs;
+        ys = other.ys;
+        names = other.names;
+        n_countries = other.n_countries;
+        n_regions = other.n_regions;
+        n_nodes = other.n_nodes;
+        n_leaves = other.n_leaves;
+        n_rings = other.n_rings;
+        n_vertices = other.n_vertices;
+
+        other.mapping = nullptr;
+        other.mapping_size = 0;
+        other.n_countries = other.n_regions = other.n_nodes = other.n_leaves = other.n_rings = other.n_vertices = 0;
+    }
+    return *this;
+}
+
+GeoIndex::~GeoIndex() {
+    release();
+}
+
+void GeoIndex::release() {
+    if (mapping != nullptr)
+        munmap(mapping, mapping_size);
+    mapping = nullptr;
+    mapping_size = 0;
+}
+
+GeoIndex GeoIndex::map(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("GeoIndex: cannot open " + path);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(GeoIndexFileHeader)) {
+        close(fd);
+        throw std::runtime_error("GeoIndex: " + path + " is truncated");
+    }
+
+    size_t size = st.st_size;
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        throw std::runtime_error("GeoIndex: cannot map " + path);
+
+    GeoIndex index;
+    index.mapping = mapping;
+    index.mapping_size = size;
+
+    GeoIndexFileHeader header;
+    std::memcpy(&header, mapping, sizeof(header));
+    if (std::memcmp(header.magic, GEO_INDEX_FILE_MAGIC, sizeof(header.magic)) != 0)
+        throw std::runtime_error("GeoIndex: " + path + " is not a region index file");
+    if (header.version != GEO_INDEX_FILE_VERSION)
+        throw std::runtime_error("GeoIndex: " + path + " has unsupported version " + std::to_string(header.version));
+
+    // Tables follow each other, every entry size is a multiple of 8 so they all stay aligned
+    const char *base = static_cast<const char *>(mapping);
+    size_t offset = sizeof(header);
+    auto table = [&](uint64_t count, size_t entry_size) {
+        if (count > (size - offset) / entry_size)
+            throw std::runtime_error("GeoIndex: " + path + " is truncated");
+        const char *begin = base + offset;
+        offset += count * entry_size;
+        return begin;
+    };
+    index.country_table = reinterpret_cast<const GeoCountry *>(table(header.country_count, sizeof(GeoCountry)));
+    index.region_table = reinterpret_cast<const GeoRegion *>(table(header.region_count, sizeof(GeoRegion)));
+    index.node_table = reinterpret_cast<const GeoNode *>(table(header.node_count, sizeof(GeoNode)));
+    index.ring_table = reinterpret_cast<const GeoRing *>(table(header.ring_count, sizeof(GeoRing)));
+    index.xs = reinterpret_cast<const double *>(table(header.vertex_count, sizeof(double)));
+    index.ys = reinterpret_cast<const double *>(table(header.vertex_count, sizeof(double)));
+    index.names = table(header.names_size, 1);
+    index.n_countries = header.country_count;
+    index.n_regions = header.region_count;
+    index.n_nodes = header.node_count;
+    index.n_leaves = header.leaf_count;
+    index.n_rings = header.ring_count;
+    index.n_vertices = header.vertex_count;
+
+    // Lookups trust every index of the tables, so they are all checked here once
+    auto inconsistent = [&](const std::string &what) {
+        return std::runtime_error("GeoIndex: " + path + " is inconsistent, " + what);
+    };
+    if (index.n_leaves > index.n_nodes || (index.n_regions > 0 && index.n_leaves == 0))
+        throw inconsistent("the tree has no leaves");
+    for (size_t i = 0; i < index.n_countries; ++i) {
+        const GeoCountry &country = index.country_table[i];
+        if (!in_range(country.name_offset, country.name_size, header.names_size))
+            throw inconsistent("country " + std::to_string(i) + " has no name");
+        if (country.region >= index.n_regions || index.region_table[country.region].country != i
+            || index.region_table[country.region].level != GEO_COUNTRY_LEVEL)
+            throw inconsistent("country " + std::to_string(i) + " has no outline");
+    }
+    for (size_t i = 0; i < index.n_regions; ++i) {
+        const GeoRegion &region = index.region_table[i];
+        if (region.country >= index.n_countries)
+            throw inconsistent("region " + std::to_string(i) + " has no country");
+        if (region.level < GEO_COUNTRY_LEVEL || region.level > GEO_COUNTRY_LEVEL + GEO_INDEX_LEVELS)
+            throw inconsistent("region " + std::to_string(i) + " has level " + std::to_string(region.level));
+        if (region.level > GEO_COUNTRY_LEVEL) {
+            const uint32_t *sizes = index.country_table[region.country].level_sizes;
+            if (region.slot >= std::accumulate(sizes, sizes + GEO_INDEX_LEVELS, uint64_t(0)))
+                throw inconsistent("region " + std::to_string(i) + " is outside of the location vector of its country");
+        }
+        if (!in_range(region.first_ring, region.ring_count, index.n_rings))
+            throw inconsistent("region " + std::to_string(i) + " has rings out of range");
+    }
+    for (size_t i = 0; i < index.n_nodes; ++i) {
+        const GeoNode &node = index.node_table[i];
+        // Children of inner nodes come before them, so that the tree has no cycles
+        bool valid = i < index.n_leaves ? in_range(node.first_child, node.child_count, index.n_regions)
+            : in_range(node.first_child, node.child_count, i);
+        if (!valid)
+            throw inconsistent("node " + std::to_string(i) + " has children out of range");
+    }
+    for (size_t i = 0; i < index.n_rings; ++i) {
+        const GeoRing &ring = index.ring_table[i];
+        if (!in_range(ring.first_vertex, ring.vertex_count, index.n_vertices))
+            throw inconsistent("ring " + std::to_string(i) + " has vertices out of range");
+    }
+
+    return index;
+}
+
+std::string_view GeoIndex::country_name(size_t i) const {
+    const GeoCountry &country = country_table[i];
+    return std::string_view(names + country.name_offset, country.name_size);
+}
+
+void GeoIndex::candidates(double x, double y, std::vector<uint32_t> &regions) const {
+    if (n_nodes == 0)
+        return;
+
+    // Depth-first from the root, which is the last node
+    thread_local std::vector<uint32_t> stack;
+    stack.assign(1, static_cast<uint32_t>(n_nodes - 1));
+    while (!stack.empty()) {
+        uint32_t current = stack.back();
+        stack.pop_back();
+        const GeoNode &node = node_table[current];
+        if (!in_box(&node.min_x, x, y))
+            continue;
+        uint32_t end = node.first_child + node.child_count;
+        if (current < n_leaves) {
+            for (uint32_t child = node.first_child; child < end; ++child) {
+                if (in_box(&region_table[child].min_x, x, y))
+                    regions.push_back(child);
+            }
+        } else {
+            for (uint32_t child = node.first_child; child < end; ++child)
+                stack.push_back(child);
+        }
+    }
+}
+
+bool GeoIndex::contains(size_t i, double x, double y) const {
+    const GeoRegion &region = region_table[i];
+    if (!in_box(&region.min_x, x, y))
+        return false;
+
+    // Even-odd rule over every ring: count the edges crossed by a ray from (x, y) towards +x.
+    // The crossing test has no branch and no division, so the loop over the edges vectorizes.
+    // The counter has the width of the coordinates, so that the comparisons and the sum share vector lanes.
+    uint64_t crossings = 0;
+    for (uint32_t r = region.first_ring; r < region.first_ring + region.ring_count; ++r) {
+        const GeoRing &ring = ring_table[r];
+        if (ring.vertex_count < 2)
+            continue;
+        const double *rx = xs + ring.first_vertex;
+        const double *ry = ys + ring.first_vertex;
+        size_t edges = ring.vertex_count - 1;
+        #pragma omp simd reduction(+:crossings)
+        for (size_t e = 0; e < edges; ++e) {
+            double x0 = rx[e], y0 = ry[e], x1 = rx[e + 1], y1 = ry[e + 1];
+            uint64_t straddles = (y0 > y) != (y1 > y);
+            // x < x0 + (y - y0) * (x1 - x0) / (y1 - y0), with both sides multiplied by y1 - y0
+            uint64_t left = ((x - x0) * (y1 - y0) < (y - y0) * (x1 - x0)) != (y1 < y0);
+            crossings += straddles & left;
+        }
+    }
+    return crossings & 1;
+}
+
+Geolocator::Geolocator(const GeoIndex &index, const std::vector<SlotLayout> &layouts) :
+    index(index), slots(layouts.empty() ? 0 : layouts[0].slot_count()),
+    country_layout(index.countries(), NOT_FOUND), country_offset(index.countries(), 0)
+{
+    std::unordered_map<std::string_view, size_t> countries;
+    for (size_t i = 0; i < index.countries(); ++i)
+        countries.emplace(index.country_name(i), i);
+
+    for (size_t l = 0; l < layouts.size(); ++l) {
+        if (layouts[l].slot_count() != slots)
+            throw std::invalid_argument("Geolocator: every layout must have the same slot count");
+        for (const auto &slot_country : layouts[l].countries()) {
+            auto it = countries.find(slot_country.name);
+            if (it == countries.end())
+                continue;
+
+            // Region slots of the index are only meaningful if both count the regions the same way
+            const GeoCountry &country = index.country(it->second);
+            for (size_t level = 0; level < std::max(GEO_INDEX_LEVELS, slot_country.level_sizes.size()); ++level) {
+                uint32_t expected = level < slot_country.level_sizes.size() ? slot_country.level_sizes[level] : 0;
+                uint32_t actual = level < GEO_INDEX_LEVELS ? country.level_sizes[level] : 0;
+                if (expected != actual)
+                    throw std::invalid_argument("Geolocator: " + slot_country.name + " has " + std::to_string(actual)
+                        + " regions at level " + std::to_string(level + GEO_COUNTRY_LEVEL + 1)
+                        + " in the index but " + std::to_string(expected) + " in its layout");
+            }
+            country_layout[it->second] = l;
+            country_offset[it->second] = slot_country.offset;
+        }
+    }
+}
+
+uint32_t Geolocator::locate(double x, double y, uint32_t *slots, std::vector<uint32_t> &candidates) const {
+    std::fill(slots, slots + GEO_INDEX_LEVELS, LocationVectors::NO_REGION);
+    candidates.clear();
+    index.candidates(x, y, candidates);
+
+    // The outlines settle the country, the polygons of its regions are only tested afterwards
+    uint32_t country = NOT_FOUND;
+    for (uint32_t r : candidates) {
+        const GeoRegion &region = index.region(r);
+        if (region.level == GEO_COUNTRY_LEVEL && country_layout[region.country] != NOT_FOUND && index.contains(r, x, y)) {
+            country = region.country;
+            break;
+        }
+    }
+    if (country == NOT_FOUND)
+        return NOT_FOUND;
+
+    for (uint32_t r : candidates) {
+        const GeoRegion &region = index.region(r);
+        if (region.country != country || region.level == GEO_COUNTRY_LEVEL)
+            continue;
+        uint32_t &slot = slots[region.level - GEO_COUNTRY_LEVEL - 1];
+        if (slot == LocationVectors::NO_REGION && index.contains(r, x, y))
+            slot = static_cast<uint32_t>(country_offset[country] + region.slot);
+    }
+    return country_layout[country];
+}
+
+uint32_t Geolocator::locate(double x, double y, uint32_t *slots) const {
+    std::vector<uint32_t> candidates;
+    return locate(x, y, slots, candidates);
+}
+
+void Geolocator::locate(const double *x, const double *y, size_t count, LocationVectors &locations, std::vector<uint32_t> &layouts) const {
+    if (locations.levels() != GEO_INDEX_LEVELS || locations.slot_count() != slots || locations.rows() < count)
+        throw std::invalid_argument("Geolocator::locate: locations must have " + std::to_string(GEO_INDEX_LEVELS)
+            + " levels, " + std::to_string(slots) + " slots and at least " + std::to_string(count) + " rows");
+    layouts.resize(count);
+
+    cpu::scheduler().parallel_for(0, count, [&](size_t i) {
+        thread_local std::vector<uint32_t> candidates;
+        layouts[i] = locate(x[i], y[i], locations.row(i), candidates);
+    });
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "dataset.h"
+#include "slot_layout.h"
+
+/*
+    Region index file written by client/geoindex_exporter.py, all fields little endian,
+    every section starting on an 8-byte boundary:
+        magic               8 bytes, "HEGEOIDX"
+        version             uint32
+        fanout              uint32, maximum number of children of a node
+        country_count       uint64
+        region_count        uint64
+        node_count          uint64
+        leaf_count          uint64, nodes whose children are regions
+        ring_count          uint64
+        vertex_count        uint64
+        names_size          uint64
+    followed by the tables
+        countries           country_count x GeoCountry
+        regions             region_count x GeoRegion, sorted by the Hilbert index of their center
+        nodes               node_count x GeoNode, a packed R-tree built bottom up over the regions,
+                            leaves first and the root last
+        rings               ring_count x GeoRing
+        x, y                vertex_count doubles each, longitudes then latitudes
+        names               names_size bytes, country names without terminators
+    Rings are closed, their first vertex is repeated at the end. A region holds the rings of
+    all its polygons, holes included, and contains the points inside an odd number of them.
+*/
+constexpr uint32_t GEO_INDEX_FILE_VERSION = 1;
+
+// Administrative levels of a country, the country itself first, then those of its location vector
+constexpr uint32_t GEO_COUNTRY_LEVEL = 2;
+constexpr size_t GEO_INDEX_LEVELS = 9;
+
+struct GeoCountry {
+    uint64_t name_offset;
+    uint32_t name_size;
+    uint32_t region;                            // Region holding the outline of the country
+    uint32_t level_sizes[GEO_INDEX_LEVELS];     // Regions of every level, as in region_stats.csv
+    uint32_t reserved;
+};
+
+struct GeoRegion {
+    double min_x, min_y, max_x, max_y;
+    uint32_t country;
+    uint32_t level;         // Administrative level, GEO_COUNTRY_LEVEL for the outline of a country
+    uint32_t slot;          // Index in the location vector of the country
+    uint32_t first_ring;
+    uint32_t ring_count;
+    uint32_t reserved;
+};
+
+struct GeoNode {
+    double min_x, min_y, max_x, max_y;
+    uint32_t first_child;   // A region for the leaves, a node otherwise
+    uint32_t child_count;
+};
+
+struct GeoRing {
+    uint32_t first_vertex;
+    uint32_t vertex_count;
+};
+
+/*
+    Read-only, memory-mapped region index. Opening it validates the header and every range
+    of the tables once, lookups then read the mapped pages directly.
+*/
+class GeoIndex {
+    void *mapping = nullptr;
+    size_t mapping_size = 0;
+    const GeoCountry *country_table = nullptr;
+    const GeoRegion *region_table = nullptr;
+    const GeoNode *node_table = nullptr;
+    const GeoRing *ring_table = nullptr;
+    const double *xs = nullptr;
+    const double *ys = nullptr;
+    const char *names = nullptr;
+    size_t n_countries = 0, n_regions = 0, n_nodes = 0, n_leaves = 0, n_rings = 0, n_vertices = 0;
+
+    void release();
+public:
+    GeoIndex() = default;
+    GeoIndex(GeoIndex &&other) noexcept;
+    GeoIndex &operator=(GeoIndex &&other) noexcept;
+    GeoIndex(const GeoIndex &) = delete;
+    GeoIndex &operator=(const GeoIndex &) = delete;
+    ~GeoIndex();
+
+    // Throws std::runtime_error if the file is missing, truncated, inconsistent or has an unsupported version
+    static GeoIndex map(const std::string &path);
+
+    size_t countries() const { return n_countries; }
+    size_t regions() const { return n_regions; }
+    const GeoCountry &country(size_t i) const { return country_table[i]; }
+    std::string_view country_name(size_t i) const;
+    const GeoRegion &region(size_t i) const { return region_table[i]; }
+
+    // Appends the regions whose bounding box contains (x, y)
+    void candidates(double x, double y, std::vector<uint32_t> &regions) const;
+
+    // Whether (x, y) lies inside region i
+    bool contains(size_t i, double x, double y) const;
+};
+
+/*
+    Geolocation of users straight into the slots of the layouts served by the server.
+    Every country of the index is matched by name with the layout that holds it, and its
+    regions are numbered like the location vectors of client/overpass_downloader.py.
+    A user is located in the first country whose outline contains it, and in the first
+    region of every level of that country that contains it.
+*/
+class Geolocator {
+    const GeoIndex &index;
+    size_t slots;
+    std::vector<uint32_t> country_layout;       // Per country of the index, NOT_FOUND if no layout holds it
+    std::vector<size_t> country_offset;
+
+    uint32_t locate(double x, double y, uint32_t *slots, std::vector<uint32_t> &candidates) const;
+public:
+    static constexpr uint32_t NOT_FOUND = ~uint32_t(0);
+
+    // Throws std::invalid_argument if a country has different level sizes in the index and in its layout
+    Geolocator(const GeoIndex &index, const std::vector<SlotLayout> &layouts);
+
+    /*
+        Layout of the user at longitude x and latitude y, NOT_FOUND if it is in no country of the
+        layouts. The slot of its region of every level is written to slots, GEO_INDEX_LEVELS of them,
+        LocationVectors::NO_REGION at the levels where no region contains it.
+    */
+    uint32_t locate(double x, double y, uint32_t *slots) const;
+
+    // Locates count users in parallel, user i in row i of locations and layouts[i]
+    void locate(const double *x, const double *y, size_t count, LocationVectors &locations, std::vector<uint32_t> &layouts) const;
+};
@@ -0,0 +1,289 @@
+#include "libbfv.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cpu {
+    using namespace seal;
+
+    namespace {
+        const char KEY_BUNDLE_FILE_MAGIC[8] = { 'H', 'E', 'K', 'E', 'Y', 'B', 'D', 'L' };
+
+        struct KeyBundleFileHeader {
+            char magic[8];
+            uint32_t version;
+            uint32_t kind;
+            uint64_t parms_id[4];
+            uint64_t count;
+        };
+
+        struct KeyRecordHeader {
+            uint32_t type;
+            uint32_t reserved;
+            uint64_t size;
+            uint64_t checksum;
+        };
+
+        size_t padded(size_t size) {
+            return (size + 7) & ~size_t(7);
+        }
+
+        // SEAL object to write, with its type and its serialization
+        struct KeyRecordWriter {
+            KeyRecord type;
+            std::function<size_t()> save_size;
+            std::function<size_t(seal_byte *, size_t)> save;
+        };
+
+        template <typename T>
+        KeyRecordWriter key_record(KeyRecord type, const T &object) {
+            return {
+                type,
+                [&object] { return static_cast<size_t>(object.save_size(compr_mode_type::none)); },
+                [&object](seal_byte *out, size_t size) { return static_cast<size_t>(object.save(out, size, compr_mode_type::none)); }
+            };
+        }
+
+        // Writes all of data to fd, returns false on error
+        bool write_all(int fd, const void *data, size_t size) {
+            const char *bytes = static_cast<const char *>(data);
+            while (size > 0) {
+                ssize_t written = write(fd, bytes, size);
+                if (written < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    return false;
+                }
+                bytes += written;
+                size -= written;
+            }
+            return true;
+        }
+
+        void save_key_bundle(const std::string &path, KeyBundleKind kind, const SEALContext &context, const std::vector<KeyRecordWriter> &records) {
+            // Written aside and renamed, so that a server never maps a half-written bundle. Client bundles hold
+            // the secret key, so the file is only readable by its owner from its creation on: a stale tmp file
+            // is removed first, since O_CREAT keeps the mode of an existing file.
+            std::string tmp_path = path + ".tmp";
+            std::remove(tmp_path.c_str());
+            int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            if (fd < 0)
+                throw std::runtime_error("save_key_bundle: cannot open " + tmp_path + ": " + std::strerror(errno));
+
+            KeyBundleFileHeader header {};
+            std::memcpy(header.magic, KEY_BUNDLE_FILE_MAGIC, sizeof(header.magic));
+            header.version = KEY_BUNDLE_FILE_VERSION;
+            header.kind = static_cast<uint32_t>(kind);
+            const parms_id_type &parms_id = context.key_parms_id();
+            std::copy(parms_id.begin(), parms_id.end(), header.parms_id);
+            header.count = records.size();
+            bool ok = write_all(fd, &header, sizeof(header));
+
+            std::vector<seal_byte> buffer;
+            const char padding[8] = {};
+            for (const auto &writer : records) {
+                if (!ok)
+                    break;
+                buffer.resize(writer.save_size());
+                size_t size = writer.save(buffer.data(), buffer.size());
+                KeyRecordHeader record { static_cast<uint32_t>(writer.type), 0, size, fnv1a(buffer.data(), size) };
+                ok = write_all(fd, &record, sizeof(record))
+                    && write_all(fd, buffer.data(), size)
+                    && write_all(fd, padding, padded(size) - size);
+            }
+
+            if (close(fd) != 0 || !ok) {
+                std::remove(tmp_path.c_str());
+                throw std::runtime_error("save_key_bundle: cannot write " + tmp_path);
+            }
+            if (std::rename(tmp_path.c_str(), path.c_str()) != 0)
+                throw std::runtime_error("save_key_bundle: cannot rename " + tmp_path + " to " + path);
+        }
+    }
+
+    void save_server_keys(const std::string &path, const ServerContext &bfv) {
+        std::vector<KeyRecordWriter> records = {
+            key_record(KeyRecord::parameters, bfv.parms),
+            key_record(KeyRecord::public_key, bfv.public_key),
+            key_record(KeyRecord::relin_keys, bfv.relin_keys)
+        };
+        if (bfv.galois_keys.size() > 0)
+            records.push_back(key_record(KeyRecord::galois_keys, bfv.galois_keys));
+        save_key_bundle(path, KeyBundleKind::server, bfv.context, records);
+    }
+
+    void save_client_keys(const std::string &path, const BFVContext &bfv) {
+        save_key_bundle(path, KeyBundleKind::client, bfv.context, {
+            key_record(KeyRecord::parameters, bfv.parms),
+            key_record(KeyRecord::public_key, bfv.public_key),
+            key_record(KeyRecord::secret_key, bfv.secret_key)
+        });
+    }
+
+    KeyBundle::KeyBundle(KeyBundle &&other) noexcept {
+        *this = std::move(other);
+    }
+
+    KeyBundle &KeyBundle::operator=(KeyBundle &&other) noexcept {
+        if (this != &other) {
+            release();
+            mapping = other.mapping;
+            mapping_size = other.mapping_size;
+            bundle_kind = other.bundle_kind;
+            key_parms_id = other.key_parms_id;
+            records = std::move(other.records);
+
+            other.mapping = nullptr;
+            other.mapping_size = 0;
+            other.records.clear();
+        }
+        return *this;
+    }
+
+    KeyBundle::~KeyBundle() {
+        release();
+    }
+
+    void KeyBundle::release() {
+        if (mapping != nullptr)
+            munmap(mapping, mapping_size);
+        mapping = nullptr;
+        mapping_size = 0;
+        records.clear();
+    }
+
+    KeyBundle KeyBundle::map(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("KeyBundle: cannot open " + path);
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(KeyBundleFileHeader)) {
+            close(fd);
+            throw std::runtime_error("KeyBundle: " + path + " is truncated");
+        }
+
+        size_t size = st.st_size;
+        void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+            throw std::runtime_error("KeyBundle: cannot map " + path);
+
+        KeyBundle bundle;
+        bundle.mapping = mapping;
+        bundle.mapping_size = size;
+
+        KeyBundleFileHeader header;
+        std::memcpy(&header, mapping, sizeof(header));
+        if (std::memcmp(header.magic, KEY_BUNDLE_FILE_MAGIC, sizeof(header.magic)) != 0)
+            throw std::runtime_error("KeyBundle: " + path + " is not a key bundle");
+        if (header.version != KEY_BUNDLE_FILE_VERSION)
+            throw std::runtime_error("KeyBundle: " + path + " has unsupported version " + std::to_string(header.version));
+        if (header.kind != static_cast<uint32_t>(KeyBundleKind::server) && header.kind != static_cast<uint32_t>(KeyBundleKind::client))
+            throw std::runtime_error("KeyBundle: " + path + " has unknown kind " + std::to_string(header.kind));
+
+        bundle.bundle_kind = static_cast<KeyBundleKind>(header.kind);
+        std::copy(header.parms_id, header.parms_id + 4, bundle.key_parms_id.begin());
+
+        // Index the records, their contents are only read when they are loaded
+        size_t offset = sizeof(header);
+        for (uint64_t i = 0; i < header.count; ++i) {
+            KeyRecordHeader record;
+            if (offset + sizeof(record) > size)
+                throw std::runtime_error("KeyBundle: " + path + " is truncated");
+            std::memcpy(&record, static_cast<const char *>(mapping) + offset, sizeof(record));
+            if (record.size > size - offset - sizeof(record))
+                throw std::runtime_error("KeyBundle: " + path + " is truncated");
+
+            bundle.records.emplace_back(static_cast<KeyRecord>(record.type), offset);
+            offset += sizeof(record) + padded(record.size);
+        }
+        return bundle;
+    }
+
+    bool KeyBundle::has(KeyRecord type) const {
+        return std::any_of(records.begin(), records.end(), [&](const auto &record) { return record.first == type; });
+    }
+
+    std::pair<const seal_byte *, size_t> KeyBundle::record(KeyRecord type) const {
+        auto it = std::find_if(records.begin(), records.end(), [&](const auto &record) { return record.first == type; });
+        if (it == records.end())
+            throw std::runtime_error("KeyBundle: the bundle has no record of type " + std::to_string(static_cast<uint32_t>(type)));
+
+        KeyRecordHeader record;
+        const char *bytes = static_cast<const char *>(mapping) + it->second;
+        std::memcpy(&record, bytes, sizeof(record));
+        auto object = reinterpret_cast<const seal_byte *>(bytes + sizeof(record));
+        if (fnv1a(object, record.size) != record.checksum)
+            throw std::runtime_error("KeyBundle: the record of type " + std::to_string(record.type) + " is corrupted");
+        return { object, static_cast<size_t>(record.size) };
+    }
+
+    EncryptionParameters KeyBundle::parameters() const {
+        auto bytes = record(KeyRecord::parameters);
+        EncryptionParameters parms;
+        parms.load(bytes.first, bytes.second);
+        if (parms.parms_id() != key_parms_id)
+            throw std::runtime_error("KeyBundle::parameters: the parameters do not match the parms_id of the bundle");
+        return parms;
+    }
+
+    ServerKeys KeyBundle::server_keys(const SEALContext &context) const {
+        if (context.key_parms_id() != key_parms_id)
+            throw std::runtime_error("KeyBundle::server_keys: the bundle was written with different encryption parameters");
+
+        // Relinearization and Galois keys are by far the largest, each one is loaded by its own task
+        ServerKeys keys;
+        auto load = [&](KeyRecord type, auto &object) {
+            // Only the public key is required, the others are left empty when missing
+            if (type != KeyRecord::public_key && !has(type))
+                return;
+            auto bytes = record(type);
+            object.load(context, bytes.first, bytes.second);
+        };
+        scheduler().invoke(
+            [&] { load(KeyRecord::public_key, keys.public_key); },
+            [&] { load(KeyRecord::relin_keys, keys.relin_keys); },
+            [&] { load(KeyRecord::galois_keys, keys.galois_keys); }
+        );
+        return keys;
+    }
+
+    SecretKey KeyBundle::secret_key(const SEALContext &context) const {
+        if (context.key_parms_id() != key_parms_id)
+            throw std::runtime_error("KeyBundle::secret_key: the bundle was written with different encryption parameters");
+
+        auto bytes = record(KeyRecord::secret_key);
+        SecretKey secret_key;
+        secret_key.load(context, bytes.first, bytes.second);
+        return secret_key;
+    }
+
+    std::unique_ptr<ServerContext> load_server_context(const std::string &path) {
+        KeyBundle bundle = KeyBundle::map(path);
+        if (bundle.kind() != KeyBundleKind::server)
+            throw std::runtime_error("load_server_context: " + path + " is not a server key bundle");
+        if (!bundle.has(KeyRecord::relin_keys))
+            throw std::runtime_error("load_server_context: " + path + " has no relinearization keys");
+
+        SEALContext context(bundle.parameters());
+        return std::make_unique<ServerContext>(context, bundle.server_keys(context));
+    }
+
+    std::unique_ptr<BFVContext> load_client_context(const std::string &path) {
+        KeyBundle bundle = KeyBundle::map(path);
+        if (bundle.kind() != KeyBundleKind::client)
+            throw std::runtime_error("load_client_context: " + path + " is not a client key bundle");
+
+        SEALContext context(bundle.parameters());
+        return std::make_unique<BFVContext>(context, bundle.secret_key(context), bundle.server_keys(context));
+    }
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "bfv.h"
+
+namespace cpu {
+    /*
+        Key bundle file layout, all fields little endian:
+            magic               8 bytes, "HEKEYBDL"
+            version             uint32
+            kind                uint32, KeyBundleKind
+            parms_id            4 x uint64, key level parms_id of the encryption parameters
+            count               uint64, number of records
+        followed by count records, each starting on an 8-byte boundary:
+            type                uint32, KeyRecord
+            reserved            uint32
+            size                uint64
+            checksum            uint64, FNV-1a of the object bytes
+            object              size bytes, saved by SEAL without compression
+        Server bundles hold the parameters and the public, relinearization and Galois keys,
+        and never the secret key. Client bundles hold the parameters, the public key and the
+        secret key.
+    */
+    constexpr uint32_t KEY_BUNDLE_FILE_VERSION = 1;
+
+    enum class KeyBundleKind : uint32_t {
+        server = 1,
+        client = 2
+    };
+
+    enum class KeyRecord : uint32_t {
+        parameters = 1,
+        public_key = 2,
+        relin_keys = 3,
+        galois_keys = 4,
+        secret_key = 5
+    };
+
+    /*
+        Writes the keys of the server, with the Galois keys if galois_keys is not empty.
+        As snapshots, the file is written to a temporary file first and then moved in place.
+        Throws std::runtime_error if the file can not be written.
+    */
+    void save_server_keys(const std::string &path, const ServerContext &bfv);
+
+    // Writes the keys of the clients, throws std::runtime_error if the file can not be written
+    void save_client_keys(const std::string &path, const BFVContext &bfv);
+
+    /*
+        Read-only, memory-mapped key bundle. Opening it validates the header and indexes the
+        records; keys are deserialized straight from the mapped pages, without the file streams
+        and the decompression of the usual SEAL loading, after checking their checksum.
+    */
+    class KeyBundle {
+        void *mapping = nullptr;
+        size_t mapping_size = 0;
+        KeyBundleKind bundle_kind = KeyBundleKind::server;
+        seal::parms_id_type key_parms_id;
+        std::vector<std::pair<KeyRecord, size_t>> records;
+
+        void release();
+
+        // Serialized bytes of the record of a type, throws std::runtime_error if it is missing or corrupted
+        std::pair<const seal::seal_byte *, size_t> record(KeyRecord type) const;
+    public:
+        KeyBundle() = default;
+        KeyBundle(KeyBundle &&other) noexcept;
+        KeyBundle &operator=(KeyBundle &&other) noexcept;
+        KeyBundle(const KeyBundle &) = delete;
+        KeyBundle &operator=(const KeyBundle &) = delete;
+        ~KeyBundle();
+
+        // Throws std::runtime_error if the file is missing, truncated or has an unsupported version
+        static KeyBundle map(const std::string &path);
+
+        KeyBundleKind kind() const { return bundle_kind; }
+        bool has(KeyRecord type) const;
+
+        // Throws std::runtime_error if the parameters do not match the parms_id of the bundle
+        seal::EncryptionParameters parameters() const;
+
+        // Public, relinearization and Galois keys, the largest ones loaded in parallel
+        ServerKeys server_keys(const seal::SEALContext &context) const;
+
+        // Throws std::runtime_error if the bundle has no secret key
+        seal::SecretKey secret_key(const seal::SEALContext &context) const;
+    };
+
+    /*
+        Context of the server from a server bundle, without generating any key.
+        Throws std::runtime_error if the bundle is not a server bundle or has no relinearization keys.
+    */
+    std::unique_ptr<ServerContext> load_server_context(const std::string &path);
+
+    // Context of a client from a client bundle, throws std::runtime_error if it is not a client bundle
+    std::unique_ptr<BFVContext> load_client_context(const std::string &path);
+}
@@ -1,22 +1,92 @@
 #include "bfv.h"
+#include "scheduler.h"
+#include "comparison.h"
+#include "noise.h"
+#include "coefficients.h"
+#include "aggregator.h"
+#include "mask.h"
+#include "slot_layout.h"
+#include "dataset.h"
+#include "geoindex.h"
+#include "snapshot.h"
+#include "keys.h"
+#include "protocol.h"
+#include "server.h"
 
 namespace cpu {
     // Encryption functions
+    seal::EncryptionParameters get_parameters(const ParameterSet &set);
     seal::EncryptionParameters get_default_parameters();
-    std::vector<seal::Ciphertext> encrypt_data(BFVContext &bfv, std::vector<std::vector<uint64_t>> data);
-    void mod_exp(BFVContext &bfv, const seal::Ciphertext &x, uint64_t exponent, seal::Ciphertext &result);
-    void equate_plain(BFVContext &bfv, const seal::Ciphertext &x, const seal::Plaintext &y, seal::Ciphertext &result);
-    void lt_range(BFVContext &bfv, const seal::Ciphertext &x, uint64_t y, seal::Ciphertext &result);
-    void lt_range_mt(BFVContext &bfv, const seal::Ciphertext &x, uint64_t y, seal::Ciphertext &result);
-    void calc_univ_poly_coefficients(std::array<int64_t, N_POLY_TERMS> &result);
-    void lt_univariate(BFVContext &bfv, const std::array<int64_t, N_POLY_TERMS> &coefficients, const seal::Ciphertext &x, const seal::Ciphertext &y, seal::Ciphertext &result);
+
+    /*
+        Bulk encryption of rows [0, rows) on the workers of the scheduler. encode(i, plaintext) encodes
+        row i, and both callbacks are called from several workers at once. The rows are split in a few
+        contiguous chunks per worker, each reusing one plaintext and encrypting with the memory pool of
+        its worker. The first form encrypts row i straight into destination[i], resized to rows.
+        The second one hands every ciphertext to sink(i, ciphertext) as soon as it is encrypted, in no
+        particular order, and reuses it for the next row once sink returns, so that a population of any
+        size can be streamed into an aggregator or a snapshot with one ciphertext per chunk in memory.
+    */
+    using RowEncoder = std::function<void(size_t, seal::Plaintext &)>;
+    using CiphertextSink = std::function<void(size_t, const seal::Ciphertext &)>;
+    void encrypt_rows(ServerContext &bfv, size_t rows, const RowEncoder &encode, std::vector<seal::Ciphertext> &destination);
+    void encrypt_rows(ServerContext &bfv, size_t rows, const RowEncoder &encode, const CiphertextSink &sink);
+
+    // Rows encrypted with encrypt_rows
+    std::vector<seal::Ciphertext> encrypt_data(ServerContext &bfv, const std::vector<std::vector<uint64_t>> &data);
+    std::vector<seal::Ciphertext> encrypt_data(ServerContext &bfv, const LocationVectors &data);
+    std::vector<seal::Ciphertext> encrypt_data(ServerContext &bfv, const FlatMatrix &data);
+
+    /*
+        Batch encodes user i of locations: the slots of its regions are set in a zeroed buffer kept by
+        the calling thread, and cleared again after the encoding, so no dense vector is built per user.
+        Throws std::invalid_argument if the locations are wider than the slots of the encoder.
+    */
+    void encode_locations(ServerContext &bfv, const LocationVectors &locations, size_t i, seal::Plaintext &destination);
+    void encode_locations(const seal::BatchEncoder &encoder, const LocationVectors &locations, size_t i, seal::Plaintext &destination);
+
+    // Batch encodes row i of matrix through a buffer kept by the calling thread
+    void encode_row(ServerContext &bfv, const FlatMatrix &matrix, size_t i, seal::Plaintext &destination);
+    void relinearize_if_needed(ServerContext &bfv, seal::Ciphertext &x);
+
+    // The comparisons take the predicted budget of their input (the smaller of x and y for lt_univariate),
+    // and then switch their ciphertexts down the modulus chain as it is consumed, see comparison.h
+    void mod_exp(ServerContext &bfv, const seal::Ciphertext &x, uint64_t exponent, seal::Ciphertext &result,
+        double budget = he::UNKNOWN_BUDGET);
+    void equate_plain(ServerContext &bfv, const seal::Ciphertext &x, const seal::Plaintext &y, seal::Ciphertext &result,
+        double budget = he::UNKNOWN_BUDGET);
+    void lt_range(ServerContext &bfv, const seal::Ciphertext &x, uint64_t y, seal::Ciphertext &result,
+        double budget = he::UNKNOWN_BUDGET);
+    void lt_range_mt(ServerContext &bfv, const seal::Ciphertext &x, uint64_t y, seal::Ciphertext &result,
+        double budget = he::UNKNOWN_BUDGET);
+    void lt_range_prod(ServerContext &bfv, const seal::Ciphertext &x, uint64_t y, seal::Ciphertext &result,
+        double budget = he::UNKNOWN_BUDGET);
+    void lt_range_prod_mt(ServerContext &bfv, const seal::Ciphertext &x, uint64_t y, seal::Ciphertext &result,
+        double budget = he::UNKNOWN_BUDGET);
+
+    // Galois steps needed by rotate_sum over the given window, 0 standing for the column rotation
+    std::vector<int> rotation_steps(size_t window, size_t slot_count);
+
+    // Slot i of x becomes the sum of slots i to i + window - 1 of its row, wrapping around the row,
+    // and of both rows when the window is every slot. x must hold two polynomials.
+    void rotate_sum(ServerContext &bfv, seal::Ciphertext &x, size_t window, const seal::GaloisKeys &galois_keys);
+    void calc_univ_poly_coefficients(uint64_t plain_modulus, std::vector<int64_t> &result);
+    void paterson_stockmeyer(ServerContext &bfv, const int64_t *coefficients, size_t n_terms, const seal::Ciphertext &z, seal::Ciphertext &result,
+        double budget = he::UNKNOWN_BUDGET);
+
+    // [x < y] for x known to lie within [0, n_max], with the cached table of bounded_lt_coefficients
+    void lt_bounded(ServerContext &bfv, const seal::Ciphertext &x, uint64_t y, uint64_t n_max, seal::Ciphertext &result,
+        double budget = he::UNKNOWN_BUDGET);
+    void lt_univariate(ServerContext &bfv, const CoefficientTable &coefficients, const seal::Ciphertext &x, const seal::Ciphertext &y, seal::Ciphertext &result,
+        double budget = he::UNKNOWN_BUDGET);
 }
 
 // Utility functions
-std::vector<std::vector<uint64_t>> generate_dataset(unsigned int rows, unsigned int cols, double chance);
+FlatMatrix generate_dataset(unsigned int rows, unsigned int cols, double chance);
+// Dense rows of generate_locations(rows)
 std::vector<std::vector<uint64_t>> generate_dataset(unsigned int rows);
-void print_vector(std::vector<uint64_t> v);
-void print_vector(std::vector<uint64_t> v, size_t limit);
+void print_vector(const std::vector<uint64_t> &v);
+void print_vector(const std::vector<uint64_t> &v, size_t limit);
 int64_t interpret_as_signed_mod_p(uint64_t x, uint64_t p);
 
 namespace cpu {
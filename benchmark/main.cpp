@@ -1,289 +1,874 @@
 #include "libbfv.h"
+#ifdef HAVE_CUDA
 #include "libbfvcuda.h"
+#endif
 
 #include <benchmark/benchmark.h>
 #include <vector>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
 
 #define N_USERS 100
 #define USER_IDX 0
+#define DISTINCT_ROWS 16
+#define AUTO_PARMS -1
+#define REGION_STATS_PATH "../client/region_stats.csv"
+#define GEOINDEX_PATH "../client/geoindex.bin"
+
+using Clock = std::chrono::steady_clock;
+
+/*
+    Dimensions of the CPU benchmarks, every benchmark runs for their product:
+        --users=<n,...>     users in the aggregate, N_USERS by default
+        --threads=<n,...>   workers of the scheduler, one per core (or HE_THREADS) by default
+        --parms=<name,...>  parameter sets, auto selects the cheapest feasible set for every run
+    They show up in the benchmark names as users:<n>, workers:<n> and parms:<index in PARAMETER_SETS>,
+    with parms:-1 for auto.
+*/
+std::vector<int64_t> users_args = { N_USERS };
+std::vector<int64_t> workers_args;
+std::vector<int64_t> parms_args = { &DEFAULT_PARAMETER_SET - PARAMETER_SETS.data() };
+
+// Region index of the geolocation benchmark, written by client/geoindex_exporter.py, --geoindex=<path>
+std::string geoindex_path = GEOINDEX_PATH;
+
+// Parameter set of a parms argument, the default one for auto when there is no k to select with
+const ParameterSet &parameter_set_arg(int64_t parms) {
+    return parms == AUTO_PARMS ? DEFAULT_PARAMETER_SET : PARAMETER_SETS[parms];
+}
 
-class RangeFixtureCpu : public benchmark::Fixture {
-public:
-    cpu::BFVContext *bfv;
-    std::vector<std::vector<uint64_t>> data;
-    std::vector<seal::Ciphertext> enc_data;
-    seal::Ciphertext aggregate, filtered, lt;
+/*
+    Contexts are created once per parameter set and shared by every benchmark of the process,
+    so that key generation and the precomputed constants are not part of any run.
+*/
+cpu::BFVContext &cpu_context(const ParameterSet &set) {
+    static std::mutex mutex;
+    static std::map<std::string, std::unique_ptr<cpu::BFVContext>> contexts;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &bfv = contexts[set.name];
+    if (!bfv)
+        bfv = std::make_unique<cpu::BFVContext>(cpu::get_parameters(set));
+    return *bfv;
+}
+
+/*
+    Encrypted inputs of the comparison benchmarks, built once per parameter set and number of users.
+    The users are DISTINCT_ROWS vectors encrypted once and repeated, which grows the noise of the
+    aggregate as distinct users would in the worst case, without encrypting every one of them.
+*/
+struct Workload {
+    seal::Ciphertext user, aggregate, filtered;
 };
 
-class RangeFixtureGpu : public benchmark::Fixture {
-public:
-    gpu::BFVContext *bfv;
-    std::vector<std::vector<uint64_t>> data;
-    std::vector<troy::Ciphertext> enc_data;
-    troy::Ciphertext aggregate, filtered, lt;
+const Workload &cpu_workload(const ParameterSet &set, size_t users) {
+    static std::mutex mutex;
+    static std::map<std::pair<std::string, size_t>, std::unique_ptr<Workload>> workloads;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &workload = workloads[{ set.name, users }];
+    if (workload)
+        return *workload;
+
+    cpu::BFVContext &bfv = cpu_context(set);
+    auto rows = cpu::encrypt_data(bfv, generate_locations(std::min<size_t>(users, DISTINCT_ROWS)));
+    cpu::Aggregator aggregator(bfv);
+    cpu::scheduler().parallel_for(0, users, [&](size_t i) {
+        aggregator.add(rows[i % rows.size()]);
+    });
+
+    workload = std::make_unique<Workload>();
+    workload->user = rows[USER_IDX];
+    aggregator.snapshot(workload->aggregate);
+    bfv.evaluator.multiply(workload->user, workload->aggregate, workload->filtered, cpu::current_pool());
+    bfv.evaluator.relinearize_inplace(workload->filtered, bfv.relin_keys, cpu::current_pool());
+    return *workload;
+}
+
+#ifdef HAVE_CUDA
+/*
+    GPU context and inputs for the default parameters. Kept apart from the static caches,
+    since they have to be released before the troy memory pool is destroyed.
+*/
+struct GpuWorkload {
+    gpu::BFVContext bfv;
+    troy::Ciphertext user, aggregate, filtered;
+
+    GpuWorkload() : bfv(gpu::get_default_parameters()) {
+        auto enc_data = gpu::encrypt_data(bfv, generate_locations(N_USERS));
+        bfv.encryptor.encrypt_zero_asymmetric(aggregate);
+        for (auto &ctx : enc_data)
+            bfv.evaluator.add_inplace(aggregate, ctx.to_device());
+        user = enc_data[USER_IDX].to_device();
+        filtered = bfv.evaluator.relinearize_new(bfv.evaluator.multiply_new(user, aggregate), bfv.relin_keys);
+    }
 };
 
-class PolyFixtureCpu : public benchmark::Fixture {
-public:
-    cpu::BFVContext *bfv;
-    std::vector<std::vector<uint64_t>> data;
-    std::vector<seal::Ciphertext> enc_data;
-    seal::Ciphertext aggregate, filtered, lt, *y;
-    std::array<int64_t, N_POLY_TERMS> *coefficients;
+std::unique_ptr<GpuWorkload> gpu_workload_cache;
 
-    void SetUp(::benchmark::State& state) {
-        // Precompute coefficients
-        coefficients = new std::array<int64_t, N_POLY_TERMS>();
-        cpu::calc_univ_poly_coefficients(*coefficients);
+GpuWorkload &gpu_workload() {
+    if (!gpu_workload_cache)
+        gpu_workload_cache = std::make_unique<GpuWorkload>();
+    return *gpu_workload_cache;
+}
+#endif
+
+// Peak resident set size in MB since the last reset_peak_rss, contexts and inputs of earlier runs included
+double peak_rss_mb() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind("VmHWM:", 0) == 0)
+            return std::stod(line.substr(6)) / 1024;
     }
+    return 0;
+}
 
-    void TearDown(::benchmark::State& state) {
-        delete coefficients;
+void reset_peak_rss() {
+    std::ofstream("/proc/self/clear_refs") << "5";
+}
+
+// Called right before the timed loop, so that the counters only cover the kernel
+void start_counters() {
+    cpu::op_counters().reset();
+    reset_peak_rss();
+}
+
+/*
+    Homomorphic operations per iteration, peak RSS, and the noise budget left in the result
+    next to the one predicted by the NoiseModel. They end up in the JSON output as user counters.
+*/
+void report_counters(benchmark::State &state, cpu::BFVContext &bfv, const std::string &stage, double predicted, const seal::Ciphertext &result) {
+    const auto &ops = cpu::op_counters();
+    state.counters["multiplications"] = benchmark::Counter(ops.multiplications, benchmark::Counter::kAvgIterations);
+    state.counters["plain_multiplications"] = benchmark::Counter(ops.plain_multiplications, benchmark::Counter::kAvgIterations);
+    state.counters["relinearizations"] = benchmark::Counter(ops.relinearizations, benchmark::Counter::kAvgIterations);
+    state.counters["mod_switches"] = benchmark::Counter(ops.mod_switches, benchmark::Counter::kAvgIterations);
+    state.counters["rotations"] = benchmark::Counter(ops.rotations, benchmark::Counter::kAvgIterations);
+    state.counters["peak_rss_mb"] = peak_rss_mb();
+    state.counters["noise_budget"] = bfv.decryptor.invariant_noise_budget(result);
+    state.counters["predicted_budget"] = predicted;
+    cpu::report_noise_budget(bfv, stage, predicted, result);
+}
+
+/*
+    Parameter set of a comparison benchmark with arguments k, users, workers and parms.
+    Infeasible combinations are skipped before any homomorphic work starts, returning nullptr.
+*/
+const ParameterSet *comparison_parameter_set(benchmark::State &state, cpu::Comparison method) {
+    const uint64_t k = state.range(0);
+    const size_t users = state.range(1);
+    try {
+        const ParameterSet &set = state.range(3) == AUTO_PARMS ? cpu::select_parameter_set(method, users, k) : PARAMETER_SETS[state.range(3)];
+        cpu::check_noise_budget(cpu::get_parameters(set), method, users, k);
+        return &set;
+    } catch (const std::invalid_argument &e) {
+        state.SkipWithError(e.what());
+        return nullptr;
     }
+}
+
+// Arguments k and users of a comparison benchmark, with the context of its parameter set
+struct ComparisonSetup {
+    const ParameterSet *set = nullptr;      // nullptr if the benchmark was skipped
+    cpu::BFVContext *bfv = nullptr;
+    const Workload *workload = nullptr;     // nullptr unless requested
+    uint64_t k = 0;
+    size_t users = 0;
 };
 
-class PolyFixtureGpu : public benchmark::Fixture {
+/*
+    Common setup of the comparison benchmarks with arguments k, users, workers and parms: selects
+    the parameter set, resizes the scheduler, warms the constants up to k and prints the banner of
+    the benchmark. The cached workload of the arguments is only built when with_workload is set.
+*/
+ComparisonSetup comparison_setup(benchmark::State &state, cpu::Comparison method, const std::string &name, bool with_workload = true) {
+    ComparisonSetup setup;
+    setup.set = comparison_parameter_set(state, method);
+    if (setup.set == nullptr)
+        return setup;
+    setup.k = state.range(0);
+    setup.users = state.range(1);
+    cpu::set_scheduler_threads(state.range(2));
+    setup.bfv = &cpu_context(*setup.set);
+    if (with_workload)
+        setup.workload = &cpu_workload(*setup.set, setup.users);
+    setup.bfv->warm_constants(0, setup.k);
+
+    std::cout << "Running CPU " << name << " benchmark with K = " << setup.k << ", " << setup.users << " users, "
+              << cpu::scheduler().threads() << " workers, parameters " << setup.set->name << std::endl;
+    return setup;
+}
+
+// Times kernel(bfv, filtered, k, result, budget) on the cached workload of setup,
+// budget being the predicted budget of filtered
+template <typename Kernel>
+void time_comparison(benchmark::State &state, const ComparisonSetup &setup, cpu::Comparison method, const std::string &stage, Kernel kernel) {
+    cpu::BFVContext &bfv = *setup.bfv;
+
+    cpu::NoiseModel model(bfv.parms);
+    const double budget = model.filter(model.aggregate(setup.users));
+    seal::Ciphertext lt;
+    start_counters();
+    for (auto _ : state)
+        kernel(bfv, setup.workload->filtered, setup.k, lt, budget);
+    report_counters(state, bfv, stage, model.pipeline(method, setup.users, setup.k), lt);
+}
+
+// time_comparison of a kernel that needs no other setup than comparison_setup
+template <typename Kernel>
+void run_comparison(benchmark::State &state, cpu::Comparison method, const std::string &stage, Kernel kernel) {
+    ComparisonSetup setup = comparison_setup(state, method, stage);
+    if (setup.set != nullptr)
+        time_comparison(state, setup, method, stage, kernel);
+}
+
+class RangeFixtureCpu : public benchmark::Fixture {};
+
+class PolyFixtureCpu : public benchmark::Fixture {
 public:
-    gpu::BFVContext *bfv;
-    std::vector<std::vector<uint64_t>> data;
-    std::vector<troy::Ciphertext> enc_data;
-    troy::Ciphertext aggregate, filtered, lt;
-    troy::Ciphertext *y;
-    std::array<int64_t, N_POLY_TERMS> *coefficients;
+    std::unique_ptr<cpu::CoefficientTable> coefficients;
 
     void SetUp(::benchmark::State& state) {
-        // Precompute coefficients
-        coefficients = new std::array<int64_t, N_POLY_TERMS>();
-        gpu::calc_univ_poly_coefficients(*coefficients);
+        // Map the precomputed coefficients, generating them on the first run
+        const ParameterSet &set = parameter_set_arg(state.range(3));
+        coefficients = std::make_unique<cpu::CoefficientTable>(cpu::load_univ_poly_coefficients(set.plain_modulus));
     }
 
-    void TearDown(::benchmark::State& state) {
-        delete coefficients;
+    void TearDown(::benchmark::State &) {
+        coefficients.reset();
     }
 };
 
 BENCHMARK_DEFINE_F(RangeFixtureCpu, cpu_single_threaded)(benchmark::State& state) {
-    // Generate test data
-    data = generate_dataset(N_USERS);
-    bfv = new cpu::BFVContext(cpu::get_default_parameters());
-    
-    // Encrypt
-    enc_data = cpu::encrypt_data(*bfv, data);
-
-    // Sum everything
-    bfv->evaluator.add_many(enc_data, aggregate);
-
-    // Filter by user
-    bfv->evaluator.multiply(enc_data[USER_IDX], aggregate, filtered);
-    bfv->evaluator.relinearize_inplace(filtered, bfv->relin_keys);
-
-    std::cout << "Running CPU single-threaded benchmark with K = " << state.range(0) << std::endl;
-
-    for (auto _ : state)
-        cpu::lt_range(*bfv, filtered, state.range(0), lt);
-    
-    delete bfv;
+    run_comparison(state, cpu::Comparison::range, "lt_range", cpu::lt_range);
 }
 
 BENCHMARK_DEFINE_F(RangeFixtureCpu, cpu_multi_threaded)(benchmark::State& state) {
-    data = generate_dataset(N_USERS);
-    bfv = new cpu::BFVContext(cpu::get_default_parameters());
-    enc_data = cpu::encrypt_data(*bfv, data);
-    bfv->evaluator.add_many(enc_data, aggregate);
-    bfv->evaluator.multiply(enc_data[USER_IDX], aggregate, filtered);
-    bfv->evaluator.relinearize_inplace(filtered, bfv->relin_keys);
-    std::cout << "Running CPU multi-threaded benchmark with K = " << state.range(0) << std::endl;
+    run_comparison(state, cpu::Comparison::range, "lt_range_mt", cpu::lt_range_mt);
+}
 
-    for (auto _ : state)
-        cpu::lt_range_mt(*bfv, filtered, state.range(0), lt);
-    
-    delete bfv;
+BENCHMARK_DEFINE_F(RangeFixtureCpu, cpu_single_threaded_prod)(benchmark::State& state) {
+    run_comparison(state, cpu::Comparison::range_prod, "lt_range_prod", cpu::lt_range_prod);
+}
+
+BENCHMARK_DEFINE_F(RangeFixtureCpu, cpu_multi_threaded_prod)(benchmark::State& state) {
+    run_comparison(state, cpu::Comparison::range_prod, "lt_range_prod_mt", cpu::lt_range_prod_mt);
 }
 
 BENCHMARK_DEFINE_F(PolyFixtureCpu, cpu_poly_univariate)(benchmark::State& state) {
-    data = generate_dataset(N_USERS);
-    bfv = new cpu::BFVContext(cpu::get_default_parameters());
-    enc_data = cpu::encrypt_data(*bfv, data);
-    bfv->evaluator.add_many(enc_data, aggregate);
-    bfv->evaluator.multiply(enc_data[USER_IDX], aggregate, filtered);
-    bfv->evaluator.relinearize_inplace(filtered, bfv->relin_keys);
+    ComparisonSetup setup = comparison_setup(state, cpu::Comparison::univariate, "lt_univariate");
+    if (setup.set == nullptr)
+        return;
+    cpu::BFVContext &bfv = *setup.bfv;
 
     // Prepare encrypted K (this algorithm does NOT require K to be in the clear)
-    seal::Plaintext k(std::to_string(state.range(0)));
-    y = new seal::Ciphertext();
-    bfv->encryptor.encrypt(k, *y);
-    
-    std::cout << "Running CPU multi-threaded polynomial benchmark with K = " << state.range(0) << std::endl;
+    seal::Ciphertext y;
+    bfv.encryptor.encrypt(bfv.constant(setup.k), y);
+    bfv.warm_constants(coefficients->begin(), coefficients->end());
 
-    for (auto _ : state)
-        cpu::lt_univariate(*bfv, *coefficients, filtered, *y, lt);
-
-    delete y;
-    delete bfv;
+    time_comparison(state, setup, cpu::Comparison::univariate, "lt_univariate", [&](cpu::BFVContext &bfv, const seal::Ciphertext &filtered, uint64_t, seal::Ciphertext &lt, double budget) {
+        cpu::lt_univariate(bfv, *coefficients, filtered, y, lt, budget);
+    });
 }
 
-BENCHMARK_DEFINE_F(RangeFixtureGpu, gpu_single_threaded)(benchmark::State& state) {
-    // Generate test data
-    data = generate_dataset(N_USERS);
-    bfv = new gpu::BFVContext(gpu::get_default_parameters());
-    
-    // Encrypt
-    enc_data = gpu::encrypt_data(*bfv, data);
+BENCHMARK_DEFINE_F(RangeFixtureCpu, cpu_bounded)(benchmark::State& state) {
+    ComparisonSetup setup = comparison_setup(state, cpu::Comparison::bounded, "lt_bounded");
+    if (setup.set == nullptr)
+        return;
+    cpu::BFVContext &bfv = *setup.bfv;
 
-    // Sum everything
-    bfv->encryptor.encrypt_zero_asymmetric(aggregate);
-    std::for_each(this->enc_data.begin(), this->enc_data.end(), [&](troy::Ciphertext &ctx) {
-        bfv->evaluator.add_inplace(this->aggregate, ctx);
+    // Filtered values are at most the number of users, the polynomial is interpolated before the timed loop
+    const uint64_t n_max = cpu::bounded_domain(setup.users);
+    const cpu::CoefficientTable &coefficients = cpu::bounded_lt_coefficients(setup.set->plain_modulus, setup.k, n_max);
+    bfv.warm_constants(coefficients.begin(), coefficients.end());
+    state.counters["degree"] = coefficients.size() - 1;
+
+    time_comparison(state, setup, cpu::Comparison::bounded, "lt_bounded", [&](cpu::BFVContext &bfv, const seal::Ciphertext &filtered, uint64_t k, seal::Ciphertext &lt, double budget) {
+        cpu::lt_bounded(bfv, filtered, k, n_max, lt, budget);
     });
+}
 
-    // Filter by user
-    troy::Ciphertext user_data = this->enc_data[USER_IDX];
-    troy::Ciphertext result = bfv->evaluator.multiply_new(user_data, aggregate);
-    filtered = bfv->evaluator.relinearize_new(result, bfv->relin_keys);
-    
-    std::cout << "Running GPU benchmark with K = " << state.range(0) << std::endl;
+BENCHMARK_DEFINE_F(RangeFixtureCpu, cpu_mask_respond)(benchmark::State& state) {
+    // The threshold mask is computed once for the aggregate, every iteration answers one user
+    ComparisonSetup setup = comparison_setup(state, cpu::Comparison::range_prod, "threshold mask");
+    if (setup.set == nullptr)
+        return;
+    cpu::BFVContext &bfv = *setup.bfv;
 
+    cpu::ThresholdMask mask(bfv, cpu::Comparison::range_prod, setup.k);
+    auto start = Clock::now();
+    mask.update(setup.workload->aggregate, setup.users);
+    std::chrono::duration<double> update_time = Clock::now() - start;
+
+    seal::Ciphertext response;
+    start_counters();
     for (auto _ : state)
-        gpu::lt_range(*bfv, filtered, state.range(0), lt);
+        mask.respond(setup.workload->user, response);
+    state.counters["update_s"] = update_time.count();
+    state.counters["response_bytes"] = response.save_size(seal::compr_mode_type::none);
+    cpu::NoiseModel model(bfv.parms);
+    double predicted = model.threshold_mask(cpu::Comparison::range_prod, setup.users, setup.k);
+    report_counters(state, bfv, "mask response", model.response(predicted, model.response_mod_switches(predicted)), response);
+}
 
-    delete bfv;
+BENCHMARK_DEFINE_F(RangeFixtureCpu, cpu_mask_compact)(benchmark::State& state) {
+    // Same as cpu_mask_respond, answering with the number of the user's regions with at least k users
+    ComparisonSetup setup = comparison_setup(state, cpu::Comparison::range_prod, "compact response");
+    if (setup.set == nullptr)
+        return;
+    cpu::BFVContext &bfv = *setup.bfv;
+
+    // The users of generate_locations all belong to a single country at slot 0
+    size_t slot_count = bfv.batch_encoder.slot_count();
+    size_t window = rotation_window(generate_locations(1).slot_count(), slot_count);
+    cpu::ThresholdMask mask(bfv, cpu::Comparison::range_prod, setup.k, nullptr, window);
+    auto start = Clock::now();
+    mask.update(setup.workload->aggregate, setup.users);
+    std::chrono::duration<double> update_time = Clock::now() - start;
+
+    seal::Ciphertext response;
+    start_counters();
+    for (auto _ : state)
+        mask.respond_compact(setup.workload->user, response);
+    state.counters["update_s"] = update_time.count();
+    state.counters["response_bytes"] = response.save_size(seal::compr_mode_type::none);
+    cpu::NoiseModel model(bfv.parms);
+    double predicted = model.threshold_mask(cpu::Comparison::range_prod, setup.users, setup.k);
+    size_t switches = model.response_mod_switches(predicted, window);
+    double budget = model.response(predicted, switches, window);
+    report_counters(state, bfv, "compact response", model.mod_switch(budget, model.result_mod_switches(budget, switches)), response);
 }
 
-BENCHMARK_DEFINE_F(PolyFixtureGpu, gpu_poly_univariate)(benchmark::State& state) {
-    data = generate_dataset(N_USERS);
-    bfv = new gpu::BFVContext(gpu::get_default_parameters());
-    enc_data = gpu::encrypt_data(*bfv, data);
+BENCHMARK_DEFINE_F(RangeFixtureCpu, cpu_aggregate)(benchmark::State& state) {
+    // Users are encrypted and streamed into the aggregator from every worker,
+    // only a few distinct plaintext rows and one running sum per shard are kept in memory
+    const size_t n_users = state.range(0);
+    cpu::set_scheduler_threads(state.range(1));
+    cpu::BFVContext &bfv = cpu_context(parameter_set_arg(state.range(2)));
+    auto data = generate_locations(DISTINCT_ROWS);
+    cpu::Aggregator aggregator(bfv);
+    seal::Ciphertext aggregate;
+    std::cout << "Running CPU streaming aggregation benchmark with " << n_users << " users" << std::endl;
+
+    start_counters();
+    for (auto _ : state) {
+        aggregator.reset();
+        cpu::encrypt_rows(bfv, n_users, [&](size_t user, seal::Plaintext &ptx) {
+            cpu::encode_locations(bfv, data, user % data.rows(), ptx);
+        }, [&](size_t, const seal::Ciphertext &ctx) {
+            aggregator.add(ctx);
+        });
+        aggregator.snapshot(aggregate);
+    }
+    state.SetItemsProcessed(state.iterations() * n_users);
+    state.counters["peak_rss_mb"] = peak_rss_mb();
+    state.counters["noise_budget"] = bfv.decryptor.invariant_noise_budget(aggregate);
+}
 
-    bfv->encryptor.encrypt_zero_asymmetric(aggregate);
-    std::for_each(this->enc_data.begin(), this->enc_data.end(), [&](troy::Ciphertext &ctx) {
-        bfv->evaluator.add_inplace(this->aggregate, ctx.to_device());
-    });
+BENCHMARK_DEFINE_F(RangeFixtureCpu, cpu_bulk_encryption)(benchmark::State& state) {
+    // Distinct users encoded from their slots and encrypted on every worker, streamed to a sink
+    // which drops them, so that the throughput of the ingest alone is measured at any scale
+    const size_t n_users = state.range(0);
+    cpu::set_scheduler_threads(state.range(1));
+    cpu::BFVContext &bfv = cpu_context(parameter_set_arg(state.range(2)));
+    auto data = generate_locations(n_users);
+    std::cout << "Running CPU bulk encryption benchmark with " << n_users << " users, "
+              << cpu::scheduler().threads() << " workers" << std::endl;
+
+    std::streamoff ciphertext_bytes = 0;
+    for (auto _ : state) {
+        cpu::encrypt_rows(bfv, n_users, [&](size_t user, seal::Plaintext &ptx) {
+            cpu::encode_locations(bfv, data, user, ptx);
+        }, [&](size_t user, const seal::Ciphertext &ctx) {
+            if (user == 0)
+                ciphertext_bytes = ctx.save_size(seal::compr_mode_type::none);
+        });
+    }
+    state.SetItemsProcessed(state.iterations() * n_users);
+    state.SetBytesProcessed(state.iterations() * n_users * ciphertext_bytes);
+    state.counters["peak_rss_mb"] = peak_rss_mb();
+}
 
-    troy::Ciphertext user_data = this->enc_data[USER_IDX].to_device();
-    troy::Ciphertext result = bfv->evaluator.multiply_new(user_data, aggregate);
-    filtered = bfv->evaluator.relinearize_new(result, bfv->relin_keys);
+BENCHMARK_DEFINE_F(RangeFixtureCpu, cpu_pipeline)(benchmark::State& state) {
+    /*
+        One full round of the protocol for every iteration: the users are encrypted and
+        streamed into the aggregator (ingest), the shards are summed (aggregate), one user
+        filters the aggregate (filter), compares it with k (threshold), and decrypts the result.
+        The time of every stage is reported as a counter next to the total.
+    */
+    // Users are encrypted by the benchmark itself, the cached workload is not needed
+    ComparisonSetup setup = comparison_setup(state, cpu::Comparison::range_prod, "pipeline", false);
+    if (setup.set == nullptr)
+        return;
+    const uint64_t k = setup.k;
+    const size_t users = setup.users;
+    cpu::BFVContext &bfv = *setup.bfv;
+    auto data = generate_locations(std::min<size_t>(users, DISTINCT_ROWS));
+    cpu::Aggregator aggregator(bfv);
+    seal::Ciphertext user, aggregate, filtered, lt;
+    seal::Plaintext ptx;
+    std::vector<uint64_t> result;
+
+    cpu::NoiseModel model(bfv.parms);
+    const double budget = model.filter(model.aggregate(users));
+    std::array<double, 5> stages {};
+    auto lap = [](Clock::time_point &start, double &total) {
+        auto now = Clock::now();
+        total += std::chrono::duration<double>(now - start).count();
+        start = now;
+    };
+
+    start_counters();
+    for (auto _ : state) {
+        auto start = Clock::now();
+        aggregator.reset();
+        cpu::encrypt_rows(bfv, users, [&](size_t i, seal::Plaintext &ptx) {
+            cpu::encode_locations(bfv, data, i % data.rows(), ptx);
+        }, [&](size_t i, const seal::Ciphertext &ctx) {
+            if (i == USER_IDX)
+                user = ctx;
+            aggregator.add(ctx);
+        });
+        lap(start, stages[0]);
+
+        aggregator.snapshot(aggregate);
+        lap(start, stages[1]);
+
+        bfv.evaluator.multiply(user, aggregate, filtered, cpu::current_pool());
+        bfv.evaluator.relinearize_inplace(filtered, bfv.relin_keys, cpu::current_pool());
+        lap(start, stages[2]);
+
+        cpu::lt_range_prod_mt(bfv, filtered, k, lt, budget);
+        lap(start, stages[3]);
+
+        bfv.decryptor.decrypt(lt, ptx);
+        bfv.batch_encoder.decode(ptx, result);
+        lap(start, stages[4]);
+    }
 
-    // Prepare encrypted K (this algorithm does NOT require K to be in the clear)
-    troy::Plaintext k = bfv->batch_encoder.encode_new(std::vector<uint64_t>(bfv->batch_encoder.slot_count(), state.range(0)));
-    y = new troy::Ciphertext(bfv->encryptor.encrypt_asymmetric_new(k));
+    const char *names[] = { "ingest_s", "aggregate_s", "filter_s", "threshold_s", "decrypt_s" };
+    for (size_t i = 0; i < stages.size(); ++i)
+        state.counters[names[i]] = benchmark::Counter(stages[i], benchmark::Counter::kAvgIterations);
+    state.SetItemsProcessed(state.iterations() * users);
+    report_counters(state, bfv, "pipeline", model.pipeline(cpu::Comparison::range_prod, users, k), lt);
+}
 
-    std::cout << "Running GPU polynomial benchmark with K = " << state.range(0) << std::endl;
+BENCHMARK_DEFINE_F(RangeFixtureCpu, cpu_snapshot_load)(benchmark::State& state) {
+    // Aggregates are written once, then mapped and loaded back as a restarted server would
+    const size_t n_ciphertexts = state.range(0);
+    const std::string path = "snapshot.bin";
+    cpu::BFVContext &bfv = cpu_context(DEFAULT_PARAMETER_SET);
+    auto enc_data = cpu::encrypt_data(bfv, generate_locations(n_ciphertexts));
+    {
+        cpu::SnapshotWriter writer(path, bfv.context, enc_data[0].parms_id(), 1);
+        for (const auto &ciphertext : enc_data)
+            writer.write(ciphertext);
+        writer.close();
+    }
+    std::cout << "Running CPU snapshot load benchmark with " << n_ciphertexts << " ciphertexts" << std::endl;
 
-    for (auto _ : state)
-        gpu::lt_univariate(*bfv, *coefficients, filtered, *y, lt);
-    
-    delete y;
-    delete bfv;
+    reset_peak_rss();
+    for (auto _ : state) {
+        auto snapshot = cpu::Snapshot::map(path);
+        auto loaded = snapshot.load_all(bfv.context);
+        benchmark::DoNotOptimize(loaded);
+    }
+    state.SetItemsProcessed(state.iterations() * n_ciphertexts);
+    state.counters["peak_rss_mb"] = peak_rss_mb();
+
+    std::remove(path.c_str());
 }
 
-BENCHMARK_DEFINE_F(RangeFixtureCpu, cpu_encoding)(benchmark::State& state) {
-    data = generate_dataset(1);
-    bfv = new cpu::BFVContext(cpu::get_default_parameters());
-    seal::Plaintext ptx;
-    std::cout << "Running CPU encoding benchmark" << std::endl;
+BENCHMARK_DEFINE_F(RangeFixtureCpu, cpu_key_generation)(benchmark::State& state) {
+    // Startup of a server that generates its keys, the relinearization keys taking most of it
+    const ParameterSet &set = parameter_set_arg(state.range(0));
+    auto parms = cpu::get_parameters(set);
+    std::cout << "Running CPU key generation benchmark with parameters " << set.name << std::endl;
 
     for (auto _ : state) {
-        bfv->batch_encoder.encode(data[0], ptx);
+        cpu::BFVContext bfv(parms);
+        benchmark::DoNotOptimize(bfv);
     }
 }
 
-BENCHMARK_DEFINE_F(RangeFixtureCpu, cpu_decoding)(benchmark::State& state) {
-    data = generate_dataset(1);
-    bfv = new cpu::BFVContext(cpu::get_default_parameters());
+BENCHMARK_DEFINE_F(RangeFixtureCpu, cpu_key_load)(benchmark::State& state) {
+    // Startup of a server from a key bundle written once, as on a restart or a new replica
+    const ParameterSet &set = parameter_set_arg(state.range(0));
+    const std::string path = "server.keys";
+    cpu::save_server_keys(path, cpu_context(set));
+    std::cout << "Running CPU key load benchmark with parameters " << set.name << std::endl;
+
+    for (auto _ : state) {
+        auto bfv = cpu::load_server_context(path);
+        benchmark::DoNotOptimize(*bfv);
+    }
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    state.SetBytesProcessed(state.iterations() * file.tellg());
+
+    std::remove(path.c_str());
+}
+
+BENCHMARK_DEFINE_F(RangeFixtureCpu, cpu_geolocate)(benchmark::State& state) {
+    // Users at random points of random regions, located straight into the slots of the packed layouts
+    const size_t n_users = state.range(0);
+    const ParameterSet &set = parameter_set_arg(state.range(1));
+    GeoIndex index;
+    try {
+        index = GeoIndex::map(geoindex_path);
+    } catch (const std::runtime_error &e) {
+        state.SkipWithError(e.what());
+        return;
+    }
+    if (index.regions() == 0) {
+        state.SkipWithError("the region index is empty");
+        return;
+    }
+    auto layouts = pack_countries(size_t(1) << set.poly_mod_deg_exp, load_region_stats(REGION_STATS_PATH));
+    Geolocator geolocator(index, layouts);
+
+    std::vector<double> x(n_users), y(n_users);
+    std::mt19937 gen(1);
+    std::uniform_int_distribution<size_t> pick(0, index.regions() - 1);
+    std::uniform_real_distribution<double> unit(0, 1);
+    for (size_t i = 0; i < n_users; ++i) {
+        const GeoRegion &region = index.region(pick(gen));
+        x[i] = region.min_x + unit(gen) * (region.max_x - region.min_x);
+        y[i] = region.min_y + unit(gen) * (region.max_y - region.min_y);
+    }
+    LocationVectors locations(GEO_INDEX_LEVELS, layouts.empty() ? 0 : layouts[0].slot_count(), n_users);
+    std::vector<uint32_t> user_layouts;
+    std::cout << "Running CPU geolocation benchmark with " << n_users << " users, " << index.regions() << " regions" << std::endl;
+
+    for (auto _ : state) {
+        geolocator.locate(x.data(), y.data(), n_users, locations, user_layouts);
+        benchmark::DoNotOptimize(user_layouts.data());
+    }
+    state.SetItemsProcessed(state.iterations() * n_users);
+    state.counters["located"] = std::count_if(user_layouts.begin(), user_layouts.end(), [](uint32_t layout) {
+        return layout != Geolocator::NOT_FOUND;
+    }) / double(n_users);
+}
+
+BENCHMARK_DEFINE_F(RangeFixtureCpu, cpu_encoding)(benchmark::State& state) {
+    auto data = generate_dataset(1);
+    cpu::BFVContext &bfv = cpu_context(DEFAULT_PARAMETER_SET);
     seal::Plaintext ptx;
-    bfv->batch_encoder.encode(data[0], ptx);
-    std::vector<uint64_t> out;
-    std::cout << "Running CPU decoding benchmark" << std::endl;
+    std::cout << "Running CPU encoding benchmark" << std::endl;
 
     for (auto _ : state) {
-        bfv->batch_encoder.decode(ptx, out);
+        bfv.batch_encoder.encode(data[0], ptx);
     }
 }
 
-BENCHMARK_DEFINE_F(RangeFixtureGpu, gpu_encoding)(benchmark::State& state) {
-    data = generate_dataset(1);
-    bfv = new gpu::BFVContext(gpu::get_default_parameters());
-    troy::Plaintext ptx;
-    std::cout << "Running GPU encoding benchmark" << std::endl;
+BENCHMARK_DEFINE_F(RangeFixtureCpu, cpu_encoding_sparse)(benchmark::State& state) {
+    // Location vectors like the ones of cpu_encoding, encoded from the slots of their regions
+    auto data = generate_locations(1);
+    cpu::BFVContext &bfv = cpu_context(DEFAULT_PARAMETER_SET);
+    seal::Plaintext ptx;
+    std::cout << "Running CPU sparse encoding benchmark" << std::endl;
 
     for (auto _ : state) {
-        ptx = bfv->batch_encoder.encode_new(data[0]);
+        cpu::encode_locations(bfv, data, 0, ptx);
     }
 }
 
-BENCHMARK_DEFINE_F(RangeFixtureGpu, gpu_decoding)(benchmark::State& state) {
-    data = generate_dataset(1);  
-    bfv = new gpu::BFVContext(gpu::get_default_parameters());
-    troy::Plaintext ptx;
-    ptx = bfv->batch_encoder.encode_new(data[0]);
+BENCHMARK_DEFINE_F(RangeFixtureCpu, cpu_decoding)(benchmark::State& state) {
+    auto data = generate_dataset(1);
+    cpu::BFVContext &bfv = cpu_context(DEFAULT_PARAMETER_SET);
+    seal::Plaintext ptx;
+    bfv.batch_encoder.encode(data[0], ptx);
     std::vector<uint64_t> out;
-    std::cout << "Running GPU decoding benchmark" << std::endl;
+    std::cout << "Running CPU decoding benchmark" << std::endl;
 
     for (auto _ : state) {
-        out = bfv->batch_encoder.decode_new(ptx);
+        bfv.batch_encoder.decode(ptx, out);
     }
 }
+
 BENCHMARK_DEFINE_F(RangeFixtureCpu, cpu_encryption)(benchmark::State& state) {
-    data = generate_dataset(1);
-    bfv = new cpu::BFVContext(cpu::get_default_parameters());
+    auto data = generate_dataset(1);
+    cpu::BFVContext &bfv = cpu_context(DEFAULT_PARAMETER_SET);
     seal::Plaintext ptx;
     seal::Ciphertext ctx;
-    bfv->batch_encoder.encode(data[0], ptx);
+    bfv.batch_encoder.encode(data[0], ptx);
     std::cout << "Running CPU encryption benchmark" << std::endl;
 
     for (auto _ : state) {
-        bfv->encryptor.encrypt(ptx, ctx);
+        bfv.encryptor.encrypt(ptx, ctx);
     }
 }
 
 BENCHMARK_DEFINE_F(RangeFixtureCpu, cpu_decryption)(benchmark::State& state) {
-    data = generate_dataset(1);
-    bfv = new cpu::BFVContext(cpu::get_default_parameters());
-    enc_data = cpu::encrypt_data(*bfv, data);
+    cpu::BFVContext &bfv = cpu_context(DEFAULT_PARAMETER_SET);
+    const Workload &workload = cpu_workload(DEFAULT_PARAMETER_SET, N_USERS);
     seal::Plaintext ptx;
     std::cout << "Running CPU decryption benchmark" << std::endl;
 
     for (auto _ : state) {
-        bfv->decryptor.decrypt(enc_data[0], ptx);
+        bfv.decryptor.decrypt(workload.user, ptx);
+    }
+}
+
+/*
+    Runs every CPU comparison over its whole input domain, packed into as many ciphertexts as needed,
+    and checks the decrypted output against x < k: [0, p) for the range methods, the p values of
+    [k - (p-1)/2, k + (p-1)/2] for lt_univariate, and [0, bounded_domain(N_USERS)] for lt_bounded.
+*/
+bool test_comparisons() {
+    const uint64_t k = 10;
+    cpu::BFVContext &bfv = cpu_context(DEFAULT_PARAMETER_SET);
+    const uint64_t p = bfv.parms.plain_modulus().value();
+    const size_t slot_count = bfv.batch_encoder.slot_count();
+    const uint64_t n_max = cpu::bounded_domain(N_USERS);
+    auto coefficients = cpu::load_univ_poly_coefficients(p);
+    seal::Ciphertext y;
+    bfv.encryptor.encrypt(bfv.constant(k), y);
+
+    using Kernel = std::function<void(const seal::Ciphertext &, seal::Ciphertext &)>;
+    // Checks the integers [low, low + domain), encrypted as their residues modulo p
+    auto check = [&](const std::string &name, int64_t low, uint64_t domain, Kernel kernel) {
+        std::cout << "Checking " << name << " over " << domain << " values from " << low << "..." << std::endl;
+        auto value = [&](uint64_t i) { return low + int64_t(i % domain); };
+        std::vector<uint64_t> x(slot_count), output;
+        seal::Plaintext ptx;
+        seal::Ciphertext ctx, result;
+        for (uint64_t first = 0; first < domain; first += slot_count) {
+            // The last ciphertext wraps around to the start of the domain
+            for (size_t i = 0; i < slot_count; ++i)
+                x[i] = uint64_t((value(first + i) % int64_t(p) + int64_t(p)) % int64_t(p));
+            bfv.batch_encoder.encode(x, ptx);
+            bfv.encryptor.encrypt(ptx, ctx);
+            kernel(ctx, result);
+            bfv.decryptor.decrypt(result, ptx);
+            bfv.batch_encoder.decode(ptx, output);
+            for (size_t i = 0; i < slot_count; ++i) {
+                const uint64_t expected = value(first + i) < int64_t(k) ? 1 : 0;
+                if (output[i] != expected) {
+                    std::cout << name << " outputs " << output[i] << " for x = " << value(first + i) << ", k = " << k
+                              << " instead of " << expected << "." << std::endl;
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+
+    bool ok = check("lt_range", 0, p, [&](const seal::Ciphertext &x, seal::Ciphertext &result) {
+        cpu::lt_range(bfv, x, k, result);
+    });
+    ok = check("lt_range_mt", 0, p, [&](const seal::Ciphertext &x, seal::Ciphertext &result) {
+        cpu::lt_range_mt(bfv, x, k, result);
+    }) && ok;
+    ok = check("lt_range_prod", 0, p, [&](const seal::Ciphertext &x, seal::Ciphertext &result) {
+        cpu::lt_range_prod(bfv, x, k, result);
+    }) && ok;
+    ok = check("lt_range_prod_mt", 0, p, [&](const seal::Ciphertext &x, seal::Ciphertext &result) {
+        cpu::lt_range_prod_mt(bfv, x, k, result);
+    }) && ok;
+    ok = check("lt_univariate", int64_t(k) - int64_t(p - 1) / 2, p, [&](const seal::Ciphertext &x, seal::Ciphertext &result) {
+        cpu::lt_univariate(bfv, coefficients, x, y, result);
+    }) && ok;
+    ok = check("lt_bounded", 0, n_max + 1, [&](const seal::Ciphertext &x, seal::Ciphertext &result) {
+        cpu::lt_bounded(bfv, x, k, n_max, result);
+    }) && ok;
+
+    if (ok)
+        std::cout << "OK!" << std::endl;
+    return ok;
+}
+
+// Stops an anonymizer server with a snapshot, restarts it and checks that it resumes with the users of the first run
+bool test_restart() {
+    const std::string snapshot_path = "restart_snapshot.bin";
+    const uint64_t k = 3;
+    const size_t n_users = 20;
+    std::remove(snapshot_path.c_str());
+
+    cpu::BFVContext &bfv = cpu_context(DEFAULT_PARAMETER_SET);
+    cpu::ServerOptions options;
+    options.address = "/tmp/anonymizer_restart.sock";
+    options.method = cpu::Comparison::range;
+    options.k = k;
+    options.epoch_interval = std::chrono::milliseconds(100);
+    options.snapshot_path = snapshot_path;
+    cpu::AnonymizerClient client(options.address);
+
+    auto data = generate_locations(n_users + 1);
+    auto enc_data = cpu::encrypt_data(bfv, data);
+
+    std::cout << "Submitting " << n_users << " users to the first server..." << std::endl;
+    {
+        cpu::Server server(bfv, options);
+        server.start();
+        for (size_t i = 0; i < n_users; ++i)
+            client.submit(enc_data[i]);
+        server.stop();
+    }
+
+    // The restored mask answers right away, before any new submission
+    std::cout << "Restarting from " << snapshot_path << "..." << std::endl;
+    cpu::Server server(bfv, options);
+    server.start();
+    seal::Ciphertext response;
+    uint64_t users = 0;
+    try {
+        client.query(bfv.context, enc_data[0], response);
+        users = client.submit(enc_data[n_users]);
+    } catch (const std::runtime_error &e) {
+        std::cout << "The restarted server failed: " << e.what() << std::endl;
+    }
+    server.stop();
+    std::remove(snapshot_path.c_str());
+    if (users == 0)
+        return false;
+
+    seal::Plaintext ptx;
+    std::vector<uint64_t> v_response;
+    bfv.decryptor.decrypt(response, ptx);
+    bfv.batch_encoder.decode(ptx, v_response);
+
+    // user * [aggregate < k] over the users of the first run
+    std::vector<uint64_t> counts(data.slot_count(), 0), v_expected(v_response.size(), 0);
+    for (size_t i = 0; i < n_users; ++i) {
+        auto row = data.dense(i);
+        for (size_t j = 0; j < row.size(); ++j)
+            counts[j] += row[j];
+    }
+    auto user = data.dense(0);
+    for (size_t j = 0; j < user.size(); ++j)
+        v_expected[j] = user[j] != 0 && counts[j] < k ? 1 : 0;
+
+    if (users != n_users + 1) {
+        std::cout << "The restarted server counts " << users << " users instead of " << n_users + 1 << "." << std::endl;
+        return false;
+    }
+    if (v_response != v_expected) {
+        std::cout << "The response of the restarted server does not match the users of the first run." << std::endl;
+        return false;
+    }
+    std::cout << "OK!" << std::endl;
+    return true;
+}
+
+#ifdef HAVE_CUDA
+class RangeFixtureGpu : public benchmark::Fixture {};
+
+class PolyFixtureGpu : public benchmark::Fixture {
+public:
+    std::array<int64_t, N_POLY_TERMS> *coefficients;
+
+    void SetUp(::benchmark::State& state) {
+        // Copy the precomputed coefficients, generating them on the first run
+        coefficients = new std::array<int64_t, N_POLY_TERMS>();
+        auto table = cpu::load_univ_poly_coefficients(PLAIN_MOD);
+        std::copy(table.begin(), table.end(), coefficients->begin());
+    }
+
+    void TearDown(::benchmark::State &) {
+        delete coefficients;
+    }
+};
+
+
+BENCHMARK_DEFINE_F(RangeFixtureGpu, gpu_single_threaded)(benchmark::State& state) {
+    GpuWorkload &workload = gpu_workload();
+    troy::Ciphertext lt;
+    std::cout << "Running GPU benchmark with K = " << state.range(0) << std::endl;
+
+    workload.bfv.warm_constants(0, state.range(0));
+
+    for (auto _ : state)
+        gpu::lt_range(workload.bfv, workload.filtered, state.range(0), lt);
+}
+
+BENCHMARK_DEFINE_F(PolyFixtureGpu, gpu_poly_univariate)(benchmark::State& state) {
+    GpuWorkload &workload = gpu_workload();
+    troy::Ciphertext lt;
+
+    // Prepare encrypted K (this algorithm does NOT require K to be in the clear)
+    // The coefficients are encoded block by block during the evaluation, caching all of them would not fit on the device
+    troy::Ciphertext y = workload.bfv.encryptor.encrypt_asymmetric_new(workload.bfv.constant(state.range(0)));
+
+    std::cout << "Running GPU polynomial benchmark with K = " << state.range(0) << std::endl;
+
+    for (auto _ : state)
+        gpu::lt_univariate(workload.bfv, *coefficients, workload.filtered, y, lt);
+}
+
+BENCHMARK_DEFINE_F(RangeFixtureGpu, gpu_bounded)(benchmark::State& state) {
+    GpuWorkload &workload = gpu_workload();
+    troy::Ciphertext lt;
+
+    // The workload aggregates N_USERS users, the polynomial is interpolated before the timed loop
+    const uint64_t n_max = cpu::bounded_domain(N_USERS);
+    cpu::bounded_lt_coefficients(PLAIN_MOD, state.range(0), n_max);
+
+    std::cout << "Running GPU bounded benchmark with K = " << state.range(0) << ", domain [0, " << n_max << "]" << std::endl;
+
+    for (auto _ : state)
+        gpu::lt_bounded(workload.bfv, workload.filtered, state.range(0), n_max, lt);
+}
+
+BENCHMARK_DEFINE_F(RangeFixtureGpu, gpu_encoding)(benchmark::State& state) {
+    auto data = generate_dataset(1);
+    gpu::BFVContext &bfv = gpu_workload().bfv;
+    troy::Plaintext ptx;
+    std::cout << "Running GPU encoding benchmark" << std::endl;
+
+    for (auto _ : state) {
+        ptx = bfv.batch_encoder.encode_new(data[0]);
+    }
+}
+
+BENCHMARK_DEFINE_F(RangeFixtureGpu, gpu_decoding)(benchmark::State& state) {
+    auto data = generate_dataset(1);
+    gpu::BFVContext &bfv = gpu_workload().bfv;
+    troy::Plaintext ptx;
+    ptx = bfv.batch_encoder.encode_new(data[0]);
+    std::vector<uint64_t> out;
+    std::cout << "Running GPU decoding benchmark" << std::endl;
+
+    for (auto _ : state) {
+        out = bfv.batch_encoder.decode_new(ptx);
     }
 }
 
 BENCHMARK_DEFINE_F(RangeFixtureGpu, gpu_encryption)(benchmark::State& state) {
-    data = generate_dataset(1);
-    bfv = new gpu::BFVContext(gpu::get_default_parameters());
+    auto data = generate_dataset(1);
+    gpu::BFVContext &bfv = gpu_workload().bfv;
     troy::Plaintext ptx;
     troy::Ciphertext ctx;
-    ptx = bfv->batch_encoder.encode_new(data[0]);
+    ptx = bfv.batch_encoder.encode_new(data[0]);
     std::cout << "Running GPU encryption benchmark" << std::endl;
 
     for (auto _ : state) {
-        ctx = bfv->encryptor.encrypt_asymmetric_new(ptx.to_device());
+        ctx = bfv.encryptor.encrypt_asymmetric_new(ptx.to_device());
     }
 }
 
 BENCHMARK_DEFINE_F(RangeFixtureGpu, gpu_decryption)(benchmark::State& state) {
-    data = generate_dataset(1);  
-    bfv = new gpu::BFVContext(gpu::get_default_parameters());
-    enc_data = gpu::encrypt_data(*bfv, data);
+    GpuWorkload &workload = gpu_workload();
     troy::Plaintext ptx;
     std::cout << "Running GPU decryption benchmark" << std::endl;
 
     for (auto _ : state) {
-        ptx = bfv->decryptor.decrypt_new(enc_data[0].to_device());
+        ptx = workload.bfv.decryptor.decrypt_new(workload.user);
     }
 }
 
 void test_equivalence() {
     std::cout << "Setting up..." << std::endl;
     gpu::BFVContext bfv(gpu::get_default_parameters());
-    std::vector<std::vector<uint64_t>> data;
     std::vector<troy::Ciphertext> enc_data;
     troy::Ciphertext aggregate, filtered, lt;
 
     // Use a small dataset for simplicity
     const size_t limit = 20;
-    data = generate_dataset(N_USERS, limit, 0.1);
-    enc_data = gpu::encrypt_data(bfv, data);
+    enc_data = gpu::encrypt_data(bfv, generate_dataset(N_USERS, limit, 0.1));
     bfv.encryptor.encrypt_zero_asymmetric(aggregate);
     std::for_each(enc_data.begin(), enc_data.end(), [&](troy::Ciphertext &ctx) {
         bfv.evaluator.add_inplace(aggregate, ctx.to_device());
@@ -304,7 +889,8 @@ void test_equivalence() {
     const auto k_value = 10;
 
     coefficients = new std::array<int64_t, N_POLY_TERMS>();
-    gpu::calc_univ_poly_coefficients(*coefficients);
+    auto table = cpu::load_univ_poly_coefficients(PLAIN_MOD);
+    std::copy(table.begin(), table.end(), coefficients->begin());
 
     troy::Plaintext k = bfv.batch_encoder.encode_new(std::vector<uint64_t>(bfv.batch_encoder.slot_count(), k_value));
     troy::Ciphertext y = bfv.encryptor.encrypt_asymmetric_new(k);
@@ -323,17 +909,7 @@ void test_equivalence() {
     bfv.batch_encoder.decode(ptx_range, v_range);
     bfv.batch_encoder.decode(ptx_poly, v_poly);
 
-    // Convert the polynomial format into boolean format:
-    // The polynomial value is negative if X - Y is negative (which implies X < Y).
-    // The result is unsigned, but can be interpreted as signed by shifing it down by p/2.
-    auto v_poly_original = v_poly;
-    std::for_each(std::execution::par, v_poly.begin(), v_poly.end(), [&](uint64_t &i) {
-        if (interpret_as_signed_mod_p(i, PLAIN_MOD) < 0)
-            i = 1;  // Below the threshold k
-        else
-            i = 0;  // Over the threshold k
-    });
-
+    // Both methods output the indicator [x < k], 1 below the threshold and 0 over it
     if (v_poly.size() != v_range.size())
         std::cout << "The sizes of the two vectors are not equal." << std::endl;
 
@@ -346,69 +922,201 @@ void test_equivalence() {
     std::cout << "Range method result: " << std::endl;
     print_vector(v_range, limit);
     std::cout << "Polynomial method result: " << std::endl;
-    print_vector(v_poly_original, limit);
     print_vector(v_poly, limit);
 
     delete coefficients;
 }
+#endif
+
+// Splits a comma separated list of arguments
+std::vector<std::string> split_list(const std::string &list) {
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ','))
+        items.push_back(item);
+    return items;
+}
+
+std::vector<int64_t> parse_integers(const std::string &list) {
+    std::vector<int64_t> values;
+    for (const auto &item : split_list(list))
+        values.push_back(std::stoll(item));
+    return values;
+}
+
+// Arguments of a comparison benchmark, every k for every combination of the dimensions
+const std::vector<std::string> COMPARISON_ARG_NAMES = { "k", "users", "workers", "parms" };
+
+std::vector<std::vector<int64_t>> comparison_args(const std::vector<int64_t> &ks, bool multi_threaded) {
+    return { ks, users_args, multi_threaded ? workers_args : std::vector<int64_t> { 1 }, parms_args };
+}
 
 int main(int argc, char** argv) {
 
+    std::string trace_path;
     std::vector<std::string> args;
     for(int i = 0; i < argc; ++i) {
         args.push_back(std::string(argv[i]));
     }
 
+    for(std::string arg : args) {
+        if (arg.rfind("--parms=", 0) == 0) {
+            parms_args.clear();
+            for (const auto &name : split_list(arg.substr(std::string("--parms=").size()))) {
+                if (name == "auto") {
+                    parms_args.push_back(AUTO_PARMS);
+                    continue;
+                }
+                auto it = std::find_if(PARAMETER_SETS.begin(), PARAMETER_SETS.end(), [&](const ParameterSet &set) {
+                    return name == set.name;
+                });
+                if (it == PARAMETER_SETS.end()) {
+                    std::cout << "Unknown parameter set: " << name << std::endl;
+                    return -1;
+                }
+                parms_args.push_back(it - PARAMETER_SETS.begin());
+            }
+        }
+        if (arg.rfind("--users=", 0) == 0) {
+            users_args = parse_integers(arg.substr(std::string("--users=").size()));
+        }
+        if (arg.rfind("--geoindex=", 0) == 0) {
+            geoindex_path = arg.substr(std::string("--geoindex=").size());
+        }
+        if (arg.rfind("--threads=", 0) == 0) {
+            // Degree of parallelism of the CPU kernels, one thread per core by default
+            workers_args = parse_integers(arg.substr(std::string("--threads=").size()));
+        }
+        if (arg.rfind("--trace=", 0) == 0) {
+            // Chrome trace of the homomorphic operations of the whole run
+#ifdef HE_TRACE
+            trace_path = arg.substr(std::string("--trace=").size());
+#else
+            std::cout << "Built without HE_TRACE, --trace is not available" << std::endl;
+            return -1;
+#endif
+        }
+    }
+    if (workers_args.empty())
+        workers_args = { int64_t(cpu::scheduler().threads()) };
+
+    for(std::string arg : args) {
+        if (arg.rfind("--write-layout=", 0) == 0) {
+            // Pack the countries in as few ciphertexts as possible and write the descriptor for the clients
+            std::string path = arg.substr(std::string("--write-layout=").size());
+            const ParameterSet &set = parameter_set_arg(parms_args.front());
+            std::vector<std::string> oversized;
+            auto layouts = pack_countries(size_t(1) << set.poly_mod_deg_exp, load_region_stats(REGION_STATS_PATH), &oversized);
+            save_slot_layouts(path, layouts);
+
+            std::cout << "Packed the countries of " << REGION_STATS_PATH << " into " << layouts.size() << " ciphertexts" << std::endl;
+            for (const auto &name : oversized)
+                std::cout << "Not packed, larger than a ciphertext: " << name << std::endl;
+            return 0;
+        }
+    }
+
     bool has_type = false;
     for(std::string arg : args) {
         has_type = arg.find("--type") != std::string::npos;
         if(has_type) {
             if (arg == "--type=mt") {
-                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_multi_threaded)->DenseRange(10, 20, 1);             
+                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_multi_threaded)->ArgNames(COMPARISON_ARG_NAMES)->ArgsProduct(comparison_args(benchmark::CreateDenseRange(10, 20, 1), true));
             } else if (arg == "--type=mt_range") {
-                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_multi_threaded)->DenseRange(10, 100, 10);           
+                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_multi_threaded)->ArgNames(COMPARISON_ARG_NAMES)->ArgsProduct(comparison_args(benchmark::CreateDenseRange(10, 100, 10), true));
+                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_multi_threaded_prod)->ArgNames(COMPARISON_ARG_NAMES)->ArgsProduct(comparison_args(benchmark::CreateDenseRange(10, 100, 10), true));
             } else if (arg == "--type=st") {
-                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_single_threaded)->DenseRange(10, 20, 1);           
+                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_single_threaded)->ArgNames(COMPARISON_ARG_NAMES)->ArgsProduct(comparison_args(benchmark::CreateDenseRange(10, 20, 1), false));
             } else if (arg == "--type=st_range") {
-                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_single_threaded)->DenseRange(10, 50, 10);           
+                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_single_threaded)->ArgNames(COMPARISON_ARG_NAMES)->ArgsProduct(comparison_args(benchmark::CreateDenseRange(10, 50, 10), false));
+                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_single_threaded_prod)->ArgNames(COMPARISON_ARG_NAMES)->ArgsProduct(comparison_args(benchmark::CreateDenseRange(10, 50, 10), false));
+            } else if (arg == "--type=mask") {
+                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_mask_respond)->ArgNames(COMPARISON_ARG_NAMES)->ArgsProduct(comparison_args(benchmark::CreateDenseRange(10, 100, 10), true));
+                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_mask_compact)->ArgNames(COMPARISON_ARG_NAMES)->ArgsProduct(comparison_args(benchmark::CreateDenseRange(10, 100, 10), true));
+            } else if (arg == "--type=pipeline") {
+                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_pipeline)->ArgNames(COMPARISON_ARG_NAMES)->ArgsProduct(comparison_args({ 10, 50, 100 }, true));
+            } else if (arg == "--type=aggregate") {
+                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_aggregate)->ArgNames({ "users", "workers", "parms" })
+                    ->ArgsProduct({ benchmark::CreateRange(100, 100000, 10), workers_args, parms_args });
+            } else if (arg == "--type=ingest") {
+                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_bulk_encryption)->ArgNames({ "users", "workers", "parms" })
+                    ->ArgsProduct({ benchmark::CreateRange(1000, 100000, 10), workers_args, parms_args });
+            } else if (arg == "--type=geolocate") {
+                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_geolocate)->ArgNames({ "users", "parms" })
+                    ->ArgsProduct({ benchmark::CreateRange(1000, 1000000, 10), parms_args });
+            } else if (arg == "--type=keys") {
+                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_key_generation)->ArgNames({ "parms" })->ArgsProduct({ parms_args });
+                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_key_load)->ArgNames({ "parms" })->ArgsProduct({ parms_args });
+            } else if (arg == "--type=snapshot") {
+                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_snapshot_load)->RangeMultiplier(10)->Range(10, 100);
             } else if (arg == "--type=poly") {
-                BENCHMARK_REGISTER_F(PolyFixtureCpu, cpu_poly_univariate)->DenseRange(10, 100, 10);
+                BENCHMARK_REGISTER_F(PolyFixtureCpu, cpu_poly_univariate)->ArgNames(COMPARISON_ARG_NAMES)->ArgsProduct(comparison_args(benchmark::CreateDenseRange(10, 100, 10), true));
+            } else if (arg == "--type=bounded") {
+                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_bounded)->ArgNames(COMPARISON_ARG_NAMES)->ArgsProduct(comparison_args(benchmark::CreateDenseRange(10, 100, 10), true));
+            } else if (arg == "--type=cpu_encode") {
+                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_encoding);
+                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_encoding_sparse);
+            } else if (arg == "--type=cpu_decode") {
+                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_decoding);
+            } else if (arg == "--type=cpu_encrypt") {
+                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_encryption);
+            } else if (arg == "--type=cpu_decrypt") {
+                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_decryption);
+            } else if (arg == "--type=test_restart") {
+                return test_restart() ? 0 : -1;
+            } else if (arg == "--type=test_cpu_eq") {
+                return test_comparisons() ? 0 : -1;
+#ifdef HAVE_CUDA
             } else if (arg == "--type=gpu") {
                 BENCHMARK_REGISTER_F(RangeFixtureGpu, gpu_single_threaded)->DenseRange(10, 20, 1);
             } else if (arg == "--type=gpu_range") {
                 BENCHMARK_REGISTER_F(RangeFixtureGpu, gpu_single_threaded)->DenseRange(10, 100, 5);
             } else if (arg == "--type=gpu_poly") {
                 BENCHMARK_REGISTER_F(PolyFixtureGpu, gpu_poly_univariate)->DenseRange(10, 100, 10);
-            } else if (arg == "--type=cpu_encode") {
-                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_encoding);
-            } else if (arg == "--type=cpu_decode") {
-                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_decoding);
+            } else if (arg == "--type=gpu_bounded") {
+                BENCHMARK_REGISTER_F(RangeFixtureGpu, gpu_bounded)->DenseRange(10, 100, 10);
             } else if (arg == "--type=gpu_encode") {
                 BENCHMARK_REGISTER_F(RangeFixtureGpu, gpu_encoding);
             } else if (arg == "--type=gpu_decode") {
                 BENCHMARK_REGISTER_F(RangeFixtureGpu, gpu_decoding);
-            } else if (arg == "--type=cpu_encrypt") {
-                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_encryption);
-            } else if (arg == "--type=cpu_decrypt") {
-                BENCHMARK_REGISTER_F(RangeFixtureCpu, cpu_decryption);
             } else if (arg == "--type=gpu_encrypt") {
                 BENCHMARK_REGISTER_F(RangeFixtureGpu, gpu_encryption);
             } else if (arg == "--type=gpu_decrypt") {
                 BENCHMARK_REGISTER_F(RangeFixtureGpu, gpu_decryption);
             } else if (arg == "--type=test_eq") {
                 test_equivalence();
+#else
+            } else if (arg.rfind("--type=gpu", 0) == 0 || arg == "--type=test_eq") {
+                std::cout << "Built without CUDA, " << arg.substr(std::string("--type=").size()) << " is not available" << std::endl;
+                return -1;
+#endif
             }
             break;
         }
     }
     if(!has_type) {
+#ifdef HAVE_CUDA
         test_equivalence();
         return 0;
+#else
+        return test_comparisons() ? 0 : -1;
+#endif
     }
 
     benchmark::Initialize(&argc, argv);
     benchmark::RunSpecifiedBenchmarks();
 
+#ifdef HE_TRACE
+    if (!trace_path.empty()) {
+        he::trace::write_chrome_trace(trace_path);
+        he::trace::print_summary(std::cout);
+    }
+#endif
+
+#ifdef HAVE_CUDA
+    gpu_workload_cache.reset();
     troy::MemoryPool::Destroy();
+#endif
     return 0;
 }
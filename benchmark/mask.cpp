@@ -0,0 +1,108 @@
+#include "libbfv.h"
+
+namespace cpu {
+    using namespace seal;
+
+    ThresholdMask::ThresholdMask(ServerContext &bfv, Comparison method, uint64_t k, const CoefficientTable *coefficients, size_t window) :
+        bfv(bfv), method(method), k(k), coefficients(coefficients), window(window)
+    {
+        if (method == Comparison::univariate) {
+            if (coefficients == nullptr)
+                throw std::invalid_argument("ThresholdMask: the univariate comparison requires a coefficient table");
+            bfv.encryptor.encrypt(bfv.constant(k), threshold);
+        }
+        if (window > 0) {
+            if ((window & (window - 1)) != 0 || window > bfv.batch_encoder.slot_count())
+                throw std::invalid_argument("ThresholdMask: the window must be a power of two no larger than the slot count");
+            if (window > 1) {
+                auto steps = rotation_steps(window, bfv.batch_encoder.slot_count());
+                if (bfv.has_galois_keys(steps))
+                    galois_keys = &bfv.galois_keys;
+                else if (bfv.create_galois_keys(steps, generated_galois_keys))
+                    galois_keys = &generated_galois_keys;
+                else
+                    throw std::invalid_argument("ThresholdMask: the keys of the server have no Galois keys for a window of "
+                        + std::to_string(window) + " slots");
+            }
+        }
+    }
+
+    uint64_t ThresholdMask::update(const Ciphertext &aggregate, size_t users, uint64_t epoch) {
+        HE_TRACE_STAGE("threshold_mask");
+        // Compute the new mask without holding the lock
+        NoiseModel model(bfv.parms);
+        Ciphertext next;
+        switch (method) {
+            case Comparison::range:
+                lt_range_mt(bfv, aggregate, k, next, model.aggregate(users));
+                break;
+            case Comparison::range_prod:
+                lt_range_prod_mt(bfv, aggregate, k, next, model.aggregate(users));
+                break;
+            case Comparison::univariate:
+                lt_univariate(bfv, *coefficients, aggregate, threshold, next, model.aggregate(users));
+                break;
+            case Comparison::bounded:
+                // The aggregate of users binary vectors is at most users in every slot
+                lt_bounded(bfv, aggregate, k, bounded_domain(users), next, model.aggregate(users));
+                break;
+        }
+
+        // Drop as many primes as possible while a multiplication by a fresh user vector keeps a safe margin,
+        // after the sum of a compact response if they are enabled. The comparison already left the mask
+        // at the lowest level that keeps its whole budget, which may be below that one.
+        double budget = model.threshold_mask(method, users, k);
+        he::switch_to_level<SealBackend>(bfv, next, model.response_mod_switches(budget, std::max<size_t>(window, 1)));
+        size_t switches = SealBackend::level(bfv, next);
+
+        // Compact responses go down to the lowest level that still keeps the margin
+        auto context_data = bfv.context.first_context_data();
+        size_t compact_switches = model.result_mod_switches(model.response(budget, switches, std::max<size_t>(window, 1)), switches);
+        for (size_t i = 0; i < compact_switches; ++i)
+            context_data = context_data->next_context_data();
+
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        mask = std::move(next);
+        compact_parms_id = context_data->parms_id();
+        current_epoch = epoch > 0 ? epoch : current_epoch + 1;
+        return current_epoch;
+    }
+
+    uint64_t ThresholdMask::epoch() {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return current_epoch;
+    }
+
+    void ThresholdMask::respond(const Ciphertext &user, Ciphertext &result) {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        if (current_epoch == 0)
+            throw std::logic_error("ThresholdMask::respond: no mask has been computed yet!");
+
+        HE_TRACE_STAGE("respond");
+        auto pool = current_pool();
+        bfv.evaluator.mod_switch_to(user, mask.parms_id(), result, pool);
+        bfv.evaluator.multiply_inplace(result, mask, pool);
+        bfv.evaluator.relinearize_inplace(result, bfv.relin_keys, pool);
+    }
+
+    void ThresholdMask::respond_compact(const Ciphertext &user, Ciphertext &result) {
+        if (window == 0)
+            throw std::logic_error("ThresholdMask::respond_compact: compact responses are disabled, the mask has no window");
+
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        if (current_epoch == 0)
+            throw std::logic_error("ThresholdMask::respond_compact: no mask has been computed yet!");
+
+        HE_TRACE_STAGE("respond_compact");
+        auto pool = current_pool();
+        Ciphertext below;
+        bfv.evaluator.mod_switch_to(user, mask.parms_id(), result, pool);
+        bfv.evaluator.multiply(result, mask, below, pool);
+        bfv.evaluator.relinearize_inplace(below, bfv.relin_keys, pool);
+
+        // user * (1 - mask), 1 in the user's regions with at least k users
+        bfv.evaluator.sub_inplace(result, below);
+        rotate_sum(bfv, result, window, *galois_keys);
+        bfv.evaluator.mod_switch_to_inplace(result, compact_parms_id, pool);
+    }
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <shared_mutex>
+
+#include "bfv.h"
+#include "noise.h"
+#include "coefficients.h"
+
+namespace cpu {
+    /*
+        k-anonymity threshold mask shared by every user of an aggregate epoch.
+        The comparison only depends on the aggregate, so it runs once per epoch:
+        slot j of the mask is 1 if fewer than k users are in region j, 0 otherwise.
+        A user request is then answered with a single multiplication of the user's
+        location vector by the mask, which is 1 only in the user's regions with fewer
+        than k users.
+
+        The mask is switched down to the lowest level that still leaves enough noise
+        budget for that multiplication, and user vectors are switched to the same level,
+        so every response is as cheap and as small as possible.
+
+        Compact responses only tell the user the smallest of its regions with at least k users.
+        The user vector is multiplied by 1 - mask, which leaves a 1 in each of its regions with
+        at least k users, and summed over a window of slots by rotations, so that the first
+        slot of the user's country holds the number c of such regions. Regions of successive
+        administrative levels are nested, so they are the c coarsest regions of the user and
+        the smallest one is its region of rank c in vector order (none if c is 0), which the
+        client knows from its own location vector. The response is then switched down to
+        the lowest level that keeps NoiseModel::SWITCH_MARGIN_BITS of budget. The Galois keys of the rotations of the window
+        come from the keys of the server, or are generated if the context has the secret key.
+    */
+    class ThresholdMask {
+        ServerContext &bfv;
+        Comparison method;
+        uint64_t k;
+        const CoefficientTable *coefficients;
+        seal::Ciphertext threshold;     // Encryption of k, only used by the univariate comparison
+        size_t window;                  // Slots summed by a compact response, 0 if they are disabled
+        seal::GaloisKeys generated_galois_keys;
+        const seal::GaloisKeys *galois_keys = &generated_galois_keys;  // The keys of the server when they have the window
+
+        std::shared_mutex mutex;
+        seal::Ciphertext mask;
+        seal::parms_id_type compact_parms_id;   // Level of the compact responses to the current mask
+        uint64_t current_epoch = 0;
+    public:
+        /*
+            The univariate comparison needs the coefficient table, which must outlive the mask.
+            window is the SlotLayout::rotation_window of the layouts served by respond_compact, or 0
+            if only respond is used; compact responses leave the mask at a slightly higher level.
+            Throws std::invalid_argument if a server context has no Galois keys for the window.
+        */
+        ThresholdMask(ServerContext &bfv, Comparison method, uint64_t k, const CoefficientTable *coefficients = nullptr, size_t window = 0);
+
+        // Starts a new epoch from aggregate, the sum of users location vectors, and returns its number,
+        // the next one or epoch if it is given. Requests keep being answered with the previous mask
+        // while the new one is computed.
+        uint64_t update(const seal::Ciphertext &aggregate, size_t users, uint64_t epoch = 0);
+
+        // Number of the current epoch, 0 before the first update
+        uint64_t epoch();
+
+        // result = user * mask, at the level of the mask. Thread-safe.
+        void respond(const seal::Ciphertext &user, seal::Ciphertext &result);
+
+        /*
+            Compact response, the first slot of the user's country holds the number of the user's regions
+            with at least k users, at the lowest level. Throws std::logic_error if the mask has no window.
+            Thread-safe.
+        */
+        void respond_compact(const seal::Ciphertext &user, seal::Ciphertext &result);
+    };
+}
@@ -0,0 +1,232 @@
+#include "libbfv.h"
+
+#include <limits>
+
+namespace cpu {
+    using namespace seal;
+
+    NoiseModel::NoiseModel(const EncryptionParameters &parms) {
+        const auto &coeff_modulus = parms.coeff_modulus();
+        data_bits = 0;
+        for (const auto &prime : coeff_modulus)
+            data_prime_bits.push_back(std::log2(static_cast<double>(prime.value())));
+
+        // The last prime is reserved for keyswitching and never holds ciphertext data
+        if (coeff_modulus.size() > 1)
+            data_prime_bits.pop_back();
+        for (double bits : data_prime_bits)
+            data_bits += bits;
+
+        plain_modulus = parms.plain_modulus().value();
+        plain_bits = std::log2(static_cast<double>(plain_modulus));
+        degree_bits = std::log2(static_cast<double>(parms.poly_modulus_degree()));
+    }
+
+    double NoiseModel::fresh() const {
+        return data_bits - plain_bits - FRESH_NOISE_BITS;
+    }
+
+    size_t NoiseModel::max_mod_switches() const {
+        return data_prime_bits.empty() ? 0 : data_prime_bits.size() - 1;
+    }
+
+    double NoiseModel::mod_switch(double budget, size_t switches) const {
+        // SEAL drops the primes from the end of the chain
+        double bits = data_bits;
+        for (size_t i = 0; i < switches && i < max_mod_switches(); ++i)
+            bits -= data_prime_bits[data_prime_bits.size() - 1 - i];
+        return std::min(budget, bits - plain_bits - FRESH_NOISE_BITS);
+    }
+
+    size_t NoiseModel::level_floor(double budget) const {
+        const double fresh_budget = std::numeric_limits<double>::infinity();
+        size_t switches = 0;
+        while (switches < max_mod_switches() && mod_switch(fresh_budget, switches + 1) >= budget + LEVEL_SLACK_BITS)
+            ++switches;
+        return switches;
+    }
+
+    double NoiseModel::add_many(double budget, size_t count) const {
+        return count > 1 ? budget - std::log2(static_cast<double>(count)) : budget;
+    }
+
+    double NoiseModel::multiply(double a, double b) const {
+        return std::min(a, b) - plain_bits - degree_bits;
+    }
+
+    double NoiseModel::multiply_plain(double budget, int64_t value) const {
+        // Center the constant in (-t/2, t/2]
+        int64_t p = plain_modulus;
+        int64_t centered = ((value % p) + p) % p;
+        if (centered > p / 2)
+            centered -= p;
+        double magnitude = std::abs(static_cast<double>(centered));
+        return magnitude > 1 ? budget - std::log2(magnitude) : budget;
+    }
+
+    namespace {
+        // Budget of every power of plan, mirroring he::compute_powers
+        std::vector<double> power_budgets(const NoiseModel &model, const he::PowerPlan &plan, double budget) {
+            std::vector<double> budgets(plan.steps.size(), budget);
+            for (size_t i = 1; i < plan.steps.size(); ++i)
+                budgets[i] = model.multiply(budgets[plan.steps[i].a], budgets[plan.steps[i].b]);
+            return budgets;
+        }
+    }
+
+    double NoiseModel::mod_exp(double budget, uint64_t exponent) const {
+        // Mirrors the addition chain of he::mod_exp
+        if (exponent == 0)
+            return fresh();     // Encryption of 1
+        if (exponent == 1)
+            return budget;
+        return power_budgets(*this, he::plan_powers({ exponent }), budget).back();
+    }
+
+    double NoiseModel::rotate_sum(double budget, size_t window) const {
+        size_t rotations = 0;
+        for (size_t sum = 1; sum < window; sum <<= 1)
+            ++rotations;
+        return add_many(budget, window) - rotations * KEY_SWITCH_BITS;
+    }
+
+    double NoiseModel::aggregate(size_t users) const {
+        return add_many(fresh(), users);
+    }
+
+    double NoiseModel::filter(double budget) const {
+        // The aggregate is multiplied by a fresh user vector
+        return multiply(budget, fresh());
+    }
+
+    double NoiseModel::equate_plain(double budget) const {
+        // 1 - (x - y)^(p-1): plain subtraction, negation and plain addition are almost free
+        return mod_exp(budget, plain_modulus - 1);
+    }
+
+    double NoiseModel::lt_range(double budget, uint64_t k) const {
+        return add_many(equate_plain(budget), k);
+    }
+
+    double NoiseModel::lt_range_prod(double budget, uint64_t k) const {
+        // Balanced product tree of the k differences, then a single exponentiation
+        for (uint64_t factors = k; factors > 1; factors = (factors + 1) / 2)
+            budget = multiply(budget, budget);
+        return equate_plain(budget);
+    }
+
+    double NoiseModel::paterson_stockmeyer(double budget, size_t n_terms) const {
+        // Mirrors he::paterson_stockmeyer: baby steps z^j, 0 < j <= s, from the power plan,
+        // blocks of s terms with coefficients up to t/2, combined pairwise with giant steps z^(s*2^l)
+        if (n_terms == 0)
+            return fresh();
+        const auto plan = he::plan_paterson_stockmeyer(n_terms);
+        const size_t s = plan.s, v = plan.v;
+        const auto power_plan = he::plan_powers(he::paterson_stockmeyer_powers(plan));
+        const auto powers = power_budgets(*this, power_plan, budget);
+
+        double block = fresh();
+        if (s > 1) {
+            double lowest = block;
+            for (size_t j = 1; j < s; ++j)
+                lowest = std::min(lowest, powers[power_plan.index(j)]);
+            block = add_many(multiply_plain(lowest, plain_modulus / 2), s);
+        }
+
+        double polynomial = block;
+        for (unsigned int l = 0; (size_t(1) << l) < v; ++l) {
+            double giant_step = powers[power_plan.index(uint64_t(s) << l)];
+            polynomial = add_many(std::min(polynomial, multiply(polynomial, giant_step)), 2);
+        }
+        return polynomial;
+    }
+
+    double NoiseModel::lt_univariate(double budget) const {
+        // z = x - y, where y is a fresh encryption of the threshold
+        double z = std::min(budget, fresh()) - 1;
+
+        // Second term: z * g(z^2), evaluated with Paterson-Stockmeyer
+        double z2 = multiply(z, z);
+        double second_term = multiply(paterson_stockmeyer(z2, plain_modulus / 2), z);
+
+        // First term: alpha_0 * z^(p-1)
+        double first_term = multiply_plain(mod_exp(z, plain_modulus - 1), plain_modulus / 2);
+        return add_many(std::min(first_term, second_term), 2);
+    }
+
+    double NoiseModel::lt_bounded(double budget, uint64_t n_max) const {
+        // The domain must fit the plain modulus, no budget is enough otherwise
+        if (n_max >= plain_modulus)
+            return -std::numeric_limits<double>::infinity();
+        return paterson_stockmeyer(budget, n_max + 1);
+    }
+
+    double NoiseModel::pipeline(Comparison method, size_t users, uint64_t k) const {
+        return compare(method, filter(aggregate(users)), k, users);
+    }
+
+    double NoiseModel::threshold_mask(Comparison method, size_t users, uint64_t k) const {
+        return compare(method, aggregate(users), k, users);
+    }
+
+    double NoiseModel::response(double mask, size_t switches, size_t window) const {
+        return rotate_sum(multiply(mod_switch(mask, switches), mod_switch(fresh(), switches)), window);
+    }
+
+    size_t NoiseModel::response_mod_switches(double mask, size_t window) const {
+        size_t switches = max_mod_switches();
+        while (switches > 0 && response(mask, switches, window) <= SWITCH_MARGIN_BITS)
+            --switches;
+        return switches;
+    }
+
+    size_t NoiseModel::result_mod_switches(double budget, size_t switches) const {
+        while (switches < max_mod_switches() && mod_switch(budget, switches + 1) > SWITCH_MARGIN_BITS)
+            ++switches;
+        return switches;
+    }
+
+    double NoiseModel::compare(Comparison method, double budget, uint64_t k, size_t users) const {
+        switch (method) {
+            case Comparison::range:
+                return lt_range(budget, k);
+            case Comparison::range_prod:
+                return lt_range_prod(budget, k);
+            case Comparison::univariate:
+                return lt_univariate(budget);
+            case Comparison::bounded:
+                return lt_bounded(budget, bounded_domain(users));
+        }
+        return budget;
+    }
+
+    void check_noise_budget(const EncryptionParameters &parms, Comparison method, size_t users, uint64_t k) {
+        NoiseModel model(parms);
+        double predicted = model.pipeline(method, users, k);
+        if (predicted <= NoiseModel::MARGIN_BITS) {
+            std::string err_msg("check_noise_budget: predicted noise budget of " + std::to_string(predicted)
+                + " bits is not enough for " + std::to_string(users) + " users and k = " + std::to_string(k) + "!");
+            throw std::invalid_argument(err_msg);
+        }
+    }
+
+    const ParameterSet &select_parameter_set(Comparison method, size_t users, uint64_t k) {
+        for (const auto &set : PARAMETER_SETS) {
+            NoiseModel model(get_parameters(set));
+            if (model.pipeline(method, users, k) > NoiseModel::MARGIN_BITS)
+                return set;
+        }
+
+        std::string err_msg("select_parameter_set: no parameter set has enough noise budget for "
+            + std::to_string(users) + " users and k = " + std::to_string(k) + "!");
+        throw std::invalid_argument(err_msg);
+    }
+
+    void report_noise_budget([[maybe_unused]] BFVContext &bfv, [[maybe_unused]] const std::string &stage,
+        [[maybe_unused]] double predicted, [[maybe_unused]] const Ciphertext &ctx) {
+#ifdef NOISE_DEBUG
+        std::cout << "Noise budget after " << stage << ": predicted " << predicted
+            << " bits, measured " << bfv.decryptor.invariant_noise_budget(ctx) << " bits" << std::endl;
+#endif
+    }
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "bfv.h"
+
+namespace cpu {
+    // Comparison methods supported by the planner
+    enum class Comparison {
+        range,          // lt_range and lt_range_mt
+        range_prod,     // lt_range_prod and lt_range_prod_mt
+        univariate,     // lt_univariate
+        bounded         // lt_bounded, over the domain bounded_domain(users) of an aggregate of users
+    };
+
+    /*
+        Static model of the BFV invariant noise budget, computed from the encryption
+        parameters alone, so that it can be used without the secret key.
+        All budgets are expressed in bits, like Decryptor::invariant_noise_budget.
+
+        The model follows the usual heuristic bounds:
+            - a fresh encryption has log2(q) - log2(t) - FRESH_NOISE_BITS bits of budget,
+              where q only includes the primes available to ciphertexts;
+            - a ciphertext-ciphertext multiplication followed by relinearization consumes
+              about log2(t) + log2(N) bits, starting from the smaller of the two budgets;
+            - a multiplication by a constant c consumes log2(|c|) bits, with c centered mod t;
+            - a sum of n ciphertexts consumes log2(n) bits;
+            - a rotation consumes KEY_SWITCH_BITS, the key switching noise being small next to it.
+        The estimates are slightly pessimistic, so a combination that passes the check
+        may still have a few bits more than predicted.
+    */
+    class NoiseModel {
+        double data_bits;
+        std::vector<double> data_prime_bits;
+        double plain_bits;
+        double degree_bits;
+        uint64_t plain_modulus;
+    public:
+        static constexpr double FRESH_NOISE_BITS = 8.0;
+
+        // A result can only be decrypted correctly if it has more than this many bits left
+        static constexpr double MARGIN_BITS = 1.0;
+
+        // Budget the automatic switches of responses leave to them: the model is a heuristic
+        // estimate, so a level chosen from it alone keeps well clear of MARGIN_BITS
+        static constexpr double SWITCH_MARGIN_BITS = 10.0;
+
+        static constexpr double KEY_SWITCH_BITS = 1.0;
+
+        // Budget a ciphertext keeps below the fresh budget of a lower level before it is switched to it,
+        // so that the rounding noise of the switch stays negligible next to its own
+        static constexpr double LEVEL_SLACK_BITS = 2.0;
+
+        NoiseModel(const seal::EncryptionParameters &parms);
+
+        double fresh() const;
+
+        // Number of primes a ciphertext can drop by modulus switching, down to the last one
+        size_t max_mod_switches() const;
+
+        // Switching to a smaller modulus keeps the invariant noise, but the budget can not exceed
+        // the one of a fresh encryption at the new level
+        double mod_switch(double budget, size_t switches) const;
+
+        // Number of primes a ciphertext with the given budget can drop without losing any of it
+        size_t level_floor(double budget) const;
+        double add_many(double budget, size_t count) const;
+        double multiply(double a, double b) const;
+        double multiply_plain(double budget, int64_t value) const;
+        double mod_exp(double budget, uint64_t exponent) const;
+
+        // Sum of window slots by rotate_sum, log2(window) rotations and additions
+        double rotate_sum(double budget, size_t window) const;
+
+        // Pipeline stages, each taking the budget of its input
+        double aggregate(size_t users) const;
+        double filter(double budget) const;
+        double equate_plain(double budget) const;
+        double lt_range(double budget, uint64_t k) const;
+        double lt_range_prod(double budget, uint64_t k) const;
+        double paterson_stockmeyer(double budget, size_t n_terms) const;
+        double lt_univariate(double budget) const;
+        double lt_bounded(double budget, uint64_t n_max) const;
+
+        // users bounds the compared values, only the bounded comparison depends on it
+        double compare(Comparison method, double budget, uint64_t k, size_t users) const;
+
+        // Full pipeline: aggregation of users, user filter and comparison with threshold k
+        double pipeline(Comparison method, size_t users, uint64_t k) const;
+
+        // Comparison of the aggregate of users itself with threshold k, shared by every user
+        double threshold_mask(Comparison method, size_t users, uint64_t k) const;
+
+        /*
+            Product of a fresh user vector with the mask, both switched down by the given number of primes,
+            then summed over window slots for a compact response (a window of 1 is a plain response)
+        */
+        double response(double mask, size_t switches, size_t window = 1) const;
+
+        // Largest number of primes the mask can drop while the response keeps SWITCH_MARGIN_BITS
+        size_t response_mod_switches(double mask, size_t window = 1) const;
+
+        // Number of primes a result already switched down by switches can have dropped in total,
+        // while keeping SWITCH_MARGIN_BITS
+        size_t result_mod_switches(double budget, size_t switches) const;
+    };
+
+    /*
+        Throws std::invalid_argument if the comparison of an aggregate of users with
+        threshold k is predicted to run out of noise budget with the given parameters.
+        Meant to be called before any homomorphic work starts.
+    */
+    void check_noise_budget(const seal::EncryptionParameters &parms, Comparison method, size_t users, uint64_t k);
+
+    /*
+        Returns the cheapest of PARAMETER_SETS that is predicted to have enough noise budget
+        for the comparison of an aggregate of users with threshold k.
+        Throws std::invalid_argument if none of them is large enough.
+    */
+    const ParameterSet &select_parameter_set(Comparison method, size_t users, uint64_t k);
+
+    /*
+        With NOISE_DEBUG defined, prints the predicted budget of a pipeline stage next to
+        the budget measured with the secret key. Does nothing otherwise.
+    */
+    void report_noise_budget(BFVContext &bfv, const std::string &stage, double predicted, const seal::Ciphertext &ctx);
+}
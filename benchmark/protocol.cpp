@@ -0,0 +1,226 @@
+#include "protocol.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace cpu {
+    using namespace seal;
+
+    namespace {
+        struct MessageHeader {
+            uint32_t type;
+            uint32_t reserved;
+            uint64_t size;
+        };
+
+        const std::string TCP_PREFIX = "tcp:";
+
+        void write_all(int fd, const void *data, size_t size) {
+            const char *bytes = static_cast<const char *>(data);
+            while (size > 0) {
+                ssize_t written = send(fd, bytes, size, MSG_NOSIGNAL);
+                if (written < 0 && errno == EINTR)
+                    continue;
+                if (written <= 0)
+                    throw std::runtime_error(std::string("write_message: ") + std::strerror(errno));
+                bytes += written;
+                size -= written;
+            }
+        }
+
+        void read_all(int fd, void *data, size_t size) {
+            char *bytes = static_cast<char *>(data);
+            while (size > 0) {
+                ssize_t received = recv(fd, bytes, size, 0);
+                if (received < 0 && errno == EINTR)
+                    continue;
+                if (received == 0)
+                    throw std::runtime_error("read_message: connection closed");
+                if (received < 0)
+                    throw std::runtime_error(std::string("read_message: ") + std::strerror(errno));
+                bytes += received;
+                size -= received;
+            }
+        }
+
+        bool is_tcp(const std::string &address) {
+            return address.rfind(TCP_PREFIX, 0) == 0;
+        }
+
+        sockaddr_in tcp_address(const std::string &address) {
+            int port = std::stoi(address.substr(TCP_PREFIX.size()));
+            if (port <= 0 || port > 65535)
+                throw std::runtime_error("invalid port in " + address);
+            sockaddr_in addr {};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(port);
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            return addr;
+        }
+
+        sockaddr_un unix_address(const std::string &address) {
+            sockaddr_un addr {};
+            if (address.empty() || address.size() >= sizeof(addr.sun_path))
+                throw std::runtime_error("invalid socket path " + address);
+            addr.sun_family = AF_UNIX;
+            std::strncpy(addr.sun_path, address.c_str(), sizeof(addr.sun_path) - 1);
+            return addr;
+        }
+    }
+
+    void write_message(int fd, MessageType type, const void *payload, size_t size) {
+        MessageHeader header { static_cast<uint32_t>(type), 0, size };
+        write_all(fd, &header, sizeof(header));
+        write_all(fd, payload, size);
+    }
+
+    Message read_message(int fd, uint64_t max_size) {
+        MessageHeader header;
+        read_all(fd, &header, sizeof(header));
+        if (header.size > std::min(max_size, MAX_MESSAGE_SIZE))
+            throw std::runtime_error("read_message: message of " + std::to_string(header.size) + " bytes is too large");
+
+        Message message { static_cast<MessageType>(header.type), std::vector<seal_byte>(header.size) };
+        read_all(fd, message.payload.data(), message.payload.size());
+        return message;
+    }
+
+    uint64_t max_request_size(ServerContext &bfv) {
+        Ciphertext zero;
+        bfv.encryptor.encrypt_zero(zero);
+        return static_cast<uint64_t>(zero.save_size(compr_mode_type::none));
+    }
+
+    void save_ciphertext(const Ciphertext &ciphertext, std::vector<seal_byte> &buffer) {
+        buffer.resize(static_cast<size_t>(ciphertext.save_size(compr_mode_type::none)));
+        buffer.resize(static_cast<size_t>(ciphertext.save(buffer.data(), buffer.size(), compr_mode_type::none)));
+    }
+
+    int listen_socket(const std::string &address, int backlog) {
+        int fd;
+        if (is_tcp(address)) {
+            sockaddr_in addr = tcp_address(address);
+            fd = socket(AF_INET, SOCK_STREAM, 0);
+            int one = 1;
+            if (fd >= 0)
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (fd < 0 || bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+                if (fd >= 0)
+                    close(fd);
+                throw std::runtime_error("listen_socket: cannot bind " + address + ": " + std::strerror(errno));
+            }
+        } else {
+            // A socket file left behind by a previous run would make bind fail
+            sockaddr_un addr = unix_address(address);
+            unlink(address.c_str());
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd < 0 || bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+                if (fd >= 0)
+                    close(fd);
+                throw std::runtime_error("listen_socket: cannot bind " + address + ": " + std::strerror(errno));
+            }
+        }
+
+        if (listen(fd, backlog) != 0) {
+            close(fd);
+            throw std::runtime_error("listen_socket: cannot listen on " + address + ": " + std::strerror(errno));
+        }
+        return fd;
+    }
+
+    int connect_socket(const std::string &address) {
+        int fd;
+        int result;
+        if (is_tcp(address)) {
+            sockaddr_in addr = tcp_address(address);
+            fd = socket(AF_INET, SOCK_STREAM, 0);
+            int one = 1;
+            if (fd >= 0)
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            result = fd < 0 ? -1 : connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+        } else {
+            sockaddr_un addr = unix_address(address);
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            result = fd < 0 ? -1 : connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+        }
+
+        if (fd < 0 || result != 0) {
+            std::string reason = std::strerror(errno);
+            if (fd >= 0)
+                close(fd);
+            throw std::runtime_error("connect_socket: cannot connect to " + address + ": " + reason);
+        }
+        return fd;
+    }
+
+    std::vector<seal_byte> AnonymizerClient::request(MessageType type, const void *payload, size_t size) {
+        int fd = connect_socket(address);
+        Message reply;
+        try {
+            write_message(fd, type, payload, size);
+            reply = read_message(fd);
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+        close(fd);
+
+        if (reply.type == MessageType::error)
+            throw std::runtime_error("AnonymizerClient: " + std::string(reinterpret_cast<const char *>(reply.payload.data()), reply.payload.size()));
+        if (reply.type != MessageType::ok)
+            throw std::runtime_error("AnonymizerClient: unexpected reply");
+        return std::move(reply.payload);
+    }
+
+    void AnonymizerClient::get_keys(EncryptionParameters &parms, std::vector<seal_byte> &public_key) {
+        auto payload = request(MessageType::get_keys, nullptr, 0);
+        uint64_t parms_size;
+        if (payload.size() < sizeof(parms_size))
+            throw std::runtime_error("AnonymizerClient::get_keys: malformed reply");
+        std::memcpy(&parms_size, payload.data(), sizeof(parms_size));
+        if (parms_size > payload.size() - sizeof(parms_size))
+            throw std::runtime_error("AnonymizerClient::get_keys: malformed reply");
+
+        parms.load(payload.data() + sizeof(parms_size), parms_size);
+        public_key.assign(payload.begin() + sizeof(parms_size) + parms_size, payload.end());
+    }
+
+    uint64_t AnonymizerClient::submit(const Ciphertext &user) {
+        std::vector<seal_byte> buffer;
+        save_ciphertext(user, buffer);
+        auto payload = request(MessageType::submit, buffer.data(), buffer.size());
+
+        uint64_t users;
+        if (payload.size() != sizeof(users))
+            throw std::runtime_error("AnonymizerClient::submit: malformed reply");
+        std::memcpy(&users, payload.data(), sizeof(users));
+        return users;
+    }
+
+    void AnonymizerClient::query(const SEALContext &context, const Ciphertext &user, Ciphertext &result) {
+        std::vector<seal_byte> buffer;
+        save_ciphertext(user, buffer);
+        auto payload = request(MessageType::query, buffer.data(), buffer.size());
+        result.load(context, payload.data(), payload.size());
+    }
+
+    void AnonymizerClient::query_compact(const SEALContext &context, const Ciphertext &user, Ciphertext &result) {
+        std::vector<seal_byte> buffer;
+        save_ciphertext(user, buffer);
+        auto payload = request(MessageType::query_compact, buffer.data(), buffer.size());
+        result.load(context, payload.data(), payload.size());
+    }
+
+    std::string AnonymizerClient::stats() {
+        auto payload = request(MessageType::stats, nullptr, 0);
+        return std::string(reinterpret_cast<const char *>(payload.data()), payload.size());
+    }
+}
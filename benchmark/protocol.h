@@ -0,0 +1,84 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "bfv.h"
+
+namespace cpu {
+    /*
+        Wire protocol of the anonymizer service, over a Unix domain socket or loopback TCP.
+        Every message is a 16-byte header, all fields little endian:
+            type        uint32, MessageType
+            reserved    uint32, 0
+            size        uint64, payload size, at most MAX_MESSAGE_SIZE
+        followed by the payload. A connection carries a single request and its reply. Servers
+        drop requests larger than max_request_size of their parameters without reading them.
+
+        Requests and their replies:
+            get_keys        empty           -> uint64 size of the parameters, EncryptionParameters, PublicKey
+            submit          user ciphertext -> uint64 number of users aggregated so far
+            query           user ciphertext -> user * threshold mask of the current epoch
+            stats           empty           -> server counters as text
+            query_compact   user ciphertext -> ThresholdMask::respond_compact of the current epoch, the number
+                                               of the user's regions with at least k users in the first slot
+                                               of its country, at the lowest level
+        Ciphertexts are sent at the first level of the server's parameters. Replies are of
+        type ok, or error with the reason as payload.
+    */
+    enum class MessageType : uint32_t {
+        ok = 0,
+        error = 1,
+        get_keys = 2,
+        submit = 3,
+        query = 4,
+        stats = 5,
+        query_compact = 6
+    };
+
+    constexpr uint64_t MAX_MESSAGE_SIZE = uint64_t(1) << 30;
+
+    struct Message {
+        MessageType type;
+        std::vector<seal::seal_byte> payload;
+    };
+
+    // Both throw std::runtime_error if the connection fails or is closed before the end of the message
+    void write_message(int fd, MessageType type, const void *payload, size_t size);
+
+    // Also throws std::runtime_error, before allocating anything, if the payload is larger than max_size
+    Message read_message(int fd, uint64_t max_size = MAX_MESSAGE_SIZE);
+
+    // Largest request payload for the parameters of bfv, an uncompressed fresh ciphertext at the first level
+    uint64_t max_request_size(ServerContext &bfv);
+
+    // Serializes without compression, which is faster than compressing noise-like data on a local socket
+    void save_ciphertext(const seal::Ciphertext &ciphertext, std::vector<seal::seal_byte> &buffer);
+
+    /*
+        Addresses are either the path of a Unix domain socket, or tcp:<port> for a port on
+        the loopback interface. Throw std::runtime_error on failure.
+    */
+    int listen_socket(const std::string &address, int backlog);
+    int connect_socket(const std::string &address);
+
+    // Blocking client for the anonymizer service, every call opens a new connection
+    class AnonymizerClient {
+        std::string address;
+
+        // Sends a request and returns the payload of its reply, throws std::runtime_error on an error reply
+        std::vector<seal::seal_byte> request(MessageType type, const void *payload, size_t size);
+    public:
+        explicit AnonymizerClient(const std::string &address) : address(address) {}
+
+        // The public key can only be loaded once a context has been built from the parameters
+        void get_keys(seal::EncryptionParameters &parms, std::vector<seal::seal_byte> &public_key);
+
+        // Returns the number of users aggregated so far
+        uint64_t submit(const seal::Ciphertext &user);
+
+        void query(const seal::SEALContext &context, const seal::Ciphertext &user, seal::Ciphertext &result);
+        void query_compact(const seal::SEALContext &context, const seal::Ciphertext &user, seal::Ciphertext &result);
+        std::string stats();
+    };
+}
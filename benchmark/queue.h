@@ -0,0 +1,64 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace cpu {
+    /*
+        Multi-producer, multi-consumer FIFO with a fixed capacity. Producers block while the
+        queue is full, so a slow stage pushes back on the stages before it instead of letting
+        ciphertexts pile up in memory. Once closed, pushes fail and consumers drain the
+        remaining items before pop returns false.
+    */
+    template <typename T>
+    class BoundedQueue {
+        std::mutex mutex;
+        std::condition_variable not_empty;
+        std::condition_variable not_full;
+        std::deque<T> items;
+        size_t capacity;
+        bool closed = false;
+    public:
+        explicit BoundedQueue(size_t capacity) : capacity(capacity == 0 ? 1 : capacity) {}
+
+        // Blocks while the queue is full, returns false if it has been closed
+        bool push(T item) {
+            std::unique_lock<std::mutex> lock(mutex);
+            not_full.wait(lock, [&] { return closed || items.size() < capacity; });
+            if (closed)
+                return false;
+            items.push_back(std::move(item));
+            lock.unlock();
+            not_empty.notify_one();
+            return true;
+        }
+
+        // Blocks while the queue is empty, returns false once it is closed and drained
+        bool pop(T &item) {
+            std::unique_lock<std::mutex> lock(mutex);
+            not_empty.wait(lock, [&] { return closed || !items.empty(); });
+            if (items.empty())
+                return false;
+            item = std::move(items.front());
+            items.pop_front();
+            lock.unlock();
+            not_full.notify_one();
+            return true;
+        }
+
+        void close() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                closed = true;
+            }
+            not_empty.notify_all();
+            not_full.notify_all();
+        }
+
+        size_t size() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return items.size();
+        }
+    };
+}
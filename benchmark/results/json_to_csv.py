@@ -1,4 +1,5 @@
 import json
+import os
 import pandas as pd
 
 paths = [
@@ -11,17 +12,49 @@ paths = [
     'cpu_multi_threaded.json',
     'cpu_mt_range.json',
     'cpu_polynomial.json',
+    'cpu_bounded.json',
     'gpu.json',
     'gpu_range.json',
     'gpu_polynomial.json',
+    'gpu_bounded.json',
     'gpu_encode.json',
     'gpu_decode.json',
     'gpu_encrypt.json',
-    'gpu_decrypt.json'    
+    'gpu_decrypt.json',
+    'cpu_aggregate.json',
+    'cpu_ingest.json',
+    'cpu_geolocate.json',
+    'cpu_mask.json',
+    'cpu_snapshot.json',
+    'cpu_keys.json',
+    'cpu_pipeline.json'
 ]
+
+# User counters of the benchmarks, only present in the results of the benchmarks that report them
+counters = [
+    'multiplications', 'plain_multiplications', 'relinearizations', 'mod_switches', 'rotations',
+    'response_bytes', 'degree', 'peak_rss_mb', 'noise_budget', 'predicted_budget', 'items_per_second', 'bytes_per_second',
+    'ingest_s', 'aggregate_s', 'filter_s', 'threshold_s', 'decrypt_s', 'update_s', 'located'
+]
+
+def parse_arguments(name):
+    # Arguments are named (k:10/users:100/workers:8/parms:3), older results only have k (10),
+    # aggregates append their name to the last one (parms:3_mean)
+    arguments = dict()
+    for i, argument in enumerate(name.split('/')[2:]):
+        argument = argument.split('_')[0]
+        if ':' in argument:
+            key, value = argument.split(':', 1)
+            arguments[key] = value
+        elif i == 0:
+            arguments['k'] = argument
+    return pd.Series(arguments, index=['k', 'users', 'workers', 'parms'], dtype=object)
+
 jsons = list()
 
 for path in paths:
+    if not os.path.exists(path):
+        continue
     with open(path) as f:
         jsons.append(json.load(f))
 
@@ -39,7 +72,7 @@ dataset_aggr.reset_index(drop=True, inplace=True)
 
 benchmarks = dataset
 bm_name = benchmarks['name'].str.split('/').str[1]
-benchmarks['k'] = benchmarks['name'].str.split('/').str[2]
+benchmarks[['k', 'users', 'workers', 'parms']] = benchmarks['name'].apply(parse_arguments)
 name_parts = bm_name.str.split('_')
 benchmarks['device'] = name_parts.str[0]
 benchmarks['type'] = name_parts.str[1].fillna('range')
@@ -47,16 +80,18 @@ benchmarks['threading'] = 'multi'
 benchmarks.loc[benchmarks['type'] == 'single', ['threading']] = benchmarks['type']
 benchmarks.loc[benchmarks['type'] == 'single', ['type']] = 'range'
 benchmarks.loc[benchmarks['type'] == 'multi', ['type']] = 'range'
+benchmarks.loc[bm_name.str.endswith('_compact'), ['type']] = 'mask_compact'
+benchmarks['prod'] = bm_name.str.endswith('_prod')
 
 time_filter = benchmarks['time_unit'] == 'ms'
 benchmarks.loc[time_filter, ['real_time']] /= 1000
 benchmarks.loc[time_filter, ['cpu_time']] /= 1000
 benchmarks.loc[time_filter, ['time_unit']] = 's'
-benchmarks = benchmarks[['device', 'type', 'threading', 'k', 'repetitions', 'repetition_index', 'iterations', 'real_time', 'cpu_time', 'time_unit']]
+benchmarks = benchmarks.reindex(columns=['device', 'type', 'threading', 'prod', 'k', 'users', 'workers', 'parms', 'repetitions', 'repetition_index', 'iterations', 'real_time', 'cpu_time', 'time_unit'] + counters)
 
 metrics = dataset_aggr
 bm_name = metrics['name'].str.split('/').str[1]
-metrics['k'] = metrics['name'].str.split('/').str[2].str.split('_').str[0]
+metrics[['k', 'users', 'workers', 'parms']] = metrics['name'].apply(parse_arguments)
 name_parts = bm_name.str.split('_')
 metrics['device'] = name_parts.str[0]
 metrics['type'] = name_parts.str[1].fillna('range')
@@ -64,12 +99,14 @@ metrics['threading'] = 'multi'
 metrics.loc[metrics['type'] == 'single', ['threading']] = metrics['type']
 metrics.loc[metrics['type'] == 'single', ['type']] = 'range'
 metrics.loc[metrics['type'] == 'multi', ['type']] = 'range'
+metrics.loc[bm_name.str.endswith('_compact'), ['type']] = 'mask_compact'
+metrics['prod'] = bm_name.str.endswith('_prod')
 
 time_filter_m = (metrics['time_unit'] == "ms") & (metrics['aggregate_unit'] == "time")
 metrics.loc[time_filter_m, 'real_time'] /= 1000
 metrics.loc[time_filter_m, 'cpu_time'] /= 1000
 metrics.loc[metrics['time_unit'] == "ms", 'time_unit'] = 's'
-metrics = metrics[['device', 'type', 'threading', 'k', 'repetitions', 'aggregate_name', 'aggregate_unit', 'iterations', 'real_time', 'cpu_time', 'time_unit']]
+metrics = metrics.reindex(columns=['device', 'type', 'threading', 'prod', 'k', 'users', 'workers', 'parms', 'repetitions', 'aggregate_name', 'aggregate_unit', 'iterations', 'real_time', 'cpu_time', 'time_unit'] + counters)
 
 benchmarks.loc[(benchmarks['device'] == "gpu") & (benchmarks['type'] == "range"), ['tag']] = 'gpu'
 metrics.loc[(metrics['device'] == "gpu") & (metrics['type'] == "range"), ['tag']] = 'gpu'
@@ -78,8 +115,15 @@ metrics.loc[(metrics['device'] == "cpu") & (metrics['type'] == "range"), ['tag']
 benchmarks.loc[(benchmarks['type'] == "poly"), ['tag']] = benchmarks['device'] + '-' 'polynomial'
 metrics.loc[(metrics['type'] == "poly"), ['tag']] = metrics['device'] + '-' + 'polynomial'
 
-benchmarks['k'] = pd.to_numeric(benchmarks['k'], errors='coerce')
-metrics['k'] = pd.to_numeric(metrics['k'], errors='coerce')
+benchmarks.loc[(benchmarks['type'] == "bounded"), ['tag']] = benchmarks['device'] + '-' + 'bounded'
+metrics.loc[(metrics['type'] == "bounded"), ['tag']] = metrics['device'] + '-' + 'bounded'
+
+benchmarks.loc[benchmarks['prod'], ['tag']] = benchmarks['tag'] + '-prod'
+metrics.loc[metrics['prod'], ['tag']] = metrics['tag'] + '-prod'
+
+for column in ['k', 'users', 'workers', 'parms']:
+    benchmarks[column] = pd.to_numeric(benchmarks[column], errors='coerce')
+    metrics[column] = pd.to_numeric(metrics[column], errors='coerce')
 
 benchmarks.to_csv('benchmarks.csv')
 metrics.to_csv('metrics.csv')
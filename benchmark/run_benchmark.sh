@@ -16,3 +16,12 @@
 ./main.out --type=gpu_range --benchmark_out=results/gpu_range.json --benchmark_out_format=json --benchmark_time_unit=ms --benchmark_repetitions=20
 ./main.out --type=gpu_poly --benchmark_out=results/gpu_polynomial.json --benchmark_out_format=json --benchmark_time_unit=s --benchmark_repetitions=10
 ./main.out --type=poly --benchmark_out=results/cpu_polynomial.json --benchmark_out_format=json --benchmark_time_unit=s --benchmark_repetitions=10
+./main.out --type=gpu_bounded --benchmark_out=results/gpu_bounded.json --benchmark_out_format=json --benchmark_time_unit=ms --benchmark_repetitions=10
+./main.out --type=bounded --benchmark_out=results/cpu_bounded.json --benchmark_out_format=json --benchmark_time_unit=s --benchmark_repetitions=10
+./main.out --type=aggregate --benchmark_out=results/cpu_aggregate.json --benchmark_out_format=json --benchmark_time_unit=s --benchmark_repetitions=5
+./main.out --type=ingest --benchmark_out=results/cpu_ingest.json --benchmark_out_format=json --benchmark_time_unit=s --benchmark_repetitions=5
+./main.out --type=geolocate --benchmark_out=results/cpu_geolocate.json --benchmark_out_format=json --benchmark_time_unit=ms --benchmark_repetitions=5
+./main.out --type=mask --benchmark_out=results/cpu_mask.json --benchmark_out_format=json --benchmark_time_unit=ms --benchmark_repetitions=5
+./main.out --type=snapshot --benchmark_out=results/cpu_snapshot.json --benchmark_out_format=json --benchmark_time_unit=ms --benchmark_repetitions=5
+./main.out --type=keys --benchmark_out=results/cpu_keys.json --benchmark_out_format=json --benchmark_time_unit=ms --benchmark_repetitions=5
+./main.out --type=pipeline --benchmark_out=results/cpu_pipeline.json --benchmark_out_format=json --benchmark_time_unit=s --benchmark_repetitions=5
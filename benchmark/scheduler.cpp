@@ -0,0 +1,72 @@
+#include "scheduler.h"
+
+#include <cstdlib>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+namespace cpu {
+    Scheduler::Scheduler(size_t threads) : arena(static_cast<int>(threads == 0 ? 1 : threads)) {}
+
+    size_t Scheduler::threads() const {
+        return arena.max_concurrency();
+    }
+
+    Scheduler::Use::Use(Scheduler &scheduler) : scheduler(scheduler) {
+        // Either set_threads sees this caller or the caller sees the resize, both flags are sequentially consistent
+        while (true) {
+            ++scheduler.active;
+            if (!scheduler.resizing)
+                return;
+            --scheduler.active;
+            std::this_thread::yield();
+        }
+    }
+
+    void Scheduler::set_threads(size_t threads) {
+        std::lock_guard<std::mutex> lock(resize_mutex);
+        resizing = true;
+        if (active > 0) {
+            resizing = false;
+            throw std::runtime_error("Scheduler::set_threads: tasks are running in the arena");
+        }
+        arena.terminate();
+        arena.initialize(static_cast<int>(threads == 0 ? 1 : threads));
+        resizing = false;
+    }
+
+    namespace {
+        std::mutex scheduler_mutex;
+        Scheduler *global_scheduler = nullptr;
+
+        size_t default_threads() {
+            if (const char *threads = std::getenv("HE_THREADS")) {
+                size_t n = std::strtoul(threads, nullptr, 10);
+                if (n > 0)
+                    return n;
+            }
+            return std::max(1u, std::thread::hardware_concurrency());
+        }
+    }
+
+    Scheduler &scheduler() {
+        std::lock_guard<std::mutex> lock(scheduler_mutex);
+        if (global_scheduler == nullptr)
+            global_scheduler = new Scheduler(default_threads());
+        return *global_scheduler;
+    }
+
+    void set_scheduler_threads(size_t threads) {
+        std::lock_guard<std::mutex> lock(scheduler_mutex);
+        if (global_scheduler == nullptr)
+            global_scheduler = new Scheduler(threads);
+        else
+            global_scheduler->set_threads(threads);
+    }
+
+    seal::MemoryPoolHandle current_pool() {
+        thread_local seal::MemoryPoolHandle pool = seal::MemoryPoolHandle::New();
+        return pool;
+    }
+}
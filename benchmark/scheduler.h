@@ -0,0 +1,100 @@
+#pragma once
+
+#include <SEAL-4.1/seal/seal.h>
+#include <atomic>
+#include <iterator>
+#include <mutex>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/partitioner.h>
+#include <tbb/task_arena.h>
+#include <tbb/task_group.h>
+
+#include "trace.h"
+
+namespace cpu {
+    /*
+        Work-stealing scheduler for the homomorphic kernels, a TBB task arena with a fixed
+        number of workers. Every item of a parallel loop is a task of its own, since a single
+        homomorphic operation is far coarser than the scheduling overhead. Each worker runs
+        the tasks it spawns first, depth first, and only steals from other workers when it
+        runs out, so nested loops (the blocks of a Paterson-Stockmeyer evaluation, the
+        exponentiations of lt_range_mt) stay on the worker that reached them instead of
+        oversubscribing the machine with nested thread pools.
+    */
+    class Scheduler {
+        tbb::task_arena arena;
+
+        // Callers inside the arena, and whether set_threads is resizing it
+        std::atomic<size_t> active { 0 };
+        std::atomic<bool> resizing { false };
+        std::mutex resize_mutex;
+
+        // Counts a caller for its lifetime, waiting for a resize in progress to finish first
+        class Use {
+            Scheduler &scheduler;
+        public:
+            explicit Use(Scheduler &scheduler);
+            ~Use() { --scheduler.active; }
+        };
+    public:
+        explicit Scheduler(size_t threads);
+
+        size_t threads() const;
+
+        // Resizes the arena, throws std::runtime_error instead if tasks are running in it
+        void set_threads(size_t threads);
+
+        // Runs body(i) for every i in [begin, end) and returns once they are all done
+        template <typename F>
+        void parallel_for(size_t begin, size_t end, F body) {
+#ifdef HE_TRACE
+            const char *stage = he::trace::current_stage();
+#endif
+            Use use(*this);
+            arena.execute([&] {
+                tbb::parallel_for(tbb::blocked_range<size_t>(begin, end, 1), [&](const tbb::blocked_range<size_t> &range) {
+#ifdef HE_TRACE
+                    // The workers run the items in the stage of the caller
+                    he::trace::StageGuard guard(stage);
+#endif
+                    for (size_t i = range.begin(); i != range.end(); ++i)
+                        body(i);
+                }, tbb::simple_partitioner());
+            });
+        }
+
+        // Runs body(*it) for every element of a random access range
+        template <typename It, typename F>
+        void parallel_for_each(It first, It last, F body) {
+            parallel_for(0, std::distance(first, last), [&](size_t i) {
+                body(first[i]);
+            });
+        }
+
+        // Runs every function as a task and returns once they are all done
+        template <typename... F>
+        void invoke(F &&...functions) {
+            Use use(*this);
+            arena.execute([&] {
+                tbb::task_group group;
+                (group.run(std::forward<F>(functions)), ...);
+                group.wait();
+            });
+        }
+    };
+
+    /*
+        Scheduler shared by every CPU kernel, created on first use with the number of threads
+        given to set_scheduler_threads, the HE_THREADS environment variable, or one per core.
+    */
+    Scheduler &scheduler();
+    void set_scheduler_threads(size_t threads);
+
+    /*
+        Memory pool of the calling thread, for the temporaries of evaluator calls.
+        Each thread gets a pool of its own, so workers never contend on SEAL's global pool.
+        The pools are thread-safe ones: ciphertexts allocated by a task may be freed by another.
+    */
+    seal::MemoryPoolHandle current_pool();
+}
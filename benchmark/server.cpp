@@ -0,0 +1,303 @@
+#include "libbfv.h"
+
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace cpu {
+    using namespace seal;
+
+    // A client that stops sending must not hold a receive thread forever
+    constexpr int RECEIVE_TIMEOUT_S = 10;
+
+    void RequestStats::record(std::chrono::nanoseconds latency, bool ok) {
+        uint64_t ns = latency.count();
+        count.fetch_add(1, std::memory_order_relaxed);
+        if (!ok)
+            errors.fetch_add(1, std::memory_order_relaxed);
+        total_latency_ns.fetch_add(ns, std::memory_order_relaxed);
+
+        uint64_t max = max_latency_ns.load(std::memory_order_relaxed);
+        while (ns > max && !max_latency_ns.compare_exchange_weak(max, ns, std::memory_order_relaxed));
+    }
+
+    Server::Server(ServerContext &bfv, const ServerOptions &options, const CoefficientTable *coefficients) :
+        bfv(bfv), options(options), request_size_limit(max_request_size(bfv)), aggregator(bfv), mask(bfv, options.method, options.k, coefficients, options.compact_window),
+        connections(options.queue_capacity), submissions(options.queue_capacity), queries(options.queue_capacity)
+    {
+        if (options.io_threads == 0 || options.aggregate_threads == 0 || options.respond_threads == 0)
+            throw std::invalid_argument("Server: every stage needs at least one thread");
+    }
+
+    Server::~Server() {
+        stop();
+    }
+
+    void Server::start() {
+        if (running)
+            throw std::logic_error("Server::start: the server is already running");
+
+        restore();
+        listen_fd = listen_socket(options.address, static_cast<int>(options.queue_capacity));
+        running = true;
+        started = std::chrono::steady_clock::now();
+
+        accept_thread = std::thread(&Server::accept_loop, this);
+        for (size_t i = 0; i < options.io_threads; ++i)
+            receive_threads.emplace_back(&Server::receive_loop, this);
+        for (size_t i = 0; i < options.aggregate_threads; ++i)
+            stage_threads.emplace_back(&Server::aggregate_loop, this);
+        for (size_t i = 0; i < options.respond_threads; ++i)
+            stage_threads.emplace_back(&Server::respond_loop, this);
+        threshold_thread = std::thread(&Server::threshold_loop, this);
+    }
+
+    void Server::stop() {
+        if (!running.exchange(false))
+            return;
+
+        // Unblocks accept, then every stage drains its queue before the next one is closed
+        shutdown(listen_fd, SHUT_RDWR);
+        accept_thread.join();
+        close(listen_fd);
+        listen_fd = -1;
+        if (options.address.rfind("tcp:", 0) != 0)
+            unlink(options.address.c_str());
+
+        connections.close();
+        for (auto &thread : receive_threads)
+            thread.join();
+        submissions.close();
+        queries.close();
+        for (auto &thread : stage_threads)
+            thread.join();
+
+        {
+            // Taking the lock orders the notification after the threshold thread checked running
+            std::lock_guard<std::mutex> lock(threshold_mutex);
+        }
+        threshold_cv.notify_all();
+        threshold_thread.join();
+        receive_threads.clear();
+        stage_threads.clear();
+
+        // Every submission is aggregated by now, keep those of the unfinished epoch
+        if (!options.snapshot_path.empty()) {
+            Ciphertext aggregate;
+            size_t users = aggregator.snapshot(aggregate);
+            if (users != epoch_users)
+                save_snapshot(aggregate, users, mask.epoch());
+        }
+    }
+
+    void Server::restore() {
+        if (options.snapshot_path.empty() || access(options.snapshot_path.c_str(), F_OK) != 0)
+            return;
+
+        Snapshot snapshot = Snapshot::map(options.snapshot_path);
+        const SnapshotInfo &info = snapshot.info();
+        if (snapshot.size() != 1 || info.users == 0)
+            throw std::runtime_error("Server::restore: " + options.snapshot_path + " does not hold an aggregate of users");
+        if (info.parms_id != bfv.context.first_parms_id())
+            throw std::runtime_error("Server::restore: " + options.snapshot_path + " was written with different encryption parameters");
+
+        auto begin = std::chrono::steady_clock::now();
+        Ciphertext aggregate;
+        snapshot.load(bfv.context, 0, aggregate);
+        aggregator.restore(aggregate, info.users);
+        mask.update(aggregate, info.users, std::max<uint64_t>(info.epoch, 1));
+        epoch_users = info.users;
+        threshold_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+    }
+
+    void Server::save_snapshot(const Ciphertext &aggregate, size_t users, uint64_t epoch) {
+        try {
+            SnapshotWriter writer(options.snapshot_path, bfv.context, aggregate.parms_id(), epoch);
+            writer.set_users(users);
+            writer.write(aggregate);
+            writer.close();
+        } catch (const std::exception &e) {
+            std::cerr << "Server: snapshot failed: " << e.what() << std::endl;
+        }
+    }
+
+    void Server::accept_loop() {
+        while (running) {
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd < 0) {
+                if (!running)
+                    break;
+                continue;
+            }
+
+            timeval timeout { RECEIVE_TIMEOUT_S, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            if (!connections.push({ fd, std::chrono::steady_clock::now() }))
+                close(fd);
+        }
+    }
+
+    void Server::receive_loop() {
+        Connection connection;
+        while (connections.pop(connection)) {
+            Message message;
+            try {
+                message = read_message(connection.fd, request_size_limit);
+            } catch (const std::exception &e) {
+                // Nothing can be replied on a broken connection
+                close(connection.fd);
+                other_stats.record(std::chrono::steady_clock::now() - connection.accepted, false);
+                continue;
+            }
+
+            switch (message.type) {
+                case MessageType::get_keys: {
+                    std::stringstream keys;
+                    uint64_t parms_size = bfv.parms.save(keys, compr_mode_type::none);
+                    bfv.public_key.save(keys, compr_mode_type::none);
+                    std::string payload = std::string(reinterpret_cast<const char *>(&parms_size), sizeof(parms_size)) + keys.str();
+                    reply(connection, other_stats, MessageType::ok, payload.data(), payload.size());
+                    break;
+                }
+                case MessageType::stats: {
+                    std::string payload = stats();
+                    reply(connection, other_stats, MessageType::ok, payload.data(), payload.size());
+                    break;
+                }
+                case MessageType::submit:
+                case MessageType::query:
+                case MessageType::query_compact: {
+                    bool compact = message.type == MessageType::query_compact;
+                    RequestStats &stats = message.type == MessageType::submit ? submit_stats : compact ? compact_stats : query_stats;
+                    if (compact && options.compact_window == 0) {
+                        reply_error(connection, stats, "compact queries are not enabled on this server");
+                        break;
+                    }
+                    Request request { connection, Ciphertext(), compact };
+                    try {
+                        request.user.load(bfv.context, message.payload.data(), message.payload.size());
+                    } catch (const std::exception &e) {
+                        reply_error(connection, stats, std::string("invalid ciphertext: ") + e.what());
+                        break;
+                    }
+                    if (request.user.parms_id() != bfv.context.first_parms_id()) {
+                        reply_error(connection, stats, "ciphertexts must be at the first level of the server parameters");
+                        break;
+                    }
+
+                    // Blocks while the next stage is behind
+                    auto &queue = message.type == MessageType::submit ? submissions : queries;
+                    if (!queue.push(std::move(request)))
+                        reply_error(connection, stats, "the server is shutting down");
+                    break;
+                }
+                default:
+                    reply_error(connection, other_stats, "unknown request type " + std::to_string(static_cast<uint32_t>(message.type)));
+                    break;
+            }
+        }
+    }
+
+    void Server::aggregate_loop() {
+        Request request;
+        while (submissions.pop(request)) {
+            try {
+                aggregator.add(request.user);
+                uint64_t users = aggregator.count();
+                reply(request.connection, submit_stats, MessageType::ok, &users, sizeof(users));
+            } catch (const std::exception &e) {
+                reply_error(request.connection, submit_stats, e.what());
+            }
+        }
+    }
+
+    void Server::threshold_loop() {
+        // A restored aggregate already has its mask
+        size_t last_count = epoch_users;
+        std::unique_lock<std::mutex> lock(threshold_mutex);
+        while (running) {
+            threshold_cv.wait_for(lock, options.epoch_interval, [&] { return !running; });
+            if (!running)
+                break;
+
+            if (aggregator.count() == last_count)
+                continue;
+
+            // Users keep being aggregated and answered with the previous mask meanwhile,
+            // the count is the one of the users in the snapshot, later ones start the next epoch
+            auto begin = std::chrono::steady_clock::now();
+            Ciphertext aggregate;
+            size_t users = aggregator.snapshot(aggregate);
+            try {
+                uint64_t epoch = mask.update(aggregate, users);
+                epoch_users = users;
+                if (!options.snapshot_path.empty())
+                    save_snapshot(aggregate, users, epoch);
+            } catch (const std::exception &e) {
+                std::cerr << "Server: threshold mask update failed: " << e.what() << std::endl;
+            }
+            threshold_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+            last_count = users;
+        }
+    }
+
+    void Server::respond_loop() {
+        Request request;
+        std::vector<seal_byte> buffer;
+        while (queries.pop(request)) {
+            RequestStats &stats = request.compact ? compact_stats : query_stats;
+            try {
+                Ciphertext result;
+                if (request.compact)
+                    mask.respond_compact(request.user, result);
+                else
+                    mask.respond(request.user, result);
+                save_ciphertext(result, buffer);
+                reply(request.connection, stats, MessageType::ok, buffer.data(), buffer.size());
+            } catch (const std::exception &e) {
+                reply_error(request.connection, stats, e.what());
+            }
+        }
+    }
+
+    void Server::reply(const Connection &connection, RequestStats &stats, MessageType type, const void *payload, size_t size) {
+        bool ok = type == MessageType::ok;
+        try {
+            write_message(connection.fd, type, payload, size);
+        } catch (const std::runtime_error &e) {
+            ok = false;
+        }
+        close(connection.fd);
+        stats.record(std::chrono::steady_clock::now() - connection.accepted, ok);
+    }
+
+    void Server::reply_error(const Connection &connection, RequestStats &stats, const std::string &reason) {
+        reply(connection, stats, MessageType::error, reason.data(), reason.size());
+    }
+
+    std::string Server::stats() {
+        double uptime = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(3);
+        out << "uptime " << uptime << " s" << std::endl;
+        out << "epoch " << mask.epoch() << ", " << epoch_users << " users, threshold " << threshold_ns / 1e6 << " ms" << std::endl;
+
+        auto print = [&](const std::string &name, const RequestStats &stats) {
+            uint64_t count = stats.count;
+            out << name << ": " << count << " requests, " << stats.errors << " errors, "
+                << "mean " << (count > 0 ? stats.total_latency_ns / 1e6 / count : 0.0) << " ms, "
+                << "max " << stats.max_latency_ns / 1e6 << " ms, "
+                << (uptime > 0 ? count / uptime : 0.0) << " requests/s" << std::endl;
+        };
+        print("submit", submit_stats);
+        print("query", query_stats);
+        print("query_compact", compact_stats);
+        print("other", other_stats);
+
+        out << "queued: " << connections.size() << " connections, " << submissions.size() << " submissions, "
+            << queries.size() << " queries" << std::endl;
+        return out.str();
+    }
+}
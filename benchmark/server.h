@@ -0,0 +1,141 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <string>
+#include <thread>
+
+#include "bfv.h"
+#include "noise.h"
+#include "coefficients.h"
+#include "aggregator.h"
+#include "mask.h"
+#include "protocol.h"
+#include "queue.h"
+
+namespace cpu {
+    struct ServerOptions {
+        std::string address = "/tmp/anonymizer.sock";  // Unix socket path, or tcp:<port>
+        Comparison method = Comparison::range_prod;
+        uint64_t k = 10;
+
+        // Slots summed by compact queries, SlotLayout::rotation_window of the layouts, 0 disables them
+        size_t compact_window = 0;
+
+        // Thread budget of each stage
+        size_t io_threads = 2;
+        size_t aggregate_threads = 2;
+        size_t respond_threads = 4;
+
+        // Capacity of each queue between two stages
+        size_t queue_capacity = 64;
+
+        // Interval between two threshold masks, a new mask is only computed if users were added
+        std::chrono::milliseconds epoch_interval { 1000 };
+
+        // Snapshot of the aggregate, written at the end of every epoch and on stop, and resumed from on
+        // start if it exists. Empty disables it. It must be used with the same keys on every run.
+        std::string snapshot_path;
+    };
+
+    // Request count and latency of one request type, from accept to the end of the reply
+    struct RequestStats {
+        std::atomic<uint64_t> count { 0 };
+        std::atomic<uint64_t> errors { 0 };
+        std::atomic<uint64_t> total_latency_ns { 0 };
+        std::atomic<uint64_t> max_latency_ns { 0 };
+
+        void record(std::chrono::nanoseconds latency, bool ok);
+    };
+
+    /*
+        Anonymizer service, an asynchronous pipeline of stages connected by bounded queues:
+            accept      one thread, hands connections to the receive stage
+            receive     io_threads, read and deserialize requests, answer get_keys and stats
+            aggregate   aggregate_threads, add submitted users to the streaming aggregator
+            threshold   one thread, recomputes the threshold mask every epoch_interval
+            respond     respond_threads, multiply queried users by the mask and reply,
+                        with compact responses for compact queries
+        Socket I/O and deserialization overlap with homomorphic work, and a full queue
+        blocks the stage before it, so memory stays bounded under load. The threshold
+        stage runs the comparison with the parallel kernels, which use every core.
+
+        With a snapshot path, a restarted server resumes from the aggregate and user count of
+        its last snapshot, and computes their mask before accepting any connection, instead of
+        waiting for every user to submit again. Users submitted after the last snapshot are
+        lost if the server does not stop cleanly.
+    */
+    class Server {
+        struct Connection {
+            int fd = -1;
+            std::chrono::steady_clock::time_point accepted;
+        };
+
+        struct Request {
+            Connection connection;
+            seal::Ciphertext user;
+            bool compact = false;
+        };
+
+        ServerContext &bfv;
+        ServerOptions options;
+        uint64_t request_size_limit;        // max_request_size of the parameters, larger requests are dropped unread
+        Aggregator aggregator;
+        ThresholdMask mask;
+
+        BoundedQueue<Connection> connections;
+        BoundedQueue<Request> submissions;
+        BoundedQueue<Request> queries;
+
+        int listen_fd = -1;
+        std::atomic<bool> running { false };
+        std::chrono::steady_clock::time_point started;
+        std::thread accept_thread;
+        std::thread threshold_thread;
+        std::vector<std::thread> receive_threads;
+        std::vector<std::thread> stage_threads;
+        std::mutex threshold_mutex;
+        std::condition_variable threshold_cv;
+
+        RequestStats submit_stats;
+        RequestStats query_stats;
+        RequestStats compact_stats;
+        RequestStats other_stats;
+        std::atomic<uint64_t> epoch_users { 0 };
+        std::atomic<uint64_t> threshold_ns { 0 };
+
+        void accept_loop();
+        void receive_loop();
+        void aggregate_loop();
+        void threshold_loop();
+        void respond_loop();
+
+        // Resumes from the snapshot if there is one, throws std::runtime_error if it can not be used
+        void restore();
+        void save_snapshot(const seal::Ciphertext &aggregate, size_t users, uint64_t epoch);
+
+        // Writes the reply, closes the connection and records its latency
+        void reply(const Connection &connection, RequestStats &stats, MessageType type, const void *payload, size_t size);
+        void reply_error(const Connection &connection, RequestStats &stats, const std::string &reason);
+    public:
+        // The univariate comparison needs the coefficient table, which must outlive the server
+        Server(ServerContext &bfv, const ServerOptions &options, const CoefficientTable *coefficients = nullptr);
+        Server(const Server &) = delete;
+        Server &operator=(const Server &) = delete;
+        ~Server();
+
+        /*
+            Resumes from the snapshot, binds the socket and starts every stage. Throws std::runtime_error
+            if the snapshot can not be resumed from or the socket can not be bound.
+        */
+        void start();
+
+        // Stops accepting connections, returns once the requests already received are answered and
+        // the users aggregated since the last epoch are saved to the snapshot
+        void stop();
+
+        // Request counters, latencies, throughput and queue depths as text
+        std::string stats();
+    };
+}
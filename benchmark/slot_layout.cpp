@@ -0,0 +1,272 @@
+#include "slot_layout.h"
+#include "dataset.h"
+
+#include <algorithm>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+
+size_t CountrySlots::size() const {
+    return std::accumulate(level_sizes.begin(), level_sizes.end(), size_t(0));
+}
+
+SlotLayout::SlotLayout(size_t slot_count) : slots(slot_count) {
+    if (slot_count < 2 || slot_count % 2 != 0)
+        throw std::invalid_argument("SlotLayout: the slot count must be even");
+}
+
+size_t SlotLayout::used_slots() const {
+    size_t used = 0;
+    for (const auto &entry : entries)
+        used += entry.size();
+    return used;
+}
+
+bool SlotLayout::fits(size_t size) const {
+    if (size <= row_size())
+        return row_used[0] + size <= row_size() || row_used[1] + size <= row_size();
+    return size <= slots && row_used[0] == 0 && row_used[1] == 0;
+}
+
+const CountrySlots &SlotLayout::add(const std::string &name, const std::vector<uint32_t> &level_sizes) {
+    CountrySlots country { name, 0, level_sizes };
+    size_t size = country.size();
+    if (!fits(size))
+        throw std::length_error("SlotLayout::add: no room left for the " + std::to_string(size) + " regions of " + name);
+
+    // First row with enough room, countries larger than a row start at slot 0
+    if (size <= row_size()) {
+        size_t row = row_used[0] + size <= row_size() ? 0 : 1;
+        country.offset = row * row_size() + row_used[row];
+    }
+    return place(country);
+}
+
+const CountrySlots &SlotLayout::place(const CountrySlots &country) {
+    size_t size = country.size();
+    size_t end = country.offset + size;
+    if (end > slots)
+        throw std::invalid_argument("SlotLayout::place: " + country.name + " does not fit in " + std::to_string(slots) + " slots");
+    if (size > 0 && size <= row_size() && country.offset / row_size() != (end - 1) / row_size())
+        throw std::invalid_argument("SlotLayout::place: " + country.name + " crosses the boundary between the two rows");
+
+    for (const auto &entry : entries) {
+        if (entry.name == country.name)
+            throw std::invalid_argument("SlotLayout::place: " + country.name + " is already part of the layout");
+        if (country.offset < entry.offset + entry.size() && entry.offset < end)
+            throw std::invalid_argument("SlotLayout::place: " + country.name + " overlaps " + entry.name);
+    }
+
+    if (size > row_size()) {
+        row_used[0] = row_used[1] = row_size();
+    } else if (size > 0) {
+        size_t row = country.offset / row_size();
+        row_used[row] = std::max(row_used[row], end - row * row_size());
+    }
+    entries.push_back(country);
+    return entries.back();
+}
+
+const CountrySlots &SlotLayout::country(const std::string &name) const {
+    auto it = std::find_if(entries.begin(), entries.end(), [&](const CountrySlots &entry) {
+        return entry.name == name;
+    });
+    if (it == entries.end())
+        throw std::out_of_range("SlotLayout::country: " + name + " is not part of the layout");
+    return *it;
+}
+
+bool SlotLayout::contains(const std::string &name) const {
+    return std::any_of(entries.begin(), entries.end(), [&](const CountrySlots &entry) {
+        return entry.name == name;
+    });
+}
+
+void SlotLayout::pack(const std::string &name, const std::vector<uint64_t> &regions, std::vector<uint64_t> &slots) const {
+    const CountrySlots &entry = country(name);
+    if (regions.size() != entry.size())
+        throw std::invalid_argument("SlotLayout::pack: " + name + " has " + std::to_string(entry.size())
+            + " regions, got a vector of " + std::to_string(regions.size()));
+
+    if (slots.size() < this->slots)
+        slots.resize(this->slots, 0);
+    std::copy(regions.begin(), regions.end(), slots.begin() + entry.offset);
+}
+
+std::vector<uint64_t> SlotLayout::extract(const std::string &name, const std::vector<uint64_t> &slots) const {
+    const CountrySlots &entry = country(name);
+    if (slots.size() < entry.offset + entry.size())
+        throw std::invalid_argument("SlotLayout::extract: expected " + std::to_string(this->slots) + " slots, got " + std::to_string(slots.size()));
+    return std::vector<uint64_t>(slots.begin() + entry.offset, slots.begin() + entry.offset + entry.size());
+}
+
+size_t SlotLayout::rotation_window() const {
+    size_t window = 1;
+    for (const auto &entry : entries)
+        window = std::max(window, ::rotation_window(entry.size(), slots));
+    return window;
+}
+
+size_t rotation_window(size_t size, size_t slot_count) {
+    size_t window = 1;
+    while (window < size)
+        window <<= 1;
+    return window > slot_count / 2 ? slot_count : window;
+}
+
+std::vector<SlotLayout> pack_countries(size_t slot_count, std::vector<CountrySlots> countries, std::vector<std::string> *oversized) {
+    std::stable_sort(countries.begin(), countries.end(), [](const CountrySlots &a, const CountrySlots &b) {
+        return a.size() > b.size();
+    });
+
+    std::vector<SlotLayout> layouts;
+    for (const auto &country : countries) {
+        size_t size = country.size();
+        if (size == 0)
+            continue;
+        if (size > slot_count) {
+            if (oversized != nullptr)
+                oversized->push_back(country.name);
+            continue;
+        }
+
+        auto it = std::find_if(layouts.begin(), layouts.end(), [&](const SlotLayout &layout) {
+            return layout.fits(size);
+        });
+        if (it == layouts.end())
+            it = layouts.insert(layouts.end(), SlotLayout(slot_count));
+        it->add(country.name, country.level_sizes);
+    }
+    return layouts;
+}
+
+// Splits a CSV line, fields may be quoted to contain commas
+static std::vector<std::string> split_csv_line(const std::string &line) {
+    std::vector<std::string> fields(1);
+    bool quoted = false;
+    for (size_t i = 0; i < line.size(); ++i) {
+        char c = line[i];
+        if (c == '"') {
+            if (quoted && i + 1 < line.size() && line[i + 1] == '"')
+                fields.back() += line[++i];
+            else
+                quoted = !quoted;
+        } else if (c == ',' && !quoted) {
+            fields.emplace_back();
+        } else if (c != '\r') {
+            fields.back() += c;
+        }
+    }
+    return fields;
+}
+
+std::vector<CountrySlots> load_region_stats(const std::string &path) {
+    std::ifstream in(path);
+    if (!in)
+        throw std::runtime_error("load_region_stats: cannot open " + path);
+
+    std::string line;
+    std::getline(in, line);
+    auto header = split_csv_line(line);
+    auto column = [&](const std::string &name) {
+        auto it = std::find(header.begin(), header.end(), name);
+        if (it == header.end())
+            throw std::runtime_error("load_region_stats: " + path + " has no " + name + " column");
+        return size_t(it - header.begin());
+    };
+    size_t name_column = column("name"), name_en_column = column("name_en");
+    std::vector<size_t> level_columns;
+    for (size_t i = 0; i < header.size(); ++i) {
+        if (header[i].rfind("LV", 0) == 0)
+            level_columns.push_back(i);
+    }
+
+    std::vector<CountrySlots> countries;
+    while (std::getline(in, line)) {
+        if (line.empty())
+            continue;
+        auto fields = split_csv_line(line);
+        if (fields.size() != header.size())
+            throw std::runtime_error("load_region_stats: malformed line in " + path + ": " + line);
+
+        CountrySlots country;
+        country.name = fields[name_en_column].empty() ? fields[name_column] : fields[name_en_column];
+        for (size_t i : level_columns)
+            country.level_sizes.push_back(fields[i].empty() ? 0 : std::stoul(fields[i]));
+        countries.push_back(std::move(country));
+    }
+    return countries;
+}
+
+constexpr unsigned int SLOT_LAYOUT_VERSION = 1;
+
+void save_slot_layouts(const std::string &path, const std::vector<SlotLayout> &layouts) {
+    std::ofstream out(path, std::ios::trunc);
+    if (!out)
+        throw std::runtime_error("save_slot_layouts: cannot open " + path);
+
+    size_t slot_count = layouts.empty() ? 0 : layouts[0].slot_count();
+    out << "SLOTLAYOUT " << SLOT_LAYOUT_VERSION << " " << slot_count << " " << layouts.size() << "\n";
+    for (size_t i = 0; i < layouts.size(); ++i) {
+        if (layouts[i].slot_count() != slot_count)
+            throw std::invalid_argument("save_slot_layouts: every layout must have the same slot count");
+        for (const auto &country : layouts[i].countries()) {
+            out << i << "\t" << country.offset << "\t";
+            for (size_t l = 0; l < country.level_sizes.size(); ++l)
+                out << (l > 0 ? "," : "") << country.level_sizes[l];
+            out << "\t" << country.name << "\n";
+        }
+    }
+    if (!out)
+        throw std::runtime_error("save_slot_layouts: cannot write " + path);
+}
+
+std::vector<SlotLayout> load_slot_layouts(const std::string &path) {
+    std::ifstream in(path);
+    if (!in)
+        throw std::runtime_error("load_slot_layouts: cannot open " + path);
+
+    std::string magic;
+    unsigned int version;
+    size_t slot_count, count;
+    if (!(in >> magic >> version >> slot_count >> count) || magic != "SLOTLAYOUT")
+        throw std::runtime_error("load_slot_layouts: " + path + " is not a slot layout descriptor");
+    if (version != SLOT_LAYOUT_VERSION)
+        throw std::runtime_error("load_slot_layouts: " + path + " has unsupported version " + std::to_string(version));
+
+    if (count == 0)
+        return {};
+    std::vector<SlotLayout> layouts(count, SlotLayout(slot_count));
+    std::string line;
+    std::getline(in, line);
+    while (std::getline(in, line)) {
+        if (line.empty())
+            continue;
+        std::istringstream fields(line);
+        std::string index, offset, sizes;
+        CountrySlots country;
+        if (!std::getline(fields, index, '\t') || !std::getline(fields, offset, '\t')
+            || !std::getline(fields, sizes, '\t') || !std::getline(fields, country.name))
+            throw std::runtime_error("load_slot_layouts: malformed line in " + path + ": " + line);
+
+        country.offset = std::stoul(offset);
+        std::istringstream levels(sizes);
+        for (std::string size; std::getline(levels, size, ',');)
+            country.level_sizes.push_back(std::stoul(size));
+
+        size_t i = std::stoul(index);
+        if (i >= layouts.size())
+            throw std::runtime_error("load_slot_layouts: layout index out of range in " + path + ": " + line);
+        layouts[i].place(country);
+    }
+    return layouts;
+}
+
+std::vector<std::vector<uint64_t>> generate_dataset(const SlotLayout &layout, unsigned int rows) {
+    auto locations = generate_locations(layout, rows);
+    std::vector<std::vector<uint64_t>> matrix(rows);
+    for (size_t i = 0; i < rows; ++i)
+        matrix[i] = locations.dense(i);
+    return matrix;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Slots of one country in a packed ciphertext
+struct CountrySlots {
+    std::string name;
+    size_t offset = 0;                  // First slot of the country
+    std::vector<uint32_t> level_sizes;  // Number of regions of each administrative level, in vector order
+
+    // Total number of regions, which is the length of the country's location vector
+    size_t size() const;
+};
+
+/*
+    Allocation of disjoint slot ranges to several countries in the same ciphertext.
+    Batched slots form two rows of slot_count / 2, and rotations only move slots
+    within a row, so a country is always placed inside a single row. Countries larger
+    than a row can only have a layout of their own, spanning both rows.
+    Every homomorphic operation of the pipeline is slot-wise, so aggregation and
+    comparison serve all the countries of a layout at once, and empty slots stay zero.
+*/
+class SlotLayout {
+    size_t slots;
+    size_t row_used[2] = { 0, 0 };
+    std::vector<CountrySlots> entries;
+public:
+    explicit SlotLayout(size_t slot_count);
+
+    size_t slot_count() const { return slots; }
+    size_t row_size() const { return slots / 2; }
+    size_t used_slots() const;
+    const std::vector<CountrySlots> &countries() const { return entries; }
+
+    // Whether a country of the given number of regions can be added
+    bool fits(size_t size) const;
+
+    // Allocates a slot range for the country, throws std::length_error if there is no room left
+    const CountrySlots &add(const std::string &name, const std::vector<uint32_t> &level_sizes);
+
+    // Adds a country at a given offset, throws std::invalid_argument if it overlaps another one
+    const CountrySlots &place(const CountrySlots &country);
+
+    // Throws std::out_of_range if the country is not part of the layout
+    const CountrySlots &country(const std::string &name) const;
+    bool contains(const std::string &name) const;
+
+    // Writes the location vector of a country into its range of slots, which are zero-filled up
+    // to slot_count first if needed. Throws std::invalid_argument if the vector has the wrong size.
+    void pack(const std::string &name, const std::vector<uint64_t> &regions, std::vector<uint64_t> &slots) const;
+
+    // Location vector of a country, read back from its range of slots
+    std::vector<uint64_t> extract(const std::string &name, const std::vector<uint64_t> &slots) const;
+
+    // Rotation window covering every country of the layout, see rotation_window below
+    size_t rotation_window() const;
+};
+
+/*
+    Number of slots summed into the first slot of a country by a compact response: the smallest
+    power of two that covers size slots, or all of them for a country that spans both rows.
+*/
+size_t rotation_window(size_t size, size_t slot_count);
+
+/*
+    Packs the countries in as few layouts as possible, largest first, each into the first
+    layout with enough room. Countries without regions are skipped, those that do not fit
+    in a single ciphertext are skipped too and their names are appended to oversized.
+*/
+std::vector<SlotLayout> pack_countries(size_t slot_count, std::vector<CountrySlots> countries, std::vector<std::string> *oversized = nullptr);
+
+// Reads the regions per administrative level of every country from client/region_stats.csv
+std::vector<CountrySlots> load_region_stats(const std::string &path);
+
+/*
+    Layout descriptor shared with the clients, a text file with a header line
+        SLOTLAYOUT <version> <slot_count> <layout count>
+    followed by one tab-separated line per country
+        <layout index> <offset> <comma-separated level sizes> <name>
+    Throws std::runtime_error if the file can not be written or read.
+*/
+void save_slot_layouts(const std::string &path, const std::vector<SlotLayout> &layouts);
+std::vector<SlotLayout> load_slot_layouts(const std::string &path);
+
+// Dense rows of generate_locations(layout, rows)
+std::vector<std::vector<uint64_t>> generate_dataset(const SlotLayout &layout, unsigned int rows);
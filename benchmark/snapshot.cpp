@@ -0,0 +1,243 @@
+#include "libbfv.h"
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cpu {
+    using namespace seal;
+
+    namespace {
+        const char SNAPSHOT_FILE_MAGIC[8] = { 'H', 'E', 'S', 'N', 'A', 'P', 'S', 'H' };
+
+        struct SnapshotFileHeader {
+            char magic[8];
+            uint32_t version;
+            uint32_t layout_index;
+            uint64_t parms_id[4];
+            uint64_t level;
+            uint64_t epoch;
+            uint64_t layout_checksum;
+            uint64_t users;
+            uint64_t count;
+        };
+
+        struct SnapshotRecordHeader {
+            uint64_t size;
+            uint64_t checksum;
+        };
+
+        size_t padded(size_t size) {
+            return (size + 7) & ~size_t(7);
+        }
+    }
+
+    uint64_t slot_layout_checksum(const SlotLayout &layout) {
+        uint64_t hash = FNV1A_OFFSET_BASIS;
+        uint64_t slot_count = layout.slot_count();
+        hash = fnv1a(&slot_count, sizeof(slot_count), hash);
+        for (const auto &country : layout.countries()) {
+            uint64_t offset = country.offset;
+            hash = fnv1a(country.name.data(), country.name.size() + 1, hash);
+            hash = fnv1a(&offset, sizeof(offset), hash);
+            hash = fnv1a(country.level_sizes.data(), country.level_sizes.size() * sizeof(uint32_t), hash);
+        }
+        return hash;
+    }
+
+    SnapshotWriter::SnapshotWriter(const std::string &path, const SEALContext &context, const parms_id_type &parms_id,
+        uint64_t epoch, const SlotLayout *layout, uint32_t layout_index) :
+        context(context), path(path), tmp_path(path + ".tmp")
+    {
+        auto context_data = context.get_context_data(parms_id);
+        if (!context_data)
+            throw std::invalid_argument("SnapshotWriter: parms_id is not valid for the encryption parameters");
+
+        info.parms_id = parms_id;
+        info.level = context_data->chain_index();
+        info.epoch = epoch;
+        if (layout != nullptr) {
+            info.layout_index = layout_index;
+            info.layout_checksum = slot_layout_checksum(*layout);
+        }
+
+        out.open(tmp_path, std::ios::binary | std::ios::trunc);
+        if (!out)
+            throw std::runtime_error("SnapshotWriter: cannot open " + tmp_path);
+
+        // The header is written again with the final count on close
+        SnapshotFileHeader header {};
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    }
+
+    SnapshotWriter::~SnapshotWriter() {
+        if (!closed) {
+            out.close();
+            std::remove(tmp_path.c_str());
+        }
+    }
+
+    void SnapshotWriter::write(const Ciphertext &ciphertext) {
+        if (closed)
+            throw std::logic_error("SnapshotWriter::write: the snapshot is already closed");
+        if (ciphertext.parms_id() != info.parms_id)
+            throw std::invalid_argument("SnapshotWriter::write: ciphertext parms_id does not match the snapshot");
+
+        // Uncompressed, so that loading is a plain copy out of the mapping
+        buffer.resize(static_cast<size_t>(ciphertext.save_size(compr_mode_type::none)));
+        size_t size = static_cast<size_t>(ciphertext.save(buffer.data(), buffer.size(), compr_mode_type::none));
+
+        SnapshotRecordHeader record { size, fnv1a(buffer.data(), size) };
+        const char padding[8] = {};
+        out.write(reinterpret_cast<const char *>(&record), sizeof(record));
+        out.write(reinterpret_cast<const char *>(buffer.data()), size);
+        out.write(padding, padded(size) - size);
+        if (!out)
+            throw std::runtime_error("SnapshotWriter::write: cannot write " + tmp_path);
+        ++info.count;
+    }
+
+    void SnapshotWriter::close() {
+        if (closed)
+            return;
+
+        SnapshotFileHeader header {};
+        std::memcpy(header.magic, SNAPSHOT_FILE_MAGIC, sizeof(header.magic));
+        header.version = SNAPSHOT_FILE_VERSION;
+        header.layout_index = info.layout_index;
+        std::copy(info.parms_id.begin(), info.parms_id.end(), header.parms_id);
+        header.level = info.level;
+        header.epoch = info.epoch;
+        header.layout_checksum = info.layout_checksum;
+        header.users = info.users;
+        header.count = info.count;
+
+        out.seekp(0);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.close();
+        if (!out)
+            throw std::runtime_error("SnapshotWriter::close: cannot write " + tmp_path);
+        if (std::rename(tmp_path.c_str(), path.c_str()) != 0)
+            throw std::runtime_error("SnapshotWriter::close: cannot rename " + tmp_path + " to " + path);
+        closed = true;
+    }
+
+    Snapshot::Snapshot(Snapshot &&other) noexcept {
+        *this = std::move(other);
+    }
+
+    Snapshot &Snapshot::operator=(Snapshot &&other) noexcept {
+        if (this != &other) {
+            release();
+            mapping = other.mapping;
+            mapping_size = other.mapping_size;
+            header = other.header;
+            offsets = std::move(other.offsets);
+
+            other.mapping = nullptr;
+            other.mapping_size = 0;
+            other.offsets.clear();
+        }
+        return *this;
+    }
+
+    Snapshot::~Snapshot() {
+        release();
+    }
+
+    void Snapshot::release() {
+        if (mapping != nullptr)
+            munmap(mapping, mapping_size);
+        mapping = nullptr;
+        mapping_size = 0;
+        offsets.clear();
+    }
+
+    Snapshot Snapshot::map(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("Snapshot: cannot open " + path);
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(SnapshotFileHeader)) {
+            close(fd);
+            throw std::runtime_error("Snapshot: " + path + " is truncated");
+        }
+
+        size_t size = st.st_size;
+        void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+            throw std::runtime_error("Snapshot: cannot map " + path);
+
+        Snapshot snapshot;
+        snapshot.mapping = mapping;
+        snapshot.mapping_size = size;
+
+        SnapshotFileHeader header;
+        std::memcpy(&header, mapping, sizeof(header));
+        if (std::memcmp(header.magic, SNAPSHOT_FILE_MAGIC, sizeof(header.magic)) != 0)
+            throw std::runtime_error("Snapshot: " + path + " is not a snapshot file");
+        if (header.version != SNAPSHOT_FILE_VERSION)
+            throw std::runtime_error("Snapshot: " + path + " has unsupported version " + std::to_string(header.version));
+
+        std::copy(header.parms_id, header.parms_id + 4, snapshot.header.parms_id.begin());
+        snapshot.header.level = header.level;
+        snapshot.header.epoch = header.epoch;
+        snapshot.header.layout_index = header.layout_index;
+        snapshot.header.layout_checksum = header.layout_checksum;
+        snapshot.header.users = header.users;
+        snapshot.header.count = header.count;
+
+        // Index the records, their contents are only read when they are loaded
+        snapshot.offsets.reserve(header.count);
+        size_t offset = sizeof(header);
+        for (uint64_t i = 0; i < header.count; ++i) {
+            SnapshotRecordHeader record;
+            if (offset + sizeof(record) > size)
+                throw std::runtime_error("Snapshot: " + path + " is truncated");
+            std::memcpy(&record, static_cast<const char *>(mapping) + offset, sizeof(record));
+            if (record.size > size - offset - sizeof(record))
+                throw std::runtime_error("Snapshot: " + path + " is truncated");
+
+            snapshot.offsets.push_back(offset);
+            offset += sizeof(record) + padded(record.size);
+        }
+        return snapshot;
+    }
+
+    std::pair<const seal_byte *, size_t> Snapshot::record(size_t i) const {
+        if (i >= offsets.size())
+            throw std::out_of_range("Snapshot::record: index out of range");
+
+        SnapshotRecordHeader record;
+        const char *bytes = static_cast<const char *>(mapping) + offsets[i];
+        std::memcpy(&record, bytes, sizeof(record));
+        return { reinterpret_cast<const seal_byte *>(bytes + sizeof(record)), static_cast<size_t>(record.size) };
+    }
+
+    void Snapshot::load(const SEALContext &context, size_t i, Ciphertext &ciphertext) const {
+        if (!context.get_context_data(header.parms_id))
+            throw std::runtime_error("Snapshot::load: the snapshot was written with different encryption parameters");
+
+        SnapshotRecordHeader record;
+        std::memcpy(&record, static_cast<const char *>(mapping) + offsets.at(i), sizeof(record));
+        auto bytes = this->record(i);
+        if (fnv1a(bytes.first, bytes.second) != record.checksum)
+            throw std::runtime_error("Snapshot::load: record " + std::to_string(i) + " is corrupted");
+
+        ciphertext.load(context, bytes.first, bytes.second);
+    }
+
+    std::vector<Ciphertext> Snapshot::load_all(const SEALContext &context) const {
+        std::vector<Ciphertext> ciphertexts(size());
+        scheduler().parallel_for(0, ciphertexts.size(), [&](size_t i) {
+            load(context, i, ciphertexts[i]);
+        });
+        return ciphertexts;
+    }
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "bfv.h"
+#include "slot_layout.h"
+
+namespace cpu {
+    // Layout index of snapshots whose ciphertexts are not packed with a slot layout
+    constexpr uint32_t NO_LAYOUT = ~uint32_t(0);
+
+    /*
+        Snapshot file layout, all fields little endian:
+            magic               8 bytes, "HESNAPSH"
+            version             uint32
+            layout_index        uint32, index of the layout in its descriptor or NO_LAYOUT
+            parms_id            4 x uint64, shared by every ciphertext
+            level               uint64, chain index of parms_id
+            epoch               uint64
+            layout_checksum     uint64, slot_layout_checksum of the layout or 0
+            users               uint64, number of users summed into the ciphertexts, 0 if they are no aggregates
+            count               uint64, number of records
+        followed by count records, each starting on an 8-byte boundary:
+            size                uint64
+            checksum            uint64, FNV-1a of the ciphertext bytes
+            ciphertext          size bytes, Ciphertext::save without compression
+    */
+    constexpr uint32_t SNAPSHOT_FILE_VERSION = 2;
+
+    struct SnapshotInfo {
+        seal::parms_id_type parms_id;
+        uint64_t level = 0;
+        uint64_t epoch = 0;
+        uint32_t layout_index = NO_LAYOUT;
+        uint64_t layout_checksum = 0;
+        uint64_t users = 0;
+        uint64_t count = 0;
+    };
+
+    // Checksum of the countries and slot ranges of a layout, to match snapshots with their descriptor
+    uint64_t slot_layout_checksum(const SlotLayout &layout);
+
+    /*
+        Streams ciphertexts to a snapshot file. Records are written as they come, through a
+        single reusable buffer, to a temporary file that only replaces path on close(), so
+        an interrupted write never leaves a truncated snapshot behind.
+    */
+    class SnapshotWriter {
+        const seal::SEALContext &context;
+        std::string path;
+        std::string tmp_path;
+        std::ofstream out;
+        SnapshotInfo info;
+        std::vector<seal::seal_byte> buffer;
+        bool closed = false;
+    public:
+        // Snapshot of ciphertexts at parms_id, optionally packed with a slot layout
+        SnapshotWriter(const std::string &path, const seal::SEALContext &context, const seal::parms_id_type &parms_id,
+            uint64_t epoch, const SlotLayout *layout = nullptr, uint32_t layout_index = NO_LAYOUT);
+        SnapshotWriter(const SnapshotWriter &) = delete;
+        SnapshotWriter &operator=(const SnapshotWriter &) = delete;
+        ~SnapshotWriter();
+
+        // Number of users summed into the ciphertexts, written on close
+        void set_users(uint64_t users) { info.users = users; }
+
+        // Throws std::invalid_argument if the ciphertext is not at the parms_id of the snapshot
+        void write(const seal::Ciphertext &ciphertext);
+
+        // Writes the record count and moves the file in place, throws std::runtime_error on failure
+        void close();
+    };
+
+    /*
+        Read-only, memory-mapped snapshot. Opening a snapshot only validates the header and
+        indexes the records; ciphertexts are deserialized straight from the mapped pages
+        when they are loaded, after checking their checksum.
+    */
+    class Snapshot {
+        void *mapping = nullptr;
+        size_t mapping_size = 0;
+        SnapshotInfo header;
+        std::vector<size_t> offsets;
+
+        void release();
+    public:
+        Snapshot() = default;
+        Snapshot(Snapshot &&other) noexcept;
+        Snapshot &operator=(Snapshot &&other) noexcept;
+        Snapshot(const Snapshot &) = delete;
+        Snapshot &operator=(const Snapshot &) = delete;
+        ~Snapshot();
+
+        // Throws std::runtime_error if the file is missing, truncated or has an unsupported version
+        static Snapshot map(const std::string &path);
+
+        const SnapshotInfo &info() const { return header; }
+        size_t size() const { return offsets.size(); }
+
+        // Serialized bytes of record i, pointing into the mapping
+        std::pair<const seal::seal_byte *, size_t> record(size_t i) const;
+
+        // Throws std::runtime_error if the checksum of record i does not match
+        void load(const seal::SEALContext &context, size_t i, seal::Ciphertext &ciphertext) const;
+
+        // Loads every record in parallel
+        std::vector<seal::Ciphertext> load_all(const seal::SEALContext &context) const;
+    };
+}
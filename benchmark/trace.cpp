@@ -0,0 +1,174 @@
+#include "trace.h"
+
+#ifdef HE_TRACE
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+namespace he::trace {
+    namespace {
+        using Clock = std::chrono::steady_clock;
+
+        // Events kept per thread, the summary keeps counting past it
+        constexpr size_t MAX_EVENTS_PER_THREAD = size_t(1) << 20;
+
+        struct Event {
+            const char *name;
+            const char *stage;      // Enclosing stage, nullptr outside of any
+            uint64_t start;         // Nanoseconds since the start of the process
+            uint64_t duration;
+            bool is_stage;
+        };
+
+        struct Total {
+            uint64_t count = 0;
+            uint64_t nanoseconds = 0;
+        };
+
+        // Written by its own thread only, the mutex is only ever contended by an export
+        struct ThreadLog {
+            uint32_t tid;
+            std::mutex mutex;
+            std::vector<Event> events;
+            size_t dropped = 0;
+            std::map<std::pair<const char *, const char *>, Total> totals;    // (stage, op)
+        };
+
+        const Clock::time_point epoch = Clock::now();
+
+        std::mutex logs_mutex;
+        std::vector<std::unique_ptr<ThreadLog>> logs;   // Outlive their threads
+
+        uint64_t now() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - epoch).count();
+        }
+
+        ThreadLog &thread_log() {
+            thread_local ThreadLog *log = [] {
+                std::lock_guard<std::mutex> lock(logs_mutex);
+                logs.push_back(std::make_unique<ThreadLog>());
+                logs.back()->tid = logs.size();
+                return logs.back().get();
+            }();
+            return *log;
+        }
+
+        std::vector<const char *> &stage_stack() {
+            thread_local std::vector<const char *> stack;
+            return stack;
+        }
+
+        void record(const char *name, const char *stage, bool is_stage, uint64_t start, uint64_t end) {
+            ThreadLog &log = thread_log();
+            std::lock_guard<std::mutex> lock(log.mutex);
+            if (log.events.size() < MAX_EVENTS_PER_THREAD)
+                log.events.push_back({ name, stage, start, end - start, is_stage });
+            else
+                ++log.dropped;
+
+            // Stages are summed as a (stage, nullptr) entry
+            Total &total = log.totals[{ is_stage ? name : stage, is_stage ? nullptr : name }];
+            ++total.count;
+            total.nanoseconds += end - start;
+        }
+    }
+
+    Scope::Scope(const char *name, bool is_stage) : name(name), is_stage(is_stage) {
+        if (is_stage)
+            stage_stack().push_back(name);
+        start = now();
+    }
+
+    Scope::~Scope() {
+        uint64_t end = now();
+        if (is_stage)
+            stage_stack().pop_back();
+        record(name, current_stage(), is_stage, start, end);
+    }
+
+    const char *current_stage() {
+        auto &stack = stage_stack();
+        return stack.empty() ? nullptr : stack.back();
+    }
+
+    StageGuard::StageGuard(const char *stage) {
+        stage_stack().push_back(stage);
+    }
+
+    StageGuard::~StageGuard() {
+        stage_stack().pop_back();
+    }
+
+    std::vector<Summary> summary() {
+        // Identical names may have different addresses in different translation units
+        std::map<std::pair<std::string, std::string>, Total> merged;
+        {
+            std::lock_guard<std::mutex> lock(logs_mutex);
+            for (auto &log : logs) {
+                std::lock_guard<std::mutex> log_lock(log->mutex);
+                for (const auto &[key, total] : log->totals) {
+                    auto &sum = merged[{ key.first ? key.first : "(none)", key.second ? key.second : "(stage)" }];
+                    sum.count += total.count;
+                    sum.nanoseconds += total.nanoseconds;
+                }
+            }
+        }
+
+        std::vector<Summary> result;
+        for (const auto &[key, total] : merged)
+            result.push_back({ key.first, key.second, total.count, total.nanoseconds * 1e-9 });
+        std::sort(result.begin(), result.end(), [](const Summary &a, const Summary &b) {
+            return a.seconds > b.seconds;
+        });
+        return result;
+    }
+
+    void print_summary(std::ostream &out) {
+        // Stage rows are the wall time of the stage on the thread that opened it,
+        // operation rows the time summed over every thread
+        out << "stage / operation: count, total seconds" << std::endl;
+        for (const auto &row : summary())
+            out << row.stage << " / " << row.op << ": " << row.count << ", " << row.seconds << std::endl;
+    }
+
+    void write_chrome_trace(const std::string &path) {
+        std::ofstream out(path);
+        if (!out)
+            throw std::runtime_error("write_chrome_trace: cannot open " + path);
+
+        size_t dropped = 0;
+        bool first = true;
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        std::lock_guard<std::mutex> lock(logs_mutex);
+        for (auto &log : logs) {
+            std::lock_guard<std::mutex> log_lock(log->mutex);
+            dropped += log->dropped;
+            for (const auto &event : log->events) {
+                out << (first ? "\n" : ",\n") << "{\"name\":\"" << event.name << "\",\"cat\":\""
+                    << (event.is_stage ? "stage" : "op") << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << log->tid
+                    << ",\"ts\":" << event.start / 1000.0 << ",\"dur\":" << event.duration / 1000.0;
+                if (!event.is_stage && event.stage != nullptr)
+                    out << ",\"args\":{\"stage\":\"" << event.stage << "\"}";
+                out << "}";
+                first = false;
+            }
+        }
+        out << "\n],\"otherData\":{\"dropped_events\":" << dropped << "}}" << std::endl;
+    }
+
+    void reset() {
+        std::lock_guard<std::mutex> lock(logs_mutex);
+        for (auto &log : logs) {
+            std::lock_guard<std::mutex> log_lock(log->mutex);
+            log->events.clear();
+            log->dropped = 0;
+            log->totals.clear();
+        }
+    }
+}
+
+#endif
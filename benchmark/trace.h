@@ -0,0 +1,73 @@
+#pragma once
+
+/*
+    Tracing of the homomorphic operations, compiled in with -DHE_TRACE and free otherwise.
+
+    HE_TRACE_STAGE("name") opens a stage until the end of the enclosing block, and
+    HE_TRACE_OP("name") times one operation, attributed to the innermost stage open on the
+    thread. Loops of the scheduler carry the stage of the caller over to their workers.
+    Every stage and operation is recorded as a Chrome trace event (chrome://tracing, Perfetto)
+    and summed per stage and operation.
+*/
+#ifdef HE_TRACE
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace he::trace {
+    // Count and total time of an operation within a stage
+    struct Summary {
+        std::string stage;
+        std::string op;
+        uint64_t count;
+        double seconds;
+    };
+
+    class Scope {
+        const char *name;
+        bool is_stage;
+        uint64_t start;
+    public:
+        Scope(const char *name, bool is_stage);
+        ~Scope();
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+    };
+
+    // Innermost stage open on the calling thread, nullptr outside of any stage
+    const char *current_stage();
+
+    // Makes stage the innermost stage of the calling thread for its lifetime, without recording it
+    class StageGuard {
+    public:
+        explicit StageGuard(const char *stage);
+        ~StageGuard();
+        StageGuard(const StageGuard &) = delete;
+        StageGuard &operator=(const StageGuard &) = delete;
+    };
+
+    // Operations summed per stage and operation, sorted by decreasing total time
+    std::vector<Summary> summary();
+    void print_summary(std::ostream &out);
+
+    // Writes every event recorded so far in the Chrome trace event format
+    void write_chrome_trace(const std::string &path);
+
+    // Drops the events and the summary recorded so far
+    void reset();
+}
+
+#define HE_TRACE_CONCAT_(a, b) a##b
+#define HE_TRACE_CONCAT(a, b) HE_TRACE_CONCAT_(a, b)
+#define HE_TRACE_STAGE(name) ::he::trace::Scope HE_TRACE_CONCAT(he_trace_scope_, __LINE__)(name, true)
+#define HE_TRACE_OP(name) ::he::trace::Scope HE_TRACE_CONCAT(he_trace_scope_, __LINE__)(name, false)
+
+#else
+
+#define HE_TRACE_STAGE(name) ((void)0)
+#define HE_TRACE_OP(name) ((void)0)
+
+#endif
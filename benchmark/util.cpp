@@ -1,19 +1,22 @@
 #include "bfv.h"
+#include "dataset.h"
+#ifdef HAVE_CUDA
 #include "bfvcuda.h"
+#endif
 
-std::vector<std::vector<uint64_t>> generate_dataset(unsigned int rows, unsigned int cols, double chance) {
+FlatMatrix generate_dataset(unsigned int rows, unsigned int cols, double chance) {
     if (chance < 0.0 || chance > 1.0) {
         throw std::invalid_argument("chance must be between 0.0 and 1.0");
     }
 
     std::random_device rd;
-    std::vector<std::vector<uint64_t>> matrix(rows, std::vector<uint64_t>(cols, 0));
-
-    std::for_each(std::execution::par, matrix.begin(), matrix.end(), [&](std::vector<uint64_t> &row) {
+    FlatMatrix matrix(rows, cols);
+    cpu::scheduler().parallel_for(0, rows, [&](size_t i) {
         std::mt19937 gen(rd());
         std::bernoulli_distribution d(chance);
 
-        for (int j = 0; j < cols; ++j) {
+        uint64_t *row = matrix.row(i);
+        for (size_t j = 0; j < cols; ++j) {
             row[j] = d(gen);
         }
     });
@@ -22,26 +25,14 @@ std::vector<std::vector<uint64_t>> generate_dataset(unsigned int rows, unsigned
 }
 
 std::vector<std::vector<uint64_t>> generate_dataset(unsigned int rows) {
-    const auto avg_region_count = {14, 26, 189, 143, 1062, 727, 919, 35};
-    uint64_t slot_count = std::accumulate(avg_region_count.begin(), avg_region_count.end(), 0);
-
-    std::random_device rd;
-    std::vector<std::vector<uint64_t>> matrix(rows, std::vector<uint64_t>(slot_count, 0));
-
-    std::for_each(std::execution::par, matrix.begin(), matrix.end(), [&](std::vector<uint64_t> &row) {
-        std::mt19937 gen(rd());
-        auto begin = 0;
-        for (const auto& count : avg_region_count) {
-            std::uniform_int_distribution<> dis(begin, begin + count - 1);
-            row[dis(gen)] = 1;
-            begin = count;
-        }
-    });
-
+    auto locations = generate_locations(rows);
+    std::vector<std::vector<uint64_t>> matrix(rows);
+    for (size_t i = 0; i < rows; ++i)
+        matrix[i] = locations.dense(i);
     return matrix;
 }
 
-void print_vector(std::vector<uint64_t> v) {
+void print_vector(const std::vector<uint64_t> &v) {
     std::cout <<  "[ ";
     for (int i = 0; i < v.size() - 1; ++i) {
         std::cout <<  v[i] << ", ";
@@ -49,7 +40,7 @@ void print_vector(std::vector<uint64_t> v) {
     std::cout << v.back() << "] " << std::endl;
 }
 
-void print_vector(std::vector<uint64_t> v, size_t limit) {
+void print_vector(const std::vector<uint64_t> &v, size_t limit) {
     std::cout <<  "[ ";
     for (int i = 0; i < v.size() - 1 && i < limit; ++i) {
         std::cout <<  v[i] << ", ";
@@ -83,6 +74,7 @@ namespace cpu {
     }
 }
 
+#ifdef HAVE_CUDA
 namespace gpu {
     void print_plaintext(gpu::BFVContext &bfv, const troy::Plaintext &ptx) {
         std::vector<uint64_t> decoded_ptx;
@@ -114,6 +106,7 @@ namespace gpu {
         print_plaintext(bfv, ptx, limit);
     }
 }
+#endif
 
 int64_t interpret_as_signed_mod_p(uint64_t x, uint64_t p) {   
     if (x < (p - 1)/2)
@@ -0,0 +1,88 @@
+import os
+import socket
+import struct
+import subprocess
+
+# Message types of the anonymizer service, see benchmark/protocol.h
+MSG_OK = 0
+MSG_ERROR = 1
+MSG_GET_KEYS = 2
+MSG_SUBMIT = 3
+MSG_QUERY = 4
+MSG_STATS = 5
+MSG_QUERY_COMPACT = 6
+
+HEADER = struct.Struct('<IIQ')  # type, reserved, payload size
+TCP_PREFIX = 'tcp:'
+ANONYMIZER_BINARY = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'benchmark', 'anonymizer.out')
+
+
+class AnonymizerClient:
+    """Client of the anonymizer service. Ciphertexts are exchanged as SEAL-serialized bytes,
+    one request per connection, over a Unix domain socket path or tcp:<port> on localhost."""
+    address: str
+    def __init__(self, address: str = '/tmp/anonymizer.sock'):
+        self.address = address
+
+    def _connect(self) -> socket.socket:
+        if self.address.startswith(TCP_PREFIX):
+            return socket.create_connection(('127.0.0.1', int(self.address[len(TCP_PREFIX):])))
+        s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        s.connect(self.address)
+        return s
+
+    @staticmethod
+    def _read_exactly(s: socket.socket, size: int) -> bytes:
+        data = bytearray()
+        while len(data) < size:
+            chunk = s.recv(size - len(data))
+            if not chunk:
+                raise ConnectionError('connection closed by the server')
+            data += chunk
+        return bytes(data)
+
+    def _request(self, msg_type: int, payload: bytes = b'') -> bytes:
+        with self._connect() as s:
+            s.sendall(HEADER.pack(msg_type, 0, len(payload)) + payload)
+            reply_type, _, size = HEADER.unpack(self._read_exactly(s, HEADER.size))
+            reply = self._read_exactly(s, size)
+        if reply_type == MSG_ERROR:
+            raise RuntimeError(reply.decode('utf-8', errors='replace'))
+        if reply_type != MSG_OK:
+            raise RuntimeError(f'unexpected reply type {reply_type}')
+        return reply
+
+    def get_keys(self) -> tuple[bytes, bytes]:
+        """Serialized encryption parameters and public key of the server."""
+        reply = self._request(MSG_GET_KEYS)
+        (parms_size,) = struct.unpack_from('<Q', reply)
+        return reply[8:8 + parms_size], reply[8 + parms_size:]
+
+    def submit(self, ciphertext: bytes) -> int:
+        """Adds an encrypted location vector to the aggregate, returns the number of users so far."""
+        (users,) = struct.unpack('<Q', self._request(MSG_SUBMIT, ciphertext))
+        return users
+
+    def query(self, ciphertext: bytes) -> bytes:
+        """Encrypted location vector with the regions that have fewer than k users, at the mask's level."""
+        return self._request(MSG_QUERY, ciphertext)
+
+    def query_compact(self, ciphertext: bytes) -> bytes:
+        """Number of the user's regions with at least k users, in the first slot of its country, at the lowest level.
+        Decode it with SlotLayout.qualifying_regions and Country.get_smallest_qualifying_region."""
+        return self._request(MSG_QUERY_COMPACT, ciphertext)
+
+    def stats(self) -> str:
+        return self._request(MSG_STATS).decode('utf-8')
+
+
+def anonymize(slots, client_keys: str, address: str = '/tmp/anonymizer.sock', compact: bool = False,
+              binary: str = ANONYMIZER_BINARY) -> list[int]:
+    """Encrypts the slot values with a client key bundle written by anonymizer.out --write-keys, submits and
+    queries them, and returns the decrypted response. There is no SEAL binding for Python, so the
+    encryption runs in anonymizer.out --query."""
+    command = [binary, f'--query={client_keys}', f'--address={address}'] + (['--compact'] if compact else [])
+    result = subprocess.run(command, input=' '.join(str(int(v)) for v in slots), capture_output=True, text=True)
+    if result.returncode != 0:
+        raise RuntimeError(result.stderr.strip() or f'{binary} exited with status {result.returncode}')
+    return [int(v) for v in result.stdout.split()]
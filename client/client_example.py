@@ -4,6 +4,8 @@ import osm2geojson
 import argparse
 
 import overpass_downloader as od
+import slot_layout as sl
+import anonymizer_client as ac
 
 if __name__ == "__main__":
     parser = argparse.ArgumentParser(
@@ -31,6 +33,34 @@ if __name__ == "__main__":
         default=0,
         help="use a random pair of coordinates.",
     )
+    parser.add_argument(
+        "-l",
+        "--layout",
+        type=str,
+        action="store",
+        help="slot layout descriptor written by the server, used to pack the vector in its ciphertext slots.",
+    )
+    parser.add_argument(
+        "-k",
+        "--keys",
+        type=str,
+        action="store",
+        help="client key bundle written by anonymizer.out --write-keys, to query the anonymizer with the vector.",
+    )
+    parser.add_argument(
+        "-a",
+        "--address",
+        type=str,
+        action="store",
+        default="/tmp/anonymizer.sock",
+        help="address of the anonymizer, a Unix domain socket path or tcp:<port>.",
+    )
+    parser.add_argument(
+        "-c",
+        "--compact",
+        action="store_true",
+        help="ask the anonymizer for the number of qualifying regions only.",
+    )
 
     point = None
     args = parser.parse_args()
@@ -71,6 +101,25 @@ if __name__ == "__main__":
     print('List of containing regions:')
     for r in containing_regions:
         print(f'lv = {r.admin_level}, name = {r.name}')
-    
-    # TODO: Encrypt vector with BFV, exchange public key with server, send vector to server, await response
-    
\ No newline at end of file
+
+    slots = vector
+    layout = None
+    if args.layout is not None:
+        layout = sl.find_layout(sl.load_slot_layouts(args.layout), country.name)
+        slots = layout.pack(country.name, vector)
+        c = layout.country(country.name)
+        print(f'Packed in ciphertext {layout.index}, slots {c.offset} to {c.offset + c.size - 1} of {layout.slot_count}')
+
+    if args.keys is not None:
+        response = ac.anonymize(slots, args.keys, args.address, args.compact)
+        if args.compact:
+            qualifying = layout.qualifying_regions(country.name, response) if layout is not None else response[0]
+        else:
+            # The response keeps the user's regions with fewer than k users
+            regions = layout.extract(country.name, response) if layout is not None else response[:len(vector)]
+            qualifying = len(containing_regions) - int(sum(regions))
+        region = country.get_smallest_qualifying_region(vector, qualifying)
+        if region is None:
+            print('No region containing the point has at least k users')
+        else:
+            print(f'Smallest region with at least k users: lv = {region.admin_level}, name = {region.name}')
@@ -0,0 +1,222 @@
+"""
+Exports the cached countries of overpass_downloader.py to the region index of the server
+(benchmark/geoindex.h): the simplified polygons of every region, sorted along a Hilbert curve,
+under a packed R-tree. The file is memory-mapped as is, so that locating users needs neither
+Python nor a per-query R-tree.
+
+    python geoindex_exporter.py --output geoindex.bin [--tolerance 0.001] [--fanout 16]
+"""
+import argparse
+import os
+import pickle
+
+import numpy as np
+
+GEO_INDEX_MAGIC = b'HEGEOIDX'
+GEO_INDEX_VERSION = 1
+GEO_COUNTRY_LEVEL = 2
+GEO_INDEX_LEVELS = 9
+NO_SLOT = 0xFFFFFFFF
+HILBERT_ORDER = 16
+
+HEADER_DTYPE = np.dtype([
+    ('magic', 'S8'), ('version', '<u4'), ('fanout', '<u4'),
+    ('country_count', '<u8'), ('region_count', '<u8'), ('node_count', '<u8'), ('leaf_count', '<u8'),
+    ('ring_count', '<u8'), ('vertex_count', '<u8'), ('names_size', '<u8'),
+])
+COUNTRY_DTYPE = np.dtype([
+    ('name_offset', '<u8'), ('name_size', '<u4'), ('region', '<u4'),
+    ('level_sizes', '<u4', (GEO_INDEX_LEVELS,)), ('reserved', '<u4'),
+])
+REGION_DTYPE = np.dtype([
+    ('min_x', '<f8'), ('min_y', '<f8'), ('max_x', '<f8'), ('max_y', '<f8'),
+    ('country', '<u4'), ('level', '<u4'), ('slot', '<u4'),
+    ('first_ring', '<u4'), ('ring_count', '<u4'), ('reserved', '<u4'),
+])
+NODE_DTYPE = np.dtype([
+    ('min_x', '<f8'), ('min_y', '<f8'), ('max_x', '<f8'), ('max_y', '<f8'),
+    ('first_child', '<u4'), ('child_count', '<u4'),
+])
+RING_DTYPE = np.dtype([('first_vertex', '<u4'), ('vertex_count', '<u4')])
+
+
+class IndexedRegion:
+    """Rings of one region, each an (n, 2) array of longitude, latitude."""
+    country: int
+    level: int
+    slot: int
+    rings: list
+    def __init__(self, country: int, level: int, slot: int, rings: list):
+        self.country = country
+        self.level = level
+        self.slot = slot
+        self.rings = [closed(np.asarray(r, dtype=np.float64)) for r in rings if len(r) >= 3]
+
+
+def closed(ring: np.ndarray) -> np.ndarray:
+    return ring if np.array_equal(ring[0], ring[-1]) else np.vstack([ring, ring[:1]])
+
+
+def hilbert_index(x: np.ndarray, y: np.ndarray, order: int = HILBERT_ORDER) -> np.ndarray:
+    """Distance along the Hilbert curve of cells (x, y) of a 2^order grid, for whole arrays at once."""
+    x = x.astype(np.int64)
+    y = y.astype(np.int64)
+    d = np.zeros_like(x)
+    s = 1 << (order - 1)
+    while s > 0:
+        rx = (x & s) > 0
+        ry = (y & s) > 0
+        d += s * s * ((3 * rx) ^ ry)
+        # Rotate the quadrant so that the curve continues in the next one
+        flip = ~ry & rx
+        x = np.where(flip, s - 1 - x, x)
+        y = np.where(flip, s - 1 - y, y)
+        swap = ~ry
+        x, y = np.where(swap, y, x), np.where(swap, x, y)
+        x &= s - 1
+        y &= s - 1
+        s >>= 1
+    return d
+
+
+def pack_tree(boxes: np.ndarray, fanout: int):
+    """Packed R-tree over boxes (n, 4) already in Hilbert order: leaves first, the root last."""
+    nodes = []
+    level, first = boxes, 0
+    while True:
+        start = len(nodes)
+        for i in range(0, len(level), fanout):
+            children = level[i:i + fanout]
+            nodes.append((children[:, 0].min(), children[:, 1].min(), children[:, 2].max(), children[:, 3].max(),
+                          first + i, len(children)))
+        if start == 0:
+            leaf_count = len(nodes)
+        if len(nodes) - start == 1:
+            return np.array(nodes, dtype=NODE_DTYPE), leaf_count
+        # The next level is built over the nodes just appended
+        level, first = np.array([n[:4] for n in nodes[start:]]), start
+
+
+def write_geoindex(path: str, countries: list, regions: list[IndexedRegion], fanout: int = 16):
+    """
+    Writes the index of countries, a list of (name, level_sizes), and of their regions, each
+    country having exactly one region of GEO_COUNTRY_LEVEL for its outline.
+    """
+    if fanout < 2:
+        raise ValueError("The fanout must be at least 2")
+    regions = [r for r in regions if r.rings]
+    boxes = np.array([np.concatenate([np.vstack(r.rings).min(axis=0), np.vstack(r.rings).max(axis=0)])
+                      for r in regions], dtype=np.float64).reshape(-1, 4)
+
+    # Regions close to each other end up in the same leaves
+    if len(regions) > 0:
+        centers = (boxes[:, :2] + boxes[:, 2:]) / 2
+        low, high = centers.min(axis=0), centers.max(axis=0)
+        cells = (centers - low) / np.maximum(high - low, 1e-12) * ((1 << HILBERT_ORDER) - 1)
+        order = np.argsort(hilbert_index(cells[:, 0], cells[:, 1]), kind='stable')
+        regions = [regions[i] for i in order]
+        boxes = boxes[order]
+
+    region_table = np.zeros(len(regions), dtype=REGION_DTYPE)
+    rings, xs, ys = [], [], []
+    vertex_count = 0
+    outlines = dict()
+    for i, r in enumerate(regions):
+        region_table[i] = tuple(boxes[i]) + (r.country, r.level, r.slot, len(rings), len(r.rings), 0)
+        for ring in r.rings:
+            rings.append((vertex_count, len(ring)))
+            xs.append(ring[:, 0])
+            ys.append(ring[:, 1])
+            vertex_count += len(ring)
+        if r.level == GEO_COUNTRY_LEVEL:
+            outlines[r.country] = i
+
+    names = bytearray()
+    country_table = np.zeros(len(countries), dtype=COUNTRY_DTYPE)
+    for i, (name, level_sizes) in enumerate(countries):
+        if i not in outlines:
+            raise ValueError(f"{name} has no outline")
+        encoded = name.encode('utf-8')
+        sizes = list(level_sizes) + [0] * (GEO_INDEX_LEVELS - len(level_sizes))
+        country_table[i] = (len(names), len(encoded), outlines[i], sizes, 0)
+        names += encoded
+
+    if len(regions) > 0:
+        node_table, leaf_count = pack_tree(boxes, fanout)
+    else:
+        node_table, leaf_count = np.zeros(0, dtype=NODE_DTYPE), 0
+    ring_table = np.array(rings, dtype=RING_DTYPE)
+    xs = np.concatenate(xs) if xs else np.zeros(0)
+    ys = np.concatenate(ys) if ys else np.zeros(0)
+
+    header = np.array([(GEO_INDEX_MAGIC, GEO_INDEX_VERSION, fanout, len(country_table), len(region_table),
+                        len(node_table), leaf_count, len(ring_table), vertex_count, len(names))], dtype=HEADER_DTYPE)
+    tmp_path = path + '.tmp'
+    with open(tmp_path, 'wb') as file:
+        for table in (header, country_table, region_table, node_table, ring_table, xs.astype('<f8'), ys.astype('<f8')):
+            file.write(table.tobytes())
+        file.write(bytes(names))
+    os.replace(tmp_path, path)
+
+
+def polygon_rings(shape, tolerance: float) -> list:
+    """Exterior and interior rings of every polygon of a simplified shape."""
+    import shapely
+    if tolerance > 0:
+        shape = shapely.simplify(shape, tolerance, preserve_topology=True)
+    rings = []
+    for polygon in getattr(shape, 'geoms', [shape]):
+        if polygon.geom_type != 'Polygon' or polygon.is_empty:
+            continue
+        rings.append(np.asarray(polygon.exterior.coords)[:, :2])
+        rings += [np.asarray(interior.coords)[:, :2] for interior in polygon.interiors]
+    return rings
+
+
+def load_cached_countries(tolerance: float):
+    """Countries and regions of the cache of overpass_downloader.py, numbered like its location vectors."""
+    from overpass_downloader import ADMIN_LV_MIN, ADMIN_LV_MAX, COUNTRIES_FILE_PATH, Country
+
+    with open(COUNTRIES_FILE_PATH, 'rb') as file:
+        outlines = pickle.load(file)
+
+    countries, regions = [], []
+    for outline in outlines:
+        if outline.name is None:
+            continue
+        # The subregions are only known for the countries that were downloaded
+        try:
+            country = Country.deserialize(outline.name)
+        except FileNotFoundError:
+            country = outline
+        index = len(countries)
+        level_sizes = [len(country.subregions[f'lv_{l}']) for l in range(ADMIN_LV_MIN + 1, ADMIN_LV_MAX + 1)]
+        countries.append((country.name, level_sizes))
+        regions.append(IndexedRegion(index, GEO_COUNTRY_LEVEL, NO_SLOT, polygon_rings(outline.boundary(), tolerance)))
+
+        base = 0
+        for l in range(ADMIN_LV_MIN + 1, ADMIN_LV_MAX + 1):
+            for i, region in enumerate(country.subregions[f'lv_{l}']):
+                if region.includes_shape:
+                    regions.append(IndexedRegion(index, l, base + i, polygon_rings(region.boundary(), tolerance)))
+            base += len(country.subregions[f'lv_{l}'])
+
+    # A country without any ring can not be located, and would have no outline in the index
+    kept = [i for i in range(len(countries)) if any(r.country == i and r.level == GEO_COUNTRY_LEVEL and r.rings for r in regions)]
+    renumber = {old: new for new, old in enumerate(kept)}
+    regions = [r for r in regions if r.country in renumber]
+    for r in regions:
+        r.country = renumber[r.country]
+    return [countries[i] for i in kept], regions
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description="Export the cached countries to the region index of the server.")
+    parser.add_argument('--output', default='geoindex.bin')
+    parser.add_argument('--tolerance', type=float, default=0.001, help="simplification tolerance, in degrees")
+    parser.add_argument('--fanout', type=int, default=16)
+    args = parser.parse_args()
+
+    countries, regions = load_cached_countries(args.tolerance)
+    write_geoindex(args.output, countries, regions, args.fanout)
+    print(f"Wrote {len(countries)} countries and {len(regions)} regions to {args.output}")
@@ -106,6 +106,14 @@ class Country(Region):
             base_index += len(self.subregions[f'lv_{l}'])
         return regions
     
+    def get_smallest_qualifying_region(self, vector: np.ndarray, qualifying: int) -> Region | None:
+        """Smallest region of a location vector with at least k users, given the number of such regions
+        from a compact response. Regions are nested, so the qualifying ones are the coarsest."""
+        regions = self.get_regions_from_vector(vector)
+        if qualifying < 0 or qualifying > len(regions):
+            raise ValueError(f"{qualifying} qualifying regions, but the vector only has {len(regions)}")
+        return regions[qualifying - 1] if qualifying > 0 else None
+
     def geolocate_as_vector(self, point: shapely.Point):
         all_subregions = self.get_all_subregions()
         location_vector = np.array([0]*len(all_subregions), dtype=np.uint64)
@@ -0,0 +1,84 @@
+import numpy as np
+
+SLOT_LAYOUT_MAGIC = 'SLOTLAYOUT'
+SLOT_LAYOUT_VERSION = 1
+
+class CountrySlots:
+    name: str
+    offset: int
+    level_sizes: list[int]
+    def __init__(self, name: str, offset: int, level_sizes: list[int]):
+        self.name = name
+        self.offset = offset
+        self.level_sizes = level_sizes
+
+    @property
+    def size(self) -> int:
+        return sum(self.level_sizes)
+
+
+class SlotLayout:
+    """Slot ranges of the countries packed in one ciphertext, as written by the server with --write-layout."""
+    index: int
+    slot_count: int
+    countries: dict
+    def __init__(self, index: int, slot_count: int):
+        self.index = index
+        self.slot_count = slot_count
+        self.countries = dict()
+
+    def country(self, name: str) -> CountrySlots:
+        try:
+            return self.countries[name]
+        except KeyError:
+            raise KeyError(f"{name} is not part of layout {self.index}")
+
+    def pack(self, name: str, vector: np.ndarray) -> np.ndarray:
+        """Places the location vector of a country in its slots, every other slot is zero."""
+        c = self.country(name)
+        if len(vector) != c.size:
+            raise ValueError(f"{name} has {c.size} regions, got a vector of {len(vector)}")
+        slots = np.zeros(self.slot_count, dtype=np.uint64)
+        slots[c.offset:c.offset + c.size] = vector
+        return slots
+
+    def extract(self, name: str, slots: np.ndarray) -> np.ndarray:
+        """Reads the location vector of a country back from a decrypted response."""
+        c = self.country(name)
+        if len(slots) < c.offset + c.size:
+            raise ValueError(f"Expected {self.slot_count} slots, got {len(slots)}")
+        return np.asarray(slots[c.offset:c.offset + c.size], dtype=np.uint64)
+
+    def qualifying_regions(self, name: str, slots: np.ndarray) -> int:
+        """Reads the number of the user's regions with at least k users from a decrypted compact response."""
+        c = self.country(name)
+        if len(slots) <= c.offset:
+            raise ValueError(f"Expected {self.slot_count} slots, got {len(slots)}")
+        return int(slots[c.offset])
+
+
+def load_slot_layouts(path: str) -> list[SlotLayout]:
+    with open(path, encoding='utf-8') as f:
+        header = f.readline().split()
+        if len(header) != 4 or header[0] != SLOT_LAYOUT_MAGIC:
+            raise ValueError(f"{path} is not a slot layout descriptor")
+        if int(header[1]) != SLOT_LAYOUT_VERSION:
+            raise ValueError(f"{path} has unsupported version {header[1]}")
+
+        slot_count, count = int(header[2]), int(header[3])
+        layouts = [SlotLayout(i, slot_count) for i in range(count)]
+        for line in f:
+            line = line.rstrip('\n')
+            if not line:
+                continue
+            index, offset, sizes, name = line.split('\t', 3)
+            layouts[int(index)].countries[name] = CountrySlots(name, int(offset), [int(s) for s in sizes.split(',')])
+        return layouts
+
+
+def find_layout(layouts: list[SlotLayout], name: str) -> SlotLayout:
+    """Layout of the ciphertext that holds the given country."""
+    for layout in layouts:
+        if name in layout.countries:
+            return layout
+    raise KeyError(f"{name} is not part of any layout")